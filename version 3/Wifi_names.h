@@ -3,14 +3,30 @@
 #define TITLE "your location"
 #define WIFI_SSID "your SSID"
 #define WIFI_PASSWORD "your password"
+#define WIFI_AP_PASSWORD "your AP password" // not the one above, which our access point would give away
+#define WEB_PASSWORD "your web password"    // for the web pages: not the WiFi one, which everyone on it has
 
 #ifndef TITLE
    #define TITLE "pool/spa controller"
 #endif
+#ifndef WIFI_AP_SSID // our own access point, when we can't reach the one above
+   #define WIFI_AP_SSID "poolspa"
+#endif
+#ifndef WIFI_AP_PASSWORD // for our own access point: at least 8 characters, or it will be an open network
+   #error "define WIFI_AP_PASSWORD, and make it different from WIFI_PASSWORD"
+#endif
+#ifndef WEB_PASSWORD // for logging in to the web pages to push buttons
+   #error "define WEB_PASSWORD, and make it different from WIFI_PASSWORD"
+#endif
 #ifndef WIFI_PORT
    #define WIFI_PORT 80 // default TCP port number
 #endif
 
+#if 0  // publish our state to an MQTT broker?
+   #define MQTT_BROKER_URI "mqtt://192.168.86.10" // (to test with Mosquitto on a PC, run "mosquitto -v"
+   #define MQTT_TOPIC "poolspa"                   //  and watch with: mosquitto_sub -v -t "poolspa/#")
+#endif
+
 #if 0  // use static IP address?
    #define WIFI_IPADDR      192,168,86,123
    #define WIFI_GATEWAYADDR 192,168,86,1
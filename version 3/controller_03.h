@@ -3,6 +3,7 @@
 //----------------------------------------------------
 
 #include <stdint.h>
+#include <stdarg.h>
 typedef unsigned char byte;
 #define stringify(x) stringifier(x)  // for turning #defined macros into strings
 #define stringifier(x) #x
@@ -104,7 +105,56 @@ enum  global_mode_t {  // current global mode: "mode"
    MODE_FILL_SPA,
    MODE_EMPTY_SPA,
    MODE_FILTER_POOL,
-   MODE_FILTER_SPA };
+   MODE_FILTER_SPA,
+   NUM_MODES };
+
+// the events we log (here so that the mode table in modes.h can use them)
+
+enum event_t {    // event types
+   EV_BAD,              // (to catch uninitialized log entries)
+   EV_STARTUP,          // we started from power up
+   EV_WATCHDOG_RESET,   // we were reset by watchdog timer
+   EV_ASSERTION_FAILED, // assertion failed
+   EV_CLOCK_BAD,        // can't find realtime clock
+   EV_TEMPSENSOR_BAD,   // can't find temperature sensor
+   EV_INIT_CONFIG,      // initialized the config data
+   EV_UPDATED_CONFIG,   // updated the configuration data
+   EV_IDLE,             // entered these various modes...
+   EV_HEAT_SPA,
+   EV_HEAT_POOL,
+   EV_FILL_SPA,
+   EV_EMPTY_SPA,
+   EV_FILTER_POOL,
+   EV_FILTER_SPA,
+   EV_INTERLOCK,        // rejected a relay change that violated an interlock
+   EV_MODE_RESUMED,     // resumed the mode we were in before a watchdog reset
+   EV_BOOT_PROFILE,     // how long the phases of startup took
+   EV_DAILY_ROLLUP,     // totals for the day that just ended
+   EV_TEMP_READINGS_BAD,// the temperature sensor stopped giving good readings
+   EV_NUM_EVENTS };
+
+enum ui_state_t {  // which menu is showing: "ui_state"
+   UI_NONE,        // none; the buttons are for the modes
+   UI_MENU,        // asking yes or no for one of the menu commands
+   UI_EVENTLOG,    // browsing the event log
+   UI_WIFI_INFO,   // showing the WiFi statistics
+   UI_WIFI_RSSI,   // showing the WiFi signal strength
+   UI_CONFIG,      // changing one of the configuration settings
+   UI_WATER_LEVEL, // asking whether to fill or empty the spa
+   UI_MESSAGE };   // showing a message for a while
+
+enum lcd_msg_t {        // the messages the display compositor shows, by row
+   LCD_TITLE,           // 0: our name, taking turns with...
+   LCD_CLOCK,           //    the current time
+   LCD_CHANGING,        //    "changing mode"
+   LCD_IP_LABEL,        //    "IP address", when we first connect
+   LCD_MODE,            // 1: the current mode
+   LCD_HEATER_DISABLED, //    "heater disabled!", for a while
+   LCD_IP_ADDRESS,      //    our IP address, when we first connect
+   LCD_TIME_LEFT,       // 2: the time left in the current mode
+   LCD_STEP,            //    the progress of an equipment change
+   LCD_TEMP,            // 3: the temperature while heating
+   NUM_LCD_MSGS };
 
 enum heater_t {  // current heater setting: "heater_mode"
    HEATING_NONE,
@@ -123,6 +173,82 @@ enum pump_status_t { // current pump status: "pump_status"
    PUMP_SPA,
    PUMP_POOL };
 
+struct plant_t { // the state of the equipment: "the plant"
+   enum vconfig_t valves;
+   enum pump_status_t pump;
+   enum heater_t heater;
+   bool spa_jets, pool_light; };
+
+enum actuation_t { // the steps for changing the plant from one state to another
+   ACT_SPA_JETS,       // turn the spa jets on or off
+   ACT_POOL_LIGHT,     // turn the pool light on or off
+   ACT_HEATER_OFF,     // turn the heater off, which starts its cooldown if it was burning
+   ACT_WAIT_COOLDOWN,  // wait for the heater to cool down, which needs the pump running
+   ACT_PUMP_OFF,       // turn both pumps off
+   ACT_VALVES,         // move the valves
+   ACT_PUMP_ON,        // turn on one pump
+   ACT_HEATER_ON };    // start heating the spa or pool
+
+struct plan_step_t { // one step of a plan
+   enum actuation_t action;
+   byte arg;           // the new setting
+   byte settle_secs; };// how long to wait afterwards
+#define MAX_PLAN_STEPS 8
+
+// state that survives a reset, checkpointed in RTC memory and the FLASH config partition
+
+#define CHECKPOINT_MAGIC 0x32504B43 // "CKP2"
+#define CHECKPOINT_SIZE 32          // bytes; FLASH is written in slots of this size
+struct checkpoint_t {
+   uint32_t magic;
+   // what is written to FLASH whenever it changes
+   byte valve_config;        // last valve configuration, or VALVES_UNDEFINED while moving
+   byte pump;                // pump_status
+   byte mode;                // the global mode
+   byte flags;               // CKP_xxx
+   // what changes too often for FLASH, so is only current in RTC memory
+   int16_t target_temp;      // tenths of a degree F
+   byte heater_on;
+   byte heater_cooldown_secs;
+   uint16_t mode_timer;      // minutes left in the mode
+   uint16_t spa_jets_timer;  // minutes left for the spa jets
+   uint16_t light_timer;     // minutes left for the pool light
+   byte spare[CHECKPOINT_SIZE - 22];
+   uint32_t checksum; };     // of everything before it
+#define CKP_SPA_JETS 0x01
+#define CKP_POOL_LIGHT 0x02
+#define CKP_FILTER_AUTOSTARTED 0x04
+
+// the configuration data in the FLASH config partition
+
+struct config_t {
+   char hdr_id[6]; // "SMLnn" // unique header ID w/ version number
+   byte filter_pool_mins;     // how many minutes to filter pool
+   byte filter_spa_mins;      // how many minutes to filter spa
+   byte filter_start_hour;    // what hour 1-12 to start filtering each day
+   byte filter_start_ampm;    // whether AM or PM, 0=am, 1=pm
+   byte heater_allowed;       // whether heater is allowed to be used
+   byte wifi_power_save;      // WiFi modem sleep: 0=none, 1=minimum, 2=maximum
+   byte wifi_tx_power;        // WiFi transmit power in dBm
+   byte wifi_listen_interval; // beacons between wakeups in maximum modem sleep
+   // We could add the last set spa and pool temperatures, I suppose.
+   // But that might just be confusing when there are multiple pool/spa users.
+};
+enum config_field_num_t { // the fields that can be changed, in config_fields[] order
+   CF_FILTER_POOL_MINS, CF_FILTER_SPA_MINS, CF_FILTER_START_HOUR, CF_FILTER_START_AMPM,
+   CF_HEATER_ALLOWED, CF_WIFI_POWER_SAVE, CF_WIFI_TX_POWER, CF_WIFI_LISTEN_INTERVAL,
+   NUM_CONFIG_FIELDS };
+struct config_field_t {
+   const char *name;  // as in the web form and JSON
+   byte offset;       // in config_t
+   byte min, max; };  // the limits, for both the LCD and the web
+#define CONFIG_LIMITS(f) config_fields[f].min, config_fields[f].max
+extern const struct config_field_t config_fields[NUM_CONFIG_FIELDS];
+extern struct config_t config_data;
+extern struct config_t config_webpending;  // a validated change from the web,
+extern uint16_t config_webfields;          // which of config_fields[] it sets,
+extern volatile bool config_webchanged;    // and that the controller hasn't applied yet
+
 // temperature history stuff
 
 #define TEMPHIST_DELTA_MINS 1     // how many minutes between entries
@@ -130,10 +256,55 @@ enum pump_status_t { // current pump status: "pump_status"
 #define TEMPHIST_ENTRIES (TEMPHIST_TOTAL_HOURS*60/TEMPHIST_DELTA_MINS) // how many entries to record
 struct temphist_t {
   struct datetime timestamp;
-  #define temphist_temp timestamp.day // save space: put temp where day (Mon-Sun) is
-  // write it to a CSV file as "yyyy-mm-dd hh:mm:ss, temp"
+  int16_t temp;  // tenths of a degree F, filtered
+  int16_t raw;   // the last sensor reading, for diagnosis
+  // write it to a CSV file as "yyyy-mm-dd hh:mm:ss, temp, raw"
 };
 
+// long-term archives of temperatures and runtimes, in the FLASH "archive" partition
+
+enum archive_level_t {
+   ARCHIVE_5MIN, ARCHIVE_HOUR, ARCHIVE_DAY,
+   NUM_ARCHIVES };
+#define ARCHIVE_NO_TEMP 0x7fff  // for temperatures: there weren't any
+struct archive_rec_t { // one period, while it accumulates and when it's read back
+   uint32_t start_min;     // minutes since 1 Jan 2000 when the period started
+   int16_t temp_min, temp_avg, temp_max; // tenths of a degree F
+   uint16_t temp_samples;  // how many minutes had a temperature
+   uint16_t pool_pump_mins, spa_pump_mins, heater_mins;
+   uint16_t minutes;       // how many minutes were sampled (not in FLASH)
+   int32_t temp_sum; };    // (not in FLASH)
+struct archive_small_t { // how the 5-minute and hourly archives are in FLASH
+   uint32_t start_min;
+   int16_t temp_min, temp_avg, temp_max;
+   byte temp_samples, pool_pump_mins, spa_pump_mins, heater_mins;
+   uint16_t checksum; };
+struct archive_large_t { // how the daily archive is in FLASH
+   uint32_t start_min;
+   int16_t temp_min, temp_avg, temp_max;
+   uint16_t temp_samples, pool_pump_mins, spa_pump_mins, heater_mins;
+   byte spare[12];
+   uint16_t checksum; };
+
+// MQTT telemetry: the controller queues these messages, and the webserver task publishes them
+
+enum mqtt_kind_t {
+   MQTT_STATE,       // something changed
+   MQTT_TELEMETRY }; // periodic
+struct mqtt_state_t { // what we publish about the controller
+   byte mode, heater_mode, heater_on, pump, valves, spa_jets, pool_light;
+   byte temp_valid;
+   int16_t temp, target_temp; // tenths of a degree F
+   uint16_t relays; };
+struct mqtt_msg_t {
+   uint32_t seqnum;        // increases by one for each message queued
+   uint32_t uptime_secs;
+   struct datetime time;
+   byte kind;
+   struct mqtt_state_t state;
+   const char *mode_name;
+   int web_requests; };
+
 // Timing parameters
 
 #if DEBUG_TIMES
@@ -152,6 +323,10 @@ struct temphist_t {
 #define FILTER_START_HOUR 01     // clock hour to start filter, by default
 #define FILTER_START_AMPM AM     // 
 
+#define WIFI_POWER_SAVE 0        // WiFi modem sleep: 0=none, 1=minimum, 2=maximum, by default
+#define WIFI_TX_POWER 20         // WiFi transmit power in dBm, by default
+#define WIFI_LISTEN_INTERVAL 3   // beacons between wakeups in maximum modem sleep, by default
+
 #define MODE_SPA_TIMEOUT 3*60    // minutes before spa turns off
 #define MODE_POOL_TIMEOUT 24*60  // minutes before pool turns off
 #define MODE_FILL_TIMEOUT 5      // minutes before spa fill turns off
@@ -162,20 +337,71 @@ struct temphist_t {
 
 #define DEBOUNCE_DELAY 50        // milliseconds for debounce delay
 
+// temperatures are kept as int16_t tenths of a degree Fahrenheit, and are only
+// converted to the units we show when they are formatted
+
+#define TEMP_CELSIUS false       // show temperatures in Celsius instead of Fahrenheit?
+#if TEMP_CELSIUS
+   #define TEMP_UNIT "C"
+#else
+   #define TEMP_UNIT "F"
+#endif
+#define DEGREES(deg) ((deg) * 10) // whole degrees F in tenths
+
+struct temp_filter_t {  // what we know about a sensor's recent readings
+   int16_t window[3];   // the last three good readings, for the median
+   byte count, next;    // how many are in the window, and where the next one goes
+   byte bad_in_row;     // how many readings were dropped since the last good one
+   bool valid;          // whether "filtered" is usable
+   int32_t ema_sum;     // TEMP_EMA_N times the moving average
+   int16_t raw, filtered;
+   uint32_t crc_errors, implausible, rate_limited; }; // (not cleared by a reset)
+
 // temperature limits
 
-#define TEMP_MIN 60
-#define TEMP_MAX_POOL 92
-#define TEMP_MAX_SPA 105
+#define TEMP_MIN DEGREES(60)
+#define TEMP_MAX_POOL DEGREES(92)
+#define TEMP_MAX_SPA DEGREES(105)
+
+// the bulk export from /export.bin, which tools/poolspa_export.c decodes
+
+#define EXPORT_MAGIC "PSCX"
+#define EXPORT_VERSION 2  // 2: temphist_t has tenths of a degree after the time
+
+// the phases of startup that we time for the boot profile
+
+enum boot_phase_t {
+   BOOT_LCD, BOOT_LOG, BOOT_CONFIG, BOOT_CLOCK, BOOT_TEMPSENSOR,
+   NUM_BOOT_PHASES };
+
+// binary trace records for dprint() and log entry arguments, formatted only when read
+
+struct dtrace_cursor_t { // a reader's position in the dprint() trace ring
+   uint32_t seqnum;      // sequence number of the next record to read
+   int offset; };        // where it is in the ring
+int capture_args(const char *format, va_list argptr, byte *args, int maxlen);
+int render_args(const char *format, const byte *args, int argslen, char *out, int outsize);
 
 void dprint(const char *format, ...);
+void dtrace_flush(void);
+void dtrace_dump(void *parm, void (*print)(void * parm, const char *line));
 void assert_that(bool test, const char *msg, ...);
 void lcdprintf(byte row, const char *msg, ...);
 void watchdog_poke(void);
 void log_dump(void * parm, void (*print)(void * parm, const char *line));
 void temphistory_dump(void *parm, void (*print)(void * parm, const char *line));
+void log_dump_after(void *parm, void (*print)(void * parm, const char *line), uint32_t after);
+void temphistory_dump_after(void *parm, void (*print)(void * parm, const char *line), uint32_t after);
+void export_dump(void *parm, void (*write)(void *parm, const void *data, int len));
+bool archive_dump(const char *level_name, int days, void *parm, void (*print)(void * parm, const char *line));
+bool mqtt_peek(struct mqtt_msg_t *msg, uint32_t *dropped);
+void mqtt_pop(uint32_t seqnum);
+void mqtt_check(void);
 void temp_change (int8_t direction);
+char *format_temp(int16_t temp, char *string);
 int wifi_get_rssi(void);
+void wifi_set_power(byte power_save, byte tx_dbm, byte listen_interval);
+const char *config_set_field(struct config_t *config, uint16_t *fields, const char *name, long value);
 
 extern char lcdbuf[4][21];
 extern int lcdrow, lcdcol;
@@ -186,3 +412,9 @@ extern char webserver_address[];
 extern int connect_successes;
 extern int connect_failures;
 extern int client_requests;
+extern volatile bool controller_ready;           // the controller has finished its startup
+extern volatile unsigned long wifi_ready_msecs;  // when WiFi first connected, or 0
+extern volatile unsigned long controller_heartbeat; // when the controller task last ran
+extern volatile uint32_t log_nextseq;      // numbers of the next log and temperature history entries,
+extern volatile uint32_t temphist_nextseq; // which only increase while we're running
+extern const bool mqtt_configured;         // is there an MQTT broker in Wifi_names.h?
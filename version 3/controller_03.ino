@@ -67,10 +67,69 @@
 //               - Major change for version 3.0 hardware using the ESP32 WiFi microcontroller
 //                 instead of the Arduino MEGA 2560. Add heater simulator for testing.
 //                 Add temperature history.
+// 17 Oct 2026, V3.1, L. Shustek
+//               - Make dprint() record a binary trace of the format string and the raw
+//                 arguments, and do the formatting only when the trace is read by the serial
+//                 console or the new /debuglog web page. Allow log entries with binary
+//                 arguments whose format strings are identified by number.
+//               - Plan mode changes as the minimal sequence of pump, valve, and heater steps
+//                 instead of always going through idle, so equipment that both modes use
+//                 keeps running and the valves only move when they have to.
+//               - Describe the modes in one table that a single routine executes.
+//               - Check every relay change against a set of safety interlocks, and reject
+//                 and log the ones that would create a dangerous combination. The rules and
+//                 the mode table are in interlocks.h and modes.h, which tools/interlock_test.cpp
+//                 checks on a workstation.
+//               - Checkpoint the valve configuration in RTC memory and FLASH, so a restart
+//                 doesn't have to spend 45 seconds putting the valves into a known state.
+//               - Also checkpoint the mode, its timers, and the heater state, and resume the
+//                 mode after a watchdog reset, keeping the pump on while the heater cools.
+//               - Start WiFi as soon as the log is open, so it connects while the rest of
+//                 the hardware comes up, drop the delays that were only there so messages
+//                 could be read, and log how long each phase of startup took.
+//               - Keep trying to reconnect to WiFi forever, with backoff, going straight
+//                 back to the last access point on alternate tries.
+//               - Start our own WiFi access point with a captive portal when the house
+//                 network has been gone for a minute, and stop it when the network returns.
+//               - Make the WiFi power save mode, transmit power, and listen interval
+//                 configurable, and add a /wifitest page that measures latency and
+//                 throughput from the browser and shows the history of the signal strength.
+//               - Rate-limit each web client, and refuse all web requests while the
+//                 controller is falling behind.
+//               - Require a login, with a signed session cookie, to push buttons from the web.
+//               - Add a /config web page to view or change the configuration, as a form or
+//                 JSON. Changes are applied without stopping the current mode, if safe.
+//               - Buffer web responses and send them in chunks of up to 4K, instead of one
+//                 chunk for every little piece of each page.
+//               - Compress web pages with gzip when the browser accepts it.
+//               - Answer "304 Not Modified" for the home, log, and temperature pages if the
+//                 browser has the latest version, and send just new entries for ?after=n.
+//               - Add /export.bin, a binary export of the log, temperature history,
+//                 configuration, and counters, and tools/poolspa_export.c to analyze it.
+//               - Keep long-term archives in a new FLASH "archive" partition: 5-minute
+//                 periods for a month, hourly for a year, and daily for five years, with
+//                 temperatures and pump and heater runtimes. See them at /archive.
+//               - Log a "daily rollup" event just after midnight with the day's minutes in each
+//                 mode, heater minutes and cycles, temperature range, web requests, and errors.
+//               - Publish state changes and telemetry to an MQTT broker, if one is configured
+//                 in Wifi_names.h, with messages queued in RAM while the broker is unreachable.
+//               - Make the menus a state machine stepped from the main loop, so heating, the
+//                 timeouts, and the filter autostart keep running while someone uses them.
+//               - Have a display compositor own the LCD outside of the menus, with a region per
+//                 row, message priorities and time limits, and a rotating title. It redraws at
+//                 most every 100 msec, and only the characters that changed.
+//               - Continually rewrite the display from our copy of it, one row at a time, and
+//                 reload the custom characters now and then. Go faster after the relays switch.
+//               - Keep temperatures as tenths of a degree F everywhere, from the sensor through
+//                 the heater control, history, archives, log, LCD, web, and MQTT. Set
+//                 TEMP_CELSIUS to show them in Celsius.
+//               - Filter the temperature sensor readings: drop those with bad CRCs or impossible
+//                 values, take the median of three, limit the rate of change, and average. If
+//                 the readings stay bad, turn the heater off. Keep the raw readings in /temps too.
 //
 //---------------------------------------------------------------------------------------------
 
-#define VERSION "3.0"
+#define VERSION "3.1"
 #define TITLE "Saw Mill Lodge"
 
 #define DEBUG true
@@ -82,8 +141,9 @@
 #define ROTARY_ENCODER true
 
 /* The 4MB (0x400000) of FLASH memory in the ESP32 is divided into partitions that are
-   defined by the "partitions.csv" file in the sketch directory. We add two partitions
+   defined by the "partitions.csv" file in the sketch directory. We add three partitions
    at the end from space taken out of the default "spiffs" filesystem partition:
+      "archive", a 352K area for the long-term temperature and runtime archives
       "log", a 60K area for holding the event log
       "config", a 4K area for holding the configuration information
    Our partitions.csv file is thus:
@@ -92,7 +152,8 @@
       otadata,  data, ota,     0xe000,   0x2000,
       app0,     app,  ota_0,   0x10000,  0x140000,
       app1,     app,  ota_1,   0x150000, 0x140000,
-      spiffs,   data, spiffs,  0x290000, 0x160000,
+      spiffs,   data, spiffs,  0x290000, 0x108000,
+      archive,  0x4F, 0x00,    0x398000, 0x58000,
       log,      0x4D, 0x00,    0x3f0000, 0xf000,
       config,   0x4E, 0x00,    0x3ff000, 0x1000,
 */
@@ -127,8 +188,9 @@ boolean heater_on = false;                     // is the heater currently on?
 volatile byte heater_cooldown_secs_left = 0;   // cooldown seconds left after heater off
 enum vconfig_t valve_config = VALVES_UNDEFINED;// current valve configuration
 enum pump_status_t pump_status = PUMP_NONE;    // current status of pumps
-byte target_temp = 102;                        // target temperature in degrees F
-byte simulated_temp = 72;                      // simulated temperature in F if we have no temp sensor
+uint16_t relay_status = 0;                     // which relays are on
+int16_t target_temp = DEGREES(102);            // target temperature in tenths of a degree F
+int16_t simulated_temp = DEGREES(72);          // simulated temperature if we have no temp sensor
 boolean button_awaiting_release[NUM_BUTTONS] = {
    false };                                     // button pushed but awaiting release?
 bool button_webpushed[NUM_BUTTONS] = {false }; // buttons with pending "pushes" from the web
@@ -143,9 +205,8 @@ boolean have_tempsensor = false;
 boolean no_clock = false;
 BaseType_t cpu_core;                      // which CPU core we're running on
 
-volatile boolean do_title1 = true;
-volatile boolean do_title2 = false;
-volatile byte title_timer = 0;            // count seconds for titles
+enum ui_state_t ui_state = UI_NONE;       // which menu is showing, if any
+bool ui_drawing = false;                  // the menu is drawing on the display
 
 volatile unsigned int mode_timer = 0;     // minutes left in the current mode
 volatile unsigned int spa_jets_timer = 0; // minutes left to aerator shutoff
@@ -166,59 +227,76 @@ static const byte days_in_month []  = {
 
 OneWire tempsensor(TEMPSENSOR_PIN); // Maxim DS18B20 temperature sensor
 byte tempsensor_addr[8];  // its discovered address
-byte temp_now;            // the most recently read temperature
+int16_t temp_now;         // the most recently read temperature, in tenths of a degree F
+struct temp_filter_t tempfilter; // the filter its readings go through
 bool temp_valid = false;  // if the temp is valid: pump running water through heater
+int interlock_rejections = 0; // how many relay changes an interlock prevented
 
 
 //****  map of non-volatile storage for configuration info
 
-struct { // a local copy of the configuration data
-   char hdr_id[6]; // "SMLnn" // unique header ID w/ version number
-   byte filter_pool_mins;     // how many minutes to filter pool
-   byte filter_spa_mins;      // how many minutes to filter spa
-   byte filter_start_hour;    // what hour 1-12 to start filtering each day
-   byte filter_start_ampm;    // whether AM or PM, 0=am, 1=pm
-   byte heater_allowed;       // whether heater is allowed to be used
-   // We could add the last set spa and pool temperatures, I suppose.
-   // But that might just be confusing when there are multiple pool/spa users.
-} config_data = { // default configuration data
+struct config_t config_data = { // a local copy of the configuration data, with the defaults
    // change the hdr_id when the format or event list changes, to force reinitialization
-   "SML04", FILTER_POOL_TIME, FILTER_SPA_TIME, FILTER_START_HOUR, FILTER_START_AMPM, true};
+   "SML05", FILTER_POOL_TIME, FILTER_SPA_TIME, FILTER_START_HOUR, FILTER_START_AMPM, true,
+   WIFI_POWER_SAVE, WIFI_TX_POWER, WIFI_LISTEN_INTERVAL };
+
+#define CONFIG_FIELD(f, min, max) {#f, offsetof(struct config_t, f), min, max }
+const struct config_field_t config_fields[NUM_CONFIG_FIELDS] = {
+   CONFIG_FIELD(filter_pool_mins, 5, 120),
+   CONFIG_FIELD(filter_spa_mins, 5, 60),
+   CONFIG_FIELD(filter_start_hour, 1, 12),
+   CONFIG_FIELD(filter_start_ampm, 0, 1),
+   CONFIG_FIELD(heater_allowed, 0, 1),
+   CONFIG_FIELD(wifi_power_save, 0, 2),
+   CONFIG_FIELD(wifi_tx_power, 2, 20),
+   CONFIG_FIELD(wifi_listen_interval, 1, 10) };
+
+struct config_t config_webpending;
+uint16_t config_webfields;
+volatile bool config_webchanged = false;
 
 #define LOG_DATASIZE 60 // total size of a log entry: must be 4 less than a power of 2
 #define LOG_MSGSIZE (LOG_DATASIZE-8-2) // the remainder not including time stamp and event type
+#define LOG_BINARY 0x8000 // event_type flag: event_msg is a format number and binary arguments
+#define LOG_TEXTSIZE 150  // the most a message can be when binary arguments are formatted
 struct logentry_t {  // the log entries
    struct datetime timestamp;
    uint16_t event_type;
    char event_msg[LOG_MSGSIZE]; }; // optional message, maybe NOT 0-terminated
 
 struct flashlog_state_t log_state;
-
-enum event_t {    // event types
-   EV_BAD,              // (to catch uninitialized log entries)
-   EV_STARTUP,          // we started from power up
-   EV_WATCHDOG_RESET,   // we were reset by watchdog timer
-   EV_ASSERTION_FAILED, // assertion failed
-   EV_CLOCK_BAD,        // can't find realtime clock
-   EV_TEMPSENSOR_BAD,   // can't find temperature sensor
-   EV_INIT_CONFIG,      // initialized the config data
-   EV_UPDATED_CONFIG,   // updated the configuration data
-   EV_IDLE,             // entered these various modes...
-   EV_HEAT_SPA,
-   EV_HEAT_POOL,
-   EV_FILL_SPA,
-   EV_EMPTY_SPA,
-   EV_FILTER_POOL,
-   EV_FILTER_SPA,
-   EV_NUM_EVENTS };
+volatile uint32_t log_nextseq = 1; // number of the next entry, counting from the oldest one at startup
 
 static const char *event_names[] = {
    "???",
    "power on restart", "watchdog restart", "assertion failed", "clock bad", "tempsensor bad",
    "init config", "updated config",
-   "idle", "heat spa", "heat pool", "fill spa", "empty spa", "filter pool", "filter spa" };
+   "idle", "heat spa", "heat pool", "fill spa", "empty spa", "filter pool", "filter spa",
+   "relay interlock", "mode resumed", "boot profile", "daily rollup", "temp readings bad" };
 typedef char event_name_error[sizeof(event_names) / sizeof(event_names[0]) == EV_NUM_EVENTS ? 1 : -1]; // compiler check
 
+// Formats for log entries with binary arguments. The log is in FLASH and outlives the
+// program, so these are identified by number: only add to the end, and never renumber.
+enum logfmt_t {
+   LOGFMT_NONE,
+   LOGFMT_RESET_REASON,
+   LOGFMT_INTERLOCK,
+   LOGFMT_MODE_RESUMED,
+   LOGFMT_BOOT_PROFILE,
+   LOGFMT_DAILY_ROLLUP,
+   LOGFMT_TEMP_READINGS_BAD,
+   LOGFMT_NUM_FORMATS };
+
+static const char *log_formats[] = {
+   "",
+   "reason %d",
+   "%04X rule %d",
+   "mode %d, %d min left",
+   "%d %d %d %d %d ready %d wifi %d", // msec for lcd, log, config, clock, tempsensor
+   "heat spa %d pool %d, fill %d empty %d, filter pool %d spa %d, heater %d min %d on, %d-%dF, web %d, errors %d",
+   "%d CRC errors, %d implausible" };
+typedef char log_format_error[sizeof(log_formats) / sizeof(log_formats[0]) == LOGFMT_NUM_FORMATS ? 1 : -1]; // compiler check
+
 void watchdog_poke(void);
 
 //-----------------------------------------------------------------
@@ -234,11 +312,54 @@ void log_event(enum event_t event_type, const char *msg) {
    plog->event_type = event_type;
    if (msg) strncpy(plog->event_msg, msg, LOG_MSGSIZE);
    else memset(plog->event_msg, 0, LOG_MSGSIZE);
-   assert_that(flashlog_add(&log_state) == FLASHLOG_ERR_OK, "can't add log entry"); }
+   assert_that(flashlog_add(&log_state) == FLASHLOG_ERR_OK, "can't add log entry");
+   ++log_nextseq; }
 
 void log_event(enum event_t event_type) {
    log_event(event_type, NULLP); }
 
+void log_eventf(enum event_t event_type, enum logfmt_t format, ...) {
+   // log an event whose message is recorded as binary arguments for one of the log_formats[]
+   dprint("log event: %s fmt %d\n", event_names[event_type], format);
+   struct logentry_t *plog = (struct logentry_t *) log_state.logdata;
+   plog->timestamp = now;
+   plog->event_type = event_type | LOG_BINARY;
+   memset(plog->event_msg, 0, LOG_MSGSIZE);
+   plog->event_msg[0] = format;
+   va_list argptr;
+   va_start(argptr, format);
+   capture_args(log_formats[format], argptr, (byte *)plog->event_msg + 1, LOG_MSGSIZE - 1);
+   va_end(argptr);
+   assert_that(flashlog_add(&log_state) == FLASHLOG_ERR_OK, "can't add log entry");
+   ++log_nextseq; }
+
+const char *log_event_name(struct logentry_t *plog) {
+   int event_type = plog->event_type & ~LOG_BINARY;
+   return event_type < EV_NUM_EVENTS ? event_names[event_type] : event_names[EV_BAD]; }
+
+char *log_event_msg(struct logentry_t *plog, char *buf, int bufsize) {
+   // return the message of a log entry as text, formatting binary arguments if there are any
+   if (plog->event_type & LOG_BINARY) {
+      byte format = plog->event_msg[0];
+      if (format < LOGFMT_NUM_FORMATS)
+         render_args(log_formats[format], (byte *)plog->event_msg + 1, LOG_MSGSIZE - 1, buf, bufsize);
+      else snprintf(buf, bufsize, "format %d?", format); }
+   else { // text, maybe not 0-terminated
+      int len = bufsize - 1 < LOG_MSGSIZE ? bufsize - 1 : LOG_MSGSIZE;
+      memcpy(buf, plog->event_msg, len);
+      buf[len] = 0; }
+   return buf; }
+
+void log_format_entry(struct logentry_t *plog, char *buf, int bufsize) {
+   char msg[LOG_TEXTSIZE];
+   if (datetime_invalid(plog->timestamp))
+      snprintf(buf, bufsize, " -- --- 20-- --:-- -- ");
+   else snprintf(buf, bufsize, " %2d %s 20%02d %2d:%02d %s ",
+                    plog->timestamp.date, months[plog->timestamp.month], plog->timestamp.year,
+                    plog->timestamp.hour, plog->timestamp.min, plog->timestamp.ampm ? "PM" : "AM");
+   int sofar = strlen(buf);
+   snprintf(buf + sofar, bufsize - sofar, " %s %s", log_event_name(plog), log_event_msg(plog, msg, sizeof(msg))); }
+
 void log_dump(void * parm, void (*print)(void * parm, const char *line)) {
    if (log_state.numinuse == 0)
       print(parm, "log empty\n");
@@ -250,17 +371,27 @@ void log_dump(void * parm, void (*print)(void * parm, const char *line)) {
       do {
          assert_that(flashlog_read (&log_state) == FLASHLOG_ERR_OK,
                      "can't read log entry");
-         struct logentry_t *plog = (struct logentry_t *) log_state.logdata;
-         if (datetime_invalid(plog->timestamp))
-            snprintf(buf, sizeof(buf), " -- --- 20-- --:-- -- ");
-         else snprintf(buf, sizeof(buf), " %2d %s 20%02d %2d:%02d %s ",
-                          plog->timestamp.date, months[plog->timestamp.month], plog->timestamp.year,
-                          plog->timestamp.hour, plog->timestamp.min, plog->timestamp.ampm ? "PM" : "AM");
-         int sofar = strlen(buf);
-         snprintf(buf + sofar, sizeof(buf) - sofar, " %s %.17s", event_names[plog->event_type], plog->event_msg);
+         log_format_entry((struct logentry_t *) log_state.logdata, buf, sizeof(buf));
          print(parm, buf); }
       while (flashlog_goto_prev(&log_state) == FLASHLOG_ERR_OK); } }
 
+void log_dump_after(void * parm, void (*print)(void * parm, const char *line), uint32_t after) {
+   // show the entries numbered after "after", oldest first, each starting with its number
+   uint32_t nextseq = log_nextseq, count = log_state.numinuse;
+   if (count == 0 || after + 1 >= nextseq) return;
+   if (nextseq - (after + 1) < count) count = nextseq - (after + 1);
+   flashlog_goto_newest(&log_state);
+   for (uint32_t skip = 1; skip < count; ++skip)
+      flashlog_goto_prev(&log_state);
+   for (uint32_t seq = nextseq - count; seq < nextseq; ++seq) {
+      char buf[200];
+      assert_that(flashlog_read (&log_state) == FLASHLOG_ERR_OK,
+                  "can't read log entry");
+      int len = snprintf(buf, sizeof(buf), "%lu", (unsigned long) seq);
+      log_format_entry((struct logentry_t *) log_state.logdata, buf + len, sizeof(buf) - len);
+      print(parm, buf);
+      if (flashlog_goto_next(&log_state) != FLASHLOG_ERR_OK) break; } }
+
 //-----------------------------------------------------------------------
 //    LCD display routines
 //-----------------------------------------------------------------------
@@ -271,7 +402,10 @@ char lcdbuf[4][21]; // our simulated LCD buffer, with 0 string terminators
 int lcdrow /* 0..3 */, lcdcol /* 0..19 */;
 bool lcd_cursorblinking = false;
 
-void lcd_start(void) {
+bool lcd_hidden(void) { // while a menu is showing, nobody else may change the display
+   return ui_state != UI_NONE && !ui_drawing; }
+
+void lcd_load_glyphs(void) { // load our custom characters
    static uint8_t downarrow_char[8] = {
       B00000,
       B00100,
@@ -290,10 +424,12 @@ void lcd_start(void) {
       B00100,
       B00100,
       B00000 };
+   lcdhw.createChar(DOWNARROW[0], downarrow_char);
+   lcdhw.createChar(UPARROW[0], uparrow_char); }
 
+void lcd_start(void) {
    lcdhw.begin(20, 4); // start LCD display
-   lcdhw.createChar(DOWNARROW[0], downarrow_char);
-   lcdhw.createChar(UPARROW[0], uparrow_char);
+   lcd_load_glyphs();
    lcdhw.noCursor(); }
 
 void lcd_restart(void) {
@@ -304,31 +440,66 @@ void lcd_restart(void) {
          lcdhw.print(lcdbuf[row][col]); }
    lcdhw.setCursor(lcdcol, lcdrow); }
 
+// Relay switching can garble the display, so we continually rewrite it from our buffer,
+// one row at a time, and now and then reload the custom characters. After the relays
+// switch we go faster, so any damage is repaired within a second.
+#define LCD_SCRUB_MSECS 1000      // time between rows, normally
+#define LCD_SCRUB_FAST_MSECS 250  // time between rows, after the relays switch
+#define LCD_SCRUB_GLYPH_PASSES 15 // full passes between reloading the custom characters
+byte lcd_scrub_row = 0, lcd_scrub_fast_rows = 0, lcd_scrub_passes = 0;
+bool lcd_scrub_glyphs = false;
+unsigned long lcd_scrub_msecs = 0;
+
+void lcd_scrub_soon(void) { // the relays switched, so quickly rewrite everything
+   lcd_scrub_fast_rows = 4;
+   lcd_scrub_glyphs = true; }
+
+void lcd_scrub(void) { // rewrite the next row from our buffer, if it's time to
+   unsigned long msecs = millis();
+   if (msecs - lcd_scrub_msecs < (lcd_scrub_fast_rows ? LCD_SCRUB_FAST_MSECS : LCD_SCRUB_MSECS)) return;
+   lcd_scrub_msecs = msecs;
+   if (lcd_scrub_row == 0 && ++lcd_scrub_passes >= LCD_SCRUB_GLYPH_PASSES) lcd_scrub_glyphs = true;
+   if (lcd_scrub_glyphs) {
+      lcd_load_glyphs();
+      lcd_scrub_glyphs = false;
+      lcd_scrub_passes = 0; }
+   lcdhw.setCursor(0, lcd_scrub_row);
+   lcdhw.print(lcdbuf[lcd_scrub_row]); // all 20 characters in one burst
+   lcdhw.setCursor(lcdcol, lcdrow); // (in case the cursor is blinking)
+   if (lcd_scrub_fast_rows) --lcd_scrub_fast_rows;
+   lcd_scrub_row = (lcd_scrub_row + 1) & 3; }
+
 void lcdsetrow( byte row) {
+   if (lcd_hidden()) return;
    assert_that(row <= 3, "bad lcdsetrow");
    lcdhw.setCursor(0, row);
    lcdrow = row; lcdcol = 0; }
 
 void lcdsetCursor(byte col, byte row) {
+   if (lcd_hidden()) return;
    assert_that(row <= 3 && col <= 19, "bad lcdsetcursor");
    lcdhw.setCursor(col, row);
    lcdcol = col; lcdrow = row; }
 
 void lcdclear(void) {
+   if (lcd_hidden()) return;
    lcdhw.clear();
    memset(lcdbuf, ' ', sizeof(lcdbuf)); // blank the buffer
    for (int row = 0; row < 4; ++row) lcdbuf[row][20] = 0; // insert string terminators
    lcdrow = lcdcol = 0; }
 
 void lcdblink(void) {
+   if (lcd_hidden()) return;
    lcd_cursorblinking = true;
    lcdhw.blink(); }
 
 void lcdnoBlink(void) {
+   if (lcd_hidden()) return;
    lcd_cursorblinking = false;
    lcdhw.noBlink(); }
 
 void lcdprint(char ch) {
+   if (lcd_hidden()) return;
    assert_that(lcdcol < 20 && lcdrow < 4, "bad lcdprint ch");
    lcdhw.print(ch);
    /* if (lcdcol < 20)*/ lcdbuf[lcdrow][lcdcol] = ch;
@@ -336,6 +507,7 @@ void lcdprint(char ch) {
 
 void lcdprint(const char *msg) {
    // if not on last row, allow message to overflow onto a second line
+   if (lcd_hidden()) return;
    int length = strlen(msg);
    int fits = 20 - lcdcol; // how much fits on the first row
    if (lcdrow < 3 && length > fits && length <= fits + 20) {
@@ -368,14 +540,250 @@ void lcdprintf(byte row, const char *msg, ...) {
 // Utility routines
 //-------------------------------------------------------
 
+//-------------------------------------------------------
+// Binary argument routines
+//-------------------------------------------------------
+
+/* Instead of formatting printf-style arguments when they are produced, we can copy them
+   raw into a binary record and do the formatting only if and when somebody looks at them.
+   Integers, pointers, and doubles are copied as is, and strings are copied as a length byte
+   followed by the characters. The format string isn't copied, so it must be a literal,
+   or an entry in a table that is identified by number. */
+
+#define ARGS_MAXSTR 60  // maximum characters we keep for a %s argument
+
+// parse one "%..." conversion spec, and return a pointer to what follows it
+const char *parse_spec(const char *fmt, char *conv, byte *longs, byte *stars) {
+   *longs = *stars = 0;
+   ++fmt; // skip the %
+   while (*fmt && strchr("-+ #0", *fmt)) ++fmt; // flags
+   if (*fmt == '*') {
+      ++*stars; ++fmt; }
+   else while (*fmt >= '0' && *fmt <= '9') ++fmt; // width
+   if (*fmt == '.') { // precision
+      if (*++fmt == '*') {
+         ++*stars; ++fmt; }
+      else while (*fmt >= '0' && *fmt <= '9') ++fmt; }
+   for (; *fmt && strchr("hlLqjzt", *fmt); ++fmt) // length modifiers
+      if (*fmt == 'q' || *fmt == 'j') *longs = 2;
+      else if (*fmt == 'l' || *fmt == 'z' || *fmt == 't') ++*longs;
+   *conv = *fmt;
+   if (*fmt) ++fmt;
+   return fmt; }
+
+// copy the arguments for a format string into a binary record, and return its length
+int capture_args(const char *format, va_list argptr, byte *args, int maxlen) {
+   int len = 0;
+   #define CAPTURE(type) { \
+      type arg = va_arg(argptr, type); \
+      if (len + (int)sizeof(type) > maxlen) break; \
+      memcpy(args + len, &arg, sizeof(type)); len += sizeof(type); }
+   for (const char *fmt = format; (fmt = strchr(fmt, '%')) != NULLP; ) {
+      if (fmt[1] == '%') {
+         fmt += 2; continue; }
+      char conv; byte longs, stars;
+      fmt = parse_spec(fmt, &conv, &longs, &stars);
+      while (stars--) CAPTURE(int);
+      if (strchr("diouxXc", conv)) {
+         if (longs >= 2) CAPTURE(long long)
+         else if (longs == 1) CAPTURE(long)
+            else CAPTURE(int) }
+      else if (strchr("feEgGaA", conv)) CAPTURE(double)
+      else if (conv == 'p') CAPTURE(void *)
+      else if (conv == 's') {
+         const char *str = va_arg(argptr, const char *);
+         if (!str) str = "(null)";
+         int slen = strnlen(str, ARGS_MAXSTR);
+         if (len + 1 + slen > maxlen) slen = maxlen - len - 1;
+         if (slen < 0) break;
+         args[len++] = slen;
+         memcpy(args + len, str, slen);
+         len += slen; }
+      else break; // something we don't know how to handle
+   }
+   #undef CAPTURE
+   return len; }
+
+// format a binary record of arguments into text, and return its length
+int render_args(const char *format, const byte *args, int argslen, char *out, int outsize) {
+   int outlen = 0, argndx = 0;
+   const char *fmt = format;
+   #define FETCH(var) { \
+      if (argndx + (int)sizeof(var) > argslen) goto truncated; \
+      memcpy(&var, args + argndx, sizeof(var)); argndx += sizeof(var); }
+   #define EMIT(arg) { \
+      outlen += snprintf(out + outlen, outsize - outlen, spec, arg); \
+      if (outlen >= outsize) outlen = outsize - 1; }
+   while (*fmt && outlen < outsize - 1) {
+      if (*fmt != '%' || fmt[1] == '%') { // copy ordinary characters
+         out[outlen++] = *fmt;
+         fmt += *fmt == '%' ? 2 : 1;
+         continue; }
+      char conv, spec[30]; byte longs, stars;
+      const char *next = parse_spec(fmt, &conv, &longs, &stars);
+      int speclen = 0;
+      for (; fmt < next && speclen < (int)sizeof(spec) - 12; ++fmt) // copy the spec
+         if (*fmt == '*') { // replacing * with the width or precision argument
+            int star;
+            FETCH(star);
+            speclen += sprintf(spec + speclen, "%d", star); }
+         else spec[speclen++] = *fmt;
+      spec[speclen] = 0;
+      fmt = next;
+      if (strchr("diouxXc", conv)) {
+         if (longs >= 2) {
+            long long arg; FETCH(arg); EMIT(arg); }
+         else if (longs == 1) {
+            long arg; FETCH(arg); EMIT(arg); }
+         else {
+            int arg; FETCH(arg); EMIT(arg); } }
+      else if (strchr("feEgGaA", conv)) {
+         double arg; FETCH(arg); EMIT(arg); }
+      else if (conv == 'p') {
+         void *arg; FETCH(arg); EMIT(arg); }
+      else if (conv == 's') {
+         char str[ARGS_MAXSTR + 1];
+         if (argndx >= argslen || argndx + 1 + args[argndx] > argslen) goto truncated;
+         memcpy(str, args + argndx + 1, args[argndx]);
+         str[args[argndx]] = 0;
+         argndx += 1 + args[argndx];
+         EMIT(str); }
+      else goto truncated; }
+   out[outlen] = 0;
+   return outlen;
+truncated: // ran out of arguments
+   outlen += snprintf(out + outlen, outsize - outlen, "...");
+   if (outlen >= outsize) outlen = outsize - 1;
+   return outlen;
+   #undef FETCH
+   #undef EMIT
+}
+
+//-------------------------------------------------------
+// Debugging trace routines
+//-------------------------------------------------------
+
+/* dprint() doesn't format its output or wait for the serial port. It just adds a record
+   with the format string pointer and the binary arguments to a trace ring, overwriting the
+   oldest records if necessary. The records are turned into text only when they are read:
+   by dtrace_flush() for the serial console, or by dtrace_dump() for the /debuglog web page.
+   Both CPU cores write into the ring, so it is protected by a spinlock. */
+
+#define DTRACE_SIZE 4096    // bytes in the trace ring
+#define DTRACE_MAXREC 200   // maximum bytes in one trace record
+
+struct dtrace_hdr_t {  // the start of each trace record
+   uint16_t reclen;    // total bytes including this header
+   uint16_t core;      // which CPU core recorded it
+   uint32_t seqnum;    // sequence number, to detect records that got overwritten
+   uint32_t millisecs; // when it was recorded
+   const char *format; }; // the dprint() format string
+
+byte dtrace_ring[DTRACE_SIZE];
+int dtrace_head = 0;          // where the next record goes
+int dtrace_tail = 0;          // where the oldest record is
+int dtrace_bytes = 0;         // how many bytes are in use
+uint32_t dtrace_nextseq = 0;  // sequence number of the next record
+uint32_t dtrace_oldestseq = 0;// sequence number of the oldest record
+struct dtrace_cursor_t dtrace_serial_cursor = {0, 0 }; // how far the serial console has gotten
+portMUX_TYPE dtrace_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void dtrace_copyin(const byte *data, int len) { // copy into the ring at the head
+   for (int ndx = 0; ndx < len; ++ndx) {
+      dtrace_ring[dtrace_head] = data[ndx];
+      if (++dtrace_head >= DTRACE_SIZE) dtrace_head = 0; }
+   dtrace_bytes += len; }
+
+void dtrace_copyout(int offset, byte *data, int len) { // copy out of the ring
+   for (int ndx = 0; ndx < len; ++ndx) {
+      data[ndx] = dtrace_ring[offset];
+      if (++offset >= DTRACE_SIZE) offset = 0; } }
+
 void dprint(const char *format, ...) {
    #if DEBUG
-   char buf[200];
+   byte rec[DTRACE_MAXREC];
+   struct dtrace_hdr_t hdr;
    va_list argptr;
    va_start(argptr, format);
-   vsnprintf(buf, sizeof(buf), format, argptr);
-   Serial.print(buf);
+   hdr.reclen = sizeof(hdr) +
+                capture_args(format, argptr, rec + sizeof(hdr), DTRACE_MAXREC - sizeof(hdr));
    va_end(argptr);
+   hdr.core = xPortGetCoreID();
+   hdr.millisecs = millis();
+   hdr.format = format;
+   portENTER_CRITICAL(&dtrace_lock);
+   hdr.seqnum = dtrace_nextseq++;
+   memcpy(rec, &hdr, sizeof(hdr));
+   while (dtrace_bytes + hdr.reclen > DTRACE_SIZE) { // discard the oldest records to make room
+      uint16_t oldlen;
+      dtrace_copyout(dtrace_tail, (byte *)&oldlen, sizeof(oldlen));
+      dtrace_tail = (dtrace_tail + oldlen) % DTRACE_SIZE;
+      dtrace_bytes -= oldlen;
+      ++dtrace_oldestseq; }
+   dtrace_copyin(rec, hdr.reclen);
+   portEXIT_CRITICAL(&dtrace_lock);
+   #endif
+}
+
+// get the next trace record for a reader, if there is one
+bool dtrace_next(struct dtrace_cursor_t *cursor, byte *rec, uint32_t *lost) {
+   bool gotone = false;
+   *lost = 0;
+   portENTER_CRITICAL(&dtrace_lock);
+   if (cursor->seqnum < dtrace_oldestseq) { // what we hadn't read yet got overwritten
+      *lost = dtrace_oldestseq - cursor->seqnum;
+      cursor->seqnum = dtrace_oldestseq;
+      cursor->offset = dtrace_tail; }
+   if (cursor->seqnum < dtrace_nextseq) {
+      uint16_t reclen;
+      dtrace_copyout(cursor->offset, (byte *)&reclen, sizeof(reclen));
+      dtrace_copyout(cursor->offset, rec, reclen);
+      cursor->offset = (cursor->offset + reclen) % DTRACE_SIZE;
+      ++cursor->seqnum;
+      gotone = true; }
+   portEXIT_CRITICAL(&dtrace_lock);
+   return gotone; }
+
+int dtrace_render(const byte *rec, char *out, int outsize) { // make text from a trace record
+   struct dtrace_hdr_t hdr;
+   memcpy(&hdr, rec, sizeof(hdr));
+   return render_args(hdr.format, rec + sizeof(hdr), hdr.reclen - sizeof(hdr), out, outsize); }
+
+void dtrace_flush(void) { // show new trace records on the serial console
+   #if DEBUG
+   byte rec[DTRACE_MAXREC];
+   char buf[250];
+   uint32_t lost;
+   while (dtrace_next(&dtrace_serial_cursor, rec, &lost)) {
+      if (lost) {
+         snprintf(buf, sizeof(buf), "...%lu debug messages lost\n", (unsigned long)lost);
+         Serial.print(buf); }
+      dtrace_render(rec, buf, sizeof(buf));
+      Serial.print(buf); }
+   #endif
+}
+
+void dtrace_dump(void * parm, void (*print)(void * parm, const char *line)) {
+   // show all the trace records that are still in the ring, oldest first
+   #if DEBUG
+   byte rec[DTRACE_MAXREC];
+   char buf[250];
+   uint32_t lost;
+   struct dtrace_cursor_t cursor;
+   portENTER_CRITICAL(&dtrace_lock);
+   cursor.seqnum = dtrace_oldestseq;
+   cursor.offset = dtrace_tail;
+   portEXIT_CRITICAL(&dtrace_lock);
+   while (dtrace_next(&cursor, rec, &lost)) {
+      struct dtrace_hdr_t hdr;
+      memcpy(&hdr, rec, sizeof(hdr));
+      int len = snprintf(buf, sizeof(buf), "%lu.%03lu core %d: ",
+                         (unsigned long)hdr.millisecs / 1000, (unsigned long)hdr.millisecs % 1000, hdr.core);
+      len += dtrace_render(rec, buf + len, sizeof(buf) - len);
+      if (len > 0 && buf[len - 1] == '\n') buf[len - 1] = 0; // the printer does the line ending
+      print(parm, buf); }
+   #else
+   print(parm, "debugging is off");
    #endif
 }
 
@@ -387,9 +795,11 @@ void assert_that(boolean test, const char *msg, ...) {
       va_start(argptr, msg);
       vsnprintf(buf, sizeof(buf), msg, argptr);
       #if DEBUG
+      dtrace_flush(); // show what led up to it
       Serial.print("failed assertion : "); Serial.println(buf);
       #endif
       log_event(EV_ASSERTION_FAILED, buf);
+      ui_drawing = true; // (even over a menu)
       lcdclear(); lcdprint("** INTERNAL ERROR **");
       lcdsetCursor(0, 1); lcdprint("Assertion failed : ");
       lcdsetCursor(0, 2); lcdprint(buf);
@@ -421,15 +831,120 @@ void center_messagef (byte row, const char *msg, ...) {
    center_message(row, buf);
    va_end(arg_ptr); }
 
+//-----------------------------------------------------------------------------------------
+//  display compositor
+//-----------------------------------------------------------------------------------------
+/* Except while a menu is showing, the compositor owns the display. Each row is a region,
+   and each message is posted to its region with a fixed priority and an optional time
+   limit. A row shows its highest-priority message; if there are several rotating ones,
+   they take turns. lcd_render() is the only routine that writes them to the display.
+   It runs at most once per frame, and only rewrites the characters that changed. */
+
+#define LCD_FRAME_MSECS 100                         // minimum time between renderings
+#define LCD_ROTATE_MSECS (TITLE_LINE_TIME * 1000UL) // time for each rotating message
+
+const struct { // the fixed properties of each message
+   byte row, priority;
+   bool rotates; }
+lcd_msg_descs[NUM_LCD_MSGS] = {
+   {0, 1, true },    // LCD_TITLE
+   {0, 1, true },    // LCD_CLOCK
+   {0, 2, false },   // LCD_CHANGING
+   {0, 3, false },   // LCD_IP_LABEL
+   {1, 1, false },   // LCD_MODE
+   {1, 2, false },   // LCD_HEATER_DISABLED
+   {1, 3, false },   // LCD_IP_ADDRESS
+   {2, 1, false },   // LCD_TIME_LEFT
+   {2, 2, false },   // LCD_STEP
+   {3, 1, false } }; // LCD_TEMP
+
+struct { // the current state of each message
+   bool showing;
+   char text[21];               // centered and blank-filled
+   unsigned long posted, msecs; // when it was posted, and for how long (0 = until removed)
+} lcd_msgs[NUM_LCD_MSGS];
+
+byte lcd_dirty_rows = 0;        // bitmap of rows to compose at the next rendering
+byte lcd_rotation = 0;          // which of the rotating messages is showing
+unsigned long lcd_frame_msecs = 0, lcd_rotate_msecs = 0;
+
+void lcd_post(enum lcd_msg_t msg, unsigned long msecs, const char *format, ...) {
+   // show a message for msecs, or (if 0) until it is removed or replaced
+   char buf[40], text[21];
+   va_list arg_ptr;
+   va_start(arg_ptr, format);
+   vsnprintf(buf, sizeof(buf), format, arg_ptr);
+   va_end(arg_ptr);
+   int len = strlen(buf);
+   assert_that(len <= 20 && msg < NUM_LCD_MSGS, "bad lcd_post");
+   memset(text, ' ', 20);
+   memcpy(text + ((20 - len) >> 1), buf, len);
+   text[20] = 0;
+   if (lcd_msgs[msg].showing && msecs == 0 && lcd_msgs[msg].msecs == 0
+         && strcmp(text, lcd_msgs[msg].text) == 0) return; // nothing new
+   #if DEBUG && DEBUG_LCD
+   Serial.print(":: "); Serial.println(buf);
+   #endif
+   strcpy(lcd_msgs[msg].text, text);
+   lcd_msgs[msg].showing = true;
+   lcd_msgs[msg].posted = millis();
+   lcd_msgs[msg].msecs = msecs;
+   lcd_dirty_rows |= 1 << lcd_msg_descs[msg].row; }
+
+void lcd_remove(enum lcd_msg_t msg) {
+   if (lcd_msgs[msg].showing) {
+      lcd_msgs[msg].showing = false;
+      lcd_dirty_rows |= 1 << lcd_msg_descs[msg].row; } }
+
+void lcd_redraw(void) { // compose all the rows, even if something else wrote on them
+   lcd_dirty_rows = 0x0f; }
+
+void lcd_render(void) { // update the display with the current messages, if it's time to
+   unsigned long msecs = millis();
+   if (ui_state != UI_NONE || msecs - lcd_frame_msecs < LCD_FRAME_MSECS) return;
+   for (int ndx = 0; ndx < NUM_LCD_MSGS; ++ndx) {
+      if (lcd_msgs[ndx].showing && lcd_msgs[ndx].msecs
+            && msecs - lcd_msgs[ndx].posted >= lcd_msgs[ndx].msecs)
+         lcd_remove((enum lcd_msg_t) ndx); // its time is up
+      if (lcd_msg_descs[ndx].rotates && msecs - lcd_rotate_msecs >= LCD_ROTATE_MSECS)
+         lcd_dirty_rows |= 1 << lcd_msg_descs[ndx].row; }
+   if (msecs - lcd_rotate_msecs >= LCD_ROTATE_MSECS) {
+      ++lcd_rotation;
+      lcd_rotate_msecs = msecs; }
+   if (!lcd_dirty_rows) return;
+   lcd_frame_msecs = msecs;
+   for (byte row = 0; row < 4; ++row) if (lcd_dirty_rows & (1 << row)) {
+         byte top[NUM_LCD_MSGS], ntop = 0, priority = 0; // the highest-priority messages
+         for (byte ndx = 0; ndx < NUM_LCD_MSGS; ++ndx)
+            if (lcd_msgs[ndx].showing && lcd_msg_descs[ndx].row == row) {
+               if (lcd_msg_descs[ndx].priority > priority) {
+                  priority = lcd_msg_descs[ndx].priority;
+                  ntop = 0; }
+               if (lcd_msg_descs[ndx].priority == priority) top[ntop++] = ndx; }
+         const char *text = "                    ";
+         if (ntop) text = lcd_msgs[top[lcd_msg_descs[top[0]].rotates ? lcd_rotation % ntop : 0]].text;
+         for (byte col = 0; col < 20; ) { // write each run of changed characters
+            if (text[col] == lcdbuf[row][col]) ++col;
+            else {
+               lcdhw.setCursor(col, row);
+               for (; col < 20 && text[col] != lcdbuf[row][col]; ++col) {
+                  lcdhw.print(text[col]);
+                  lcdbuf[row][col] = text[col]; } } } }
+   lcd_dirty_rows = 0; }
+
 void mode_message (const char *msg) {
-   lcdclear();
    if (msg != NULLP) {  // new mode starting
-      center_message(1, msg);
-      do_title1 = true;  // restart top title
-      do_title2 = false;
-      title_timer = 0; }
+      lcd_remove(LCD_CHANGING);
+      lcd_remove(LCD_STEP);
+      lcd_post(LCD_MODE, 0, "%s", msg);
+      lcd_rotation = 0;  // restart top title
+      lcd_rotate_msecs = millis();
+      lcd_redraw(); }
    else {  // changing mode
-      center_message(0, "changing mode"); } }
+      lcd_post(LCD_CHANGING, 0, "changing mode");
+      lcd_remove(LCD_MODE);
+      lcd_remove(LCD_TIME_LEFT);
+      lcd_remove(LCD_TEMP); } }
 
 //------------------------------------------------------------------------------
 //    temperature history routines
@@ -439,14 +954,29 @@ struct temphist_t temphist[TEMPHIST_ENTRIES];
 int temphist_count = 0;
 int temphist_next = 0;
 int temphist_minute_count = 0;
+volatile uint32_t temphist_nextseq = 1; // number of the next entry
 
 void temphistory_add(void) { // this is called once a minute from the interrupt routine
    if (temp_valid && ++temphist_minute_count >= TEMPHIST_DELTA_MINS) {
       temphist_minute_count = 0;
       temphist[temphist_next].timestamp = now;
-      temphist[temphist_next].temphist_temp = temp_now;
+      temphist[temphist_next].temp = temp_now;
+      temphist[temphist_next].raw = tempfilter.raw;
       if (temphist_count < TEMPHIST_ENTRIES) ++temphist_count;
-      if (++temphist_next >= TEMPHIST_ENTRIES) temphist_next = 0; } }
+      if (++temphist_next >= TEMPHIST_ENTRIES) temphist_next = 0;
+      ++temphist_nextseq; } }
+
+void temphistory_format(int ndx, char *str, int strsize) {
+   char temp[10], raw[10];
+   int hour = temphist[ndx].timestamp.hour;
+   if (temphist[ndx].timestamp.ampm == 0 ) { // AM
+      if (hour == 12) hour = 0; }
+   else { // PM
+      if (hour < 12) hour += 12; }
+   snprintf(str, strsize, "%4d-%02d-%02d %02d:%02d:%02d, %s, %s",
+            temphist[ndx].timestamp.year + 2000, temphist[ndx].timestamp.month, temphist[ndx].timestamp.date,
+            hour, temphist[ndx].timestamp.min, temphist[ndx].timestamp.sec,
+            format_temp(temphist[ndx].temp, temp), format_temp(temphist[ndx].raw, raw)); }
 
 void temphistory_dump(void * parm, void (*print)(void * parm, const char *line)) {
    if (temphist_count > 0) {
@@ -454,19 +984,26 @@ void temphistory_dump(void * parm, void (*print)(void * parm, const char *line))
       if (ndx < 0) ndx += TEMPHIST_ENTRIES;
       for (int cnt = 0; cnt < temphist_count; ++cnt) {
          char str[100];
-         int hour = temphist[ndx].timestamp.hour;
-         if (temphist[ndx].timestamp.ampm == 0 ) { // AM
-            if (hour == 12) hour = 0; }
-         else { // PM
-            if (hour < 12) hour += 12; }
-         snprintf(str, sizeof(str), "%4d-%02d-%02d %02d:%02d:%02d, %d",
-                  temphist[ndx].timestamp.year + 2000, temphist[ndx].timestamp.month, temphist[ndx].timestamp.date,
-                  hour, temphist[ndx].timestamp.min, temphist[ndx].timestamp.sec,
-                  temphist[ndx].temphist_temp);
+         temphistory_format(ndx, str, sizeof(str));
          print(parm, str);
          if (++ndx >= TEMPHIST_ENTRIES) ndx = 0; } }
    else print(parm, "no temperature history"); }
 
+void temphistory_dump_after(void * parm, void (*print)(void * parm, const char *line), uint32_t after) {
+   // show the entries numbered after "after", each starting with its number
+   uint32_t nextseq = temphist_nextseq, count = temphist_count;
+   int next = temphist_next;
+   if (after + 1 >= nextseq) return;
+   if (nextseq - (after + 1) < count) count = nextseq - (after + 1);
+   int ndx = next - (int) count;
+   if (ndx < 0) ndx += TEMPHIST_ENTRIES;
+   for (uint32_t seq = nextseq - count; seq < nextseq; ++seq) {
+      char str[100];
+      int len = snprintf(str, sizeof(str), "%lu ", (unsigned long) seq);
+      temphistory_format(ndx, str + len, sizeof(str) - len);
+      print(parm, str);
+      if (++ndx >= TEMPHIST_ENTRIES) ndx = 0; } }
+
 void temphistory_dprint(void *parm, const char *msg) {
    Serial.println(msg); }
 
@@ -534,32 +1071,33 @@ byte wait_for_button (void) { // wait for a button to be pushed
    while ((button = check_for_button()) == 0xff);
    return button; }
 
-bool menu_button_pushed;
-bool yesno(byte row, bool return_if_menu_button, const char *msg) {
-   assert_that(strlen(msg) <= 20, "bad msg in yesno", strlen(msg));
-   center_message(row, msg);
-   assert_that(row < 3, "bad row in yesno", row);
-   center_message(row + 1, UPARROW " if yes, " DOWNARROW " if no");
-   byte button;
-   do {
-      button = wait_for_button();
-      menu_button_pushed = button == MENU_BUTTON; }
-   while (button != UPARROW_BUTTON && button != DOWNARROW_BUTTON
-          && (!return_if_menu_button || !menu_button_pushed));
-   return button == UPARROW_BUTTON; }
-
-void setrelay(uint16_t relay_mask, bool whichway) {
-   static uint16_t relay_status = 0;  // which relays are on
+#include "interlocks.h"         // the relay interlock rules
+
+bool setrelay(uint16_t relay_mask, bool whichway) { // return false if an interlock prevented it
+   static uint16_t last_rejected = 0; // (so we don't fill the log with repeats)
+   uint16_t new_status;
    //dprint("relays %04X %s, from %04X ", relay_mask, whichway == RELAY_ON ? "on" : "off", relay_status);
-   if (whichway == RELAY_ON) relay_status |= relay_mask;
-   else relay_status &= ~relay_mask;
+   if (whichway == RELAY_ON) new_status = relay_status | relay_mask;
+   else new_status = relay_status & ~relay_mask;
+   if (!interlocks_ready) interlocks_init();
+   if (!relays_allowed(new_status)) {
+      int rule = interlock_violated(new_status);
+      dprint("relays %04X rejected by interlock %d\n", new_status, rule);
+      ++interlock_rejections;
+      if (new_status != last_rejected) {
+         last_rejected = new_status;
+         log_eventf(EV_INTERLOCK, LOGFMT_INTERLOCK, new_status, rule); }
+      return false; }
+   relay_status = new_status;
    //dprint("to %04X\n", relay_status);
    Wire.beginTransmission(RELAYS1to8); // ADG728 analog mux #1
    Wire.write(relay_status >> 8);
    Wire.endTransmission();
    Wire.beginTransmission(RELAYS9to10); // ADG728 analog mux #2
    Wire.write(relay_status & 0xff);
-   Wire.endTransmission(); }
+   Wire.endTransmission();
+   lcd_scrub_soon(); // in case the switching garbled the display
+   return true; }
 
 #if DEBUG
 void do_light_button_tests(void) {
@@ -608,110 +1146,212 @@ void do_light_button_tests(void) {
 //    heater and pump control routines
 //------------------------------------------------------------------------------
 
-void heater_off (void) {
-   if (heater_mode != HEATING_NONE) {
-      center_message(2, " "); // remove time left display
-      center_message(3, " "); // remove temperature display
-      setrelay(HEAT_SPA_RELAY + HEAT_POOL_RELAY, RELAY_OFF);
-      setLED(TEMPCTL_RED_LED + TEMPCTL_BLUE_LED, LED_OFF);
-      if (heater_on) {
-         heater_cooldown_secs_left = DELAY_HEATER_OFF;
-         heater_on = false; }
-      heater_mode = HEATING_NONE;
-      if (heater_cooldown_secs_left) {
-         do {
-            char msg[25];
-            sprintf(msg, "heater cooling... %d", heater_cooldown_secs_left);
-            center_message(2, msg);
-            watchdog_poke(); }
-         while (heater_cooldown_secs_left); // interrupt routine decrements this
-         center_message(2, " "); } } }
+/* Changing from one mode to another is done by planning the smallest sequence of steps
+   that gets the equipment from its current state to the new state, and then executing it.
+   The rules are:
+    - The spa jets and pool light are independent of everything else.
+    - The valves must only move when the pumps are off, and they take a long time to move.
+    - The pump must keep running after the heater turns off, until it has cooled down.
+      So the cooldown overlaps whatever the new mode does if the pump doesn't change,
+      but it must finish before the pump is turned off to move the valves.
+    - The heater must only be turned on after the pump that feeds it is running.
+   Anything that doesn't need to change isn't touched. Switching between filtering and heating
+   the same body of water, for example, doesn't stop the pump or move the valves. */
+
+static const char *actuation_names[] = {
+   "spa jets", "pool light", "heater off", "heater cooldown", "pump off", "valves", "pump on", "heater on" };
+
+int plan_transition(const struct plant_t *from, const struct plant_t *to, struct plan_step_t *steps) {
+   // create the plan for getting from one state to another, and return the number of steps
+   int nsteps = 0;
+   #define STEP(act, setting, secs) { \
+      assert_that(nsteps < MAX_PLAN_STEPS, "plan too long"); \
+      steps[nsteps].action = act; steps[nsteps].arg = setting; steps[nsteps].settle_secs = secs; ++nsteps; }
+   assert_that(to->heater == HEATING_NONE || to->pump != PUMP_NONE, "heater without pump");
+   if (to->spa_jets != from->spa_jets) STEP(ACT_SPA_JETS, to->spa_jets, 0);
+   if (to->pool_light != from->pool_light) STEP(ACT_POOL_LIGHT, to->pool_light, 0);
+   bool move_valves = to->valves != from->valves && to->valves != VALVES_UNDEFINED;
+   bool stop_pump = from->pump != PUMP_NONE && (move_valves || to->pump != from->pump);
+   if (from->heater != HEATING_NONE && (to->heater != from->heater || stop_pump))
+      STEP(ACT_HEATER_OFF, HEATING_NONE, 0);
+   if (stop_pump) {
+      STEP(ACT_WAIT_COOLDOWN, 0, 0);
+      STEP(ACT_PUMP_OFF, PUMP_NONE, DELAY_PUMP_OFF); }
+   if (move_valves) STEP(ACT_VALVES, to->valves, DELAY_VALVE_CHANGE);
+   if (to->pump != PUMP_NONE && (stop_pump || from->pump == PUMP_NONE))
+      STEP(ACT_PUMP_ON, to->pump, DELAY_PUMP_ON);
+   if (to->heater != HEATING_NONE && (to->heater != from->heater || stop_pump))
+      STEP(ACT_HEATER_ON, to->heater, 0);
+   #undef STEP
+   return nsteps; }
+
+void set_spa_jets(bool on) {
+   setLED(SPA_JETS_LED, on ? LED_ON : LED_OFF);
+   setrelay(SPA_JETS_PUMP_RELAY, on ? RELAY_ON : RELAY_OFF);
+   spa_jets_timer = on ? SPA_JETS_TIMEOUT : 0;
+   spa_jets_on = on; }
+
+void set_pool_light(bool on) {
+   setLED(POOL_LIGHT_LED, on ? LED_ON : LED_OFF);
+   setrelay(POOL_LIGHT_RELAY, on ? RELAY_ON : RELAY_OFF);
+   light_timer = on ? POOL_LIGHT_TIMEOUT : 0;
+   pool_light_on = on; }
+
+void set_heater_off(void) {
+   lcd_remove(LCD_TIME_LEFT);
+   lcd_remove(LCD_TEMP);
+   setrelay(HEAT_SPA_RELAY + HEAT_POOL_RELAY, RELAY_OFF);
+   setLED(TEMPCTL_RED_LED + TEMPCTL_BLUE_LED, LED_OFF);
+   if (heater_on) {
+      heater_cooldown_secs_left = DELAY_HEATER_OFF;
+      heater_on = false; }
+   heater_mode = HEATING_NONE; }
 
 void spa_heater_mode(void) {
-   target_temp = 102;  // initial target temperature
+   target_temp = DEGREES(102);  // initial target temperature
    setrelay(HEAT_POOL_RELAY, RELAY_OFF);
-   setrelay(HEAT_SPA_RELAY, RELAY_ON);
-   setLED(TEMPCTL_RED_LED, LED_ON);
-   heater_on = true;
+   heater_on = setrelay(HEAT_SPA_RELAY, RELAY_ON);
+   setLED(heater_on ? TEMPCTL_RED_LED : TEMPCTL_BLUE_LED, LED_ON);
    heater_mode = HEATING_SPA; }
 
 void pool_heater_mode(void) {
-   target_temp = 80;  // initial target temperature
+   target_temp = DEGREES(80);  // initial target temperature
    setrelay(HEAT_SPA_RELAY, RELAY_OFF);
-   setrelay(HEAT_POOL_RELAY, RELAY_ON);
-   setLED(TEMPCTL_RED_LED, LED_ON);
-   heater_on = true;
+   heater_on = setrelay(HEAT_POOL_RELAY, RELAY_ON);
+   setLED(heater_on ? TEMPCTL_RED_LED : TEMPCTL_BLUE_LED, LED_ON);
    heater_mode = HEATING_POOL; }
 
-void pumps_off (void) {
-   heater_off();
-   if (pump_status != PUMP_NONE) {
-      setrelay(POOL_PUMP_RELAY + SPA_PUMP_RELAY, RELAY_OFF);
-      pump_status = PUMP_NONE;
-      center_message(3, " "); // remove temperature display
-      center_message(2, "stopping pump");
-      longdelay(1000 * DELAY_PUMP_OFF);
-      center_message(2, " "); } }
-
-void pump_on (pump_status_t pump) {
-   if (pump == PUMP_SPA)
-      setrelay(SPA_PUMP_RELAY, RELAY_ON);
-   else if (pump == PUMP_POOL)
-      setrelay(POOL_PUMP_RELAY, RELAY_ON);
-   else assert_that(false, "Bad call to pump_on");
-   pump_status = pump;
-   center_message(2, "starting pump");
-   longdelay(1000 * DELAY_PUMP_ON);
-   center_message(2, " "); }
-
-void setvalveconfig(vconfig_t config) {
-   if (valve_config != config) {
-      pumps_off();
-      switch (config) {
-         case VALVES_HEAT_SPA:
-            setrelay(POOL_VALVE_RELAY, VALVE_RIGHT);
-            setrelay(SPA_VALVE_RELAY, VALVE_RIGHT);
-            setrelay(HEATER_VALVE_RELAY, VALVE_RIGHT);
+void set_valve_relays(vconfig_t config) {
+   assert_that(config > VALVES_UNDEFINED && config <= VALVES_EMPTY_SPA, "Bad call to setconfig");
+   setrelay(VALVE_RELAYS & ~valve_relays[config], RELAY_OFF);
+   setrelay(valve_relays[config], RELAY_ON); }
+
+void change_plant(const struct plant_t *to) { // plan and execute a change of the equipment state
+   struct plant_t from = {valve_config, pump_status, heater_mode, spa_jets_on, pool_light_on };
+   struct plan_step_t steps[MAX_PLAN_STEPS];
+   int nsteps = plan_transition(&from, to, steps);
+   for (int ndx = 0; ndx < nsteps; ++ndx) {
+      struct plan_step_t *step = &steps[ndx];
+      dprint("plan step %d of %d: %s %d\n", ndx + 1, nsteps, actuation_names[step->action], step->arg);
+      switch (step->action) {
+         case ACT_SPA_JETS:
+            set_spa_jets(step->arg);
             break;
-         case VALVES_HEAT_POOL:
-            setrelay(POOL_VALVE_RELAY, VALVE_LEFT);
-            setrelay(SPA_VALVE_RELAY, VALVE_LEFT);
-            setrelay(HEATER_VALVE_RELAY, VALVE_LEFT);
+         case ACT_POOL_LIGHT:
+            set_pool_light(step->arg);
             break;
-         case VALVES_FILL_SPA:
-            setrelay(POOL_VALVE_RELAY, VALVE_LEFT);
-            setrelay(SPA_VALVE_RELAY, VALVE_RIGHT);
-            setrelay(HEATER_VALVE_RELAY, VALVE_RIGHT);
+         case ACT_HEATER_OFF:
+            set_heater_off();
             break;
-         case VALVES_EMPTY_SPA:
-            setrelay(POOL_VALVE_RELAY, VALVE_RIGHT);
-            setrelay(SPA_VALVE_RELAY, VALVE_RIGHT);
-            setrelay(HEATER_VALVE_RELAY, VALVE_LEFT);
+         case ACT_WAIT_COOLDOWN:
+            while (heater_cooldown_secs_left) { // interrupt routine decrements this
+               lcd_post(LCD_STEP, 0, "heater cooling... %d", heater_cooldown_secs_left);
+               lcd_render();
+               lcd_scrub();
+               checkpoint_save();
+               watchdog_poke(); }
             break;
-         default:
-            assert_that(false, "Bad call to setconfig"); }
-      for (byte timeleft = DELAY_VALVE_CHANGE; timeleft; --timeleft) {
-         center_messagef(2, "setting valves... %d", timeleft);
-         delay(1000);  // seconds countdown
-         watchdog_poke(); }
-      center_message(2, " ");
-      valve_config = config; } }
-
-void enter_idle_mode (void) {
-   setLED (HEAT_SPA_LED | HEAT_POOL_LED | FILTER_SPA_LED | FILTER_POOL_LED | SPA_WATER_LEVEL_LED, LED_OFF);  // turn off all the mode LEDs
-   mode_message (NULLP); // "changing"
-   pumps_off();  // turn off the heater and pumps
-   mode_timer = 0;
-   if (mode != MODE_IDLE) log_event(EV_IDLE);
-   mode = MODE_IDLE;
-   filter_autostarted = false;
-   mode_message(" "); // blank mode message resets title line timing
-}
+         case ACT_PUMP_OFF:
+            setrelay(POOL_PUMP_RELAY + SPA_PUMP_RELAY, RELAY_OFF);
+            pump_status = PUMP_NONE;
+            lcd_remove(LCD_TEMP);
+            lcd_post(LCD_STEP, 0, "stopping pump");
+            break;
+         case ACT_VALVES:
+            set_valve_relays((enum vconfig_t) step->arg);
+            valve_config = VALVES_UNDEFINED; // until they're done moving
+            checkpoint_save();
+            break;
+         case ACT_PUMP_ON:
+            setrelay(step->arg == PUMP_SPA ? SPA_PUMP_RELAY : POOL_PUMP_RELAY, RELAY_ON);
+            pump_status = (enum pump_status_t) step->arg;
+            lcd_post(LCD_STEP, 0, "starting pump");
+            break;
+         case ACT_HEATER_ON:
+            if (step->arg == HEATING_SPA) spa_heater_mode();
+            else pool_heater_mode();
+            break; }
+      for (byte timeleft = step->settle_secs; timeleft; --timeleft) {
+         if (step->action == ACT_VALVES)
+            lcd_post(LCD_STEP, 0, "setting valves... %d", timeleft); // seconds countdown
+         longdelay(1000); }
+      if (step->settle_secs) lcd_remove(LCD_STEP);
+      if (step->action == ACT_VALVES) {
+         valve_config = (enum vconfig_t) step->arg;
+         checkpoint_save(); } } }
+
+void change_equipment(vconfig_t valves, pump_status_t pump, heater_t heater) {
+   // change the valves, pump, and heater, leaving the spa jets and pool light alone
+   struct plant_t to = {valves, pump, heater, spa_jets_on, pool_light_on };
+   change_plant(&to); }
+
+void setvalveconfig(vconfig_t config) { // stop the pumps and set the valves
+   if (valve_config != config)
+      change_equipment(config, PUMP_NONE, HEATING_NONE); }
+
+void heater_pause(void) { // turn the heater off, but stay in the heating mode
+   setrelay(HEAT_SPA_RELAY + HEAT_POOL_RELAY, RELAY_OFF);
+   setLED(TEMPCTL_BLUE_LED, LED_ON);
+   setLED(TEMPCTL_RED_LED, LED_OFF);
+   heater_cooldown_secs_left = DELAY_HEATER_OFF;
+   heater_on = false; }
 
-byte read_temp (void) {  // read temperature from DS18B20 one-wire temp sensor
+//------------------------------------------------------------------------------
+//    temperature sensor routines
+//------------------------------------------------------------------------------
+/* Each reading goes through a filter before anybody uses it, so that one bad 1-Wire
+   read can't switch the heater or get into the history. A reading with a bad CRC is
+   dropped, and so is an impossible temperature: the 85C that the DS18B20 reports
+   before its first conversion, or the 32F of a bus that reads all zeros. The median
+   of the last three good readings removes single spikes, the result can only move
+   TEMP_MAX_STEP per reading, and an exponential moving average smooths it. */
+
+#define TEMP_PLAUSIBLE_MIN DEGREES(33)  // readings outside this range are dropped
+#define TEMP_PLAUSIBLE_MAX DEGREES(130)
+#define TEMP_MAX_STEP DEGREES(1)        // the most the result moves for one reading
+#define TEMP_EMA_N 4                    // the average weighs each reading 1/TEMP_EMA_N
+#define TEMP_MAX_BAD_READS 8            // dropped in a row before we stop trusting it (2 sec)
+
+void temp_filter_reset(struct temp_filter_t *f) { // start over, because the water changed
+   f->count = f->next = f->bad_in_row = 0;
+   f->valid = false; }
+
+int16_t median3(int16_t a, int16_t b, int16_t c) {
+   if (a > b) { int16_t t = a; a = b; b = t; }
+   return c < a ? a : c > b ? b : c; }
+
+bool temp_filter_add(struct temp_filter_t *f, bool ok, int16_t raw) {
+   // add a reading, which is ok if its CRC was; return whether "filtered" is usable
+   if (ok) {
+      f->raw = raw;
+      if (raw < TEMP_PLAUSIBLE_MIN || raw > TEMP_PLAUSIBLE_MAX) {
+         ++f->implausible;
+         ok = false; } }
+   if (!ok) {
+      if (f->bad_in_row < 255) ++f->bad_in_row; }
+   else {
+      f->bad_in_row = 0;
+      f->window[f->next] = raw;
+      f->next = (f->next + 1) % 3;
+      if (f->count < 3) ++f->count;
+      int16_t median = f->count < 3 ? raw : median3(f->window[0], f->window[1], f->window[2]);
+      if (f->count == 1) f->ema_sum = (int32_t) median * TEMP_EMA_N; // the first one
+      else f->ema_sum += median - f->ema_sum / TEMP_EMA_N;
+      int16_t filtered = (f->ema_sum + (f->ema_sum < 0 ? -TEMP_EMA_N / 2 : TEMP_EMA_N / 2)) / TEMP_EMA_N;
+      if (f->count > 1 && (filtered > f->filtered + TEMP_MAX_STEP || filtered < f->filtered - TEMP_MAX_STEP)) {
+         filtered = filtered > f->filtered ? f->filtered + TEMP_MAX_STEP : f->filtered - TEMP_MAX_STEP;
+         f->ema_sum = (int32_t) filtered * TEMP_EMA_N;
+         ++f->rate_limited; }
+      f->filtered = filtered; }
+   f->valid = f->count > 0 && f->bad_in_row < TEMP_MAX_BAD_READS;
+   return f->valid; }
+
+bool read_temp (int16_t *temp) {  // read temperature from DS18B20 one-wire temp sensor
+   // return false if there isn't a good filtered temperature, in tenths of a degree F
+   bool ok = true;
+   int16_t raw = simulated_temp;
    if (have_tempsensor) {
       byte data[12];
-      unsigned int temp;
       tempsensor.reset();
       tempsensor.select(tempsensor_addr);
       tempsensor.write(0x44, 1); // start conversion w/ parasite power on at the end
@@ -721,10 +1361,41 @@ byte read_temp (void) {  // read temperature from DS18B20 one-wire temp sensor
       tempsensor.write(0xBE);  // read scratchpad
       for (byte i = 0; i < 9; ++i)
          data[i] = tempsensor.read();
-      temp = (data[1] << 8) | (data[0] & 0xfc ); // zero low 2 bits for 10-bit resolution
-      // temp is 16*Celsius; do limited-range conversion to Fahrenheit
-      return (temp * 9) / (5 * 16) + 32; }
-   else return simulated_temp; }
+      if (OneWire::crc8(data, 8) != data[8]) {
+         ++tempfilter.crc_errors;
+         ok = false; }
+      else {
+         raw = (data[1] << 8) | (data[0] & 0xfc ); // zero low 2 bits for 10-bit resolution
+         // raw is 16*Celsius, so tenths of Fahrenheit is raw * 10 * 9 / (5 * 16) + 320, rounded
+         int32_t tenths = (int32_t) raw * 9;
+         raw = (tenths + (tenths < 0 ? -4 : 4)) / 8 + 320; } }
+   if (!temp_filter_add(&tempfilter, ok, raw)) {
+      if (tempfilter.bad_in_row == TEMP_MAX_BAD_READS) // (only once until it recovers)
+         log_eventf(EV_TEMP_READINGS_BAD, LOGFMT_TEMP_READINGS_BAD,
+                    (int) tempfilter.crc_errors, (int) tempfilter.implausible);
+      return false; }
+   *temp = tempfilter.filtered;
+   return true; }
+
+int16_t temp_shown(int16_t temp) { // convert tenths of a degree F to tenths of the units we show
+   #if TEMP_CELSIUS
+   int32_t tenths = ((int32_t) temp - 320) * 10;
+   return (tenths + (tenths < 0 ? -9 : 9)) / 18;
+   #else
+   return temp;
+   #endif
+}
+
+int degrees_f(int16_t temp) { // rounded to whole degrees F, for the log, which outlives TEMP_CELSIUS
+   return (temp + (temp < 0 ? -5 : 5)) / 10; }
+
+char *format_tenths(int16_t temp, char *string) { // "" if there wasn't a temperature
+   if (temp == ARCHIVE_NO_TEMP) string[0] = 0;
+   else sprintf(string, "%s%d.%d", temp < 0 ? "-" : "", abs(temp) / 10, abs(temp) % 10);
+   return string; }
+
+char *format_temp(int16_t temp, char *string) { // in the units we show, like "101.5"
+   return format_tenths(temp == ARCHIVE_NO_TEMP ? temp : temp_shown(temp), string); }
 
 
 //------------------------------------------------------------------------------
@@ -741,14 +1412,19 @@ bool watchdog_setup(void) { // enable the watchdog timer
    esp_task_wdt_add(NULL); // add current thread to WDT watch
    return reason == ESP_RST_INT_WDT || reason == ESP_RST_TASK_WDT || reason == ESP_RST_WDT; }
 
+volatile unsigned long controller_heartbeat = 0; // for the webserver's load shedding
+
 void watchdog_poke(void) {
    esp_err_t error = esp_task_wdt_reset();  // routine to poke the watchdog to prevent a reset
+   if (xPortGetCoreID() == cpu_core) controller_heartbeat = millis(); // (the webserver pokes too)
    yield(); // and do a yield to FreeRTOS
    return; }
 
 void longdelay(unsigned long msec) { // a long delay during which we poke the watchdog
-   while (msec > 100) {
+   while (msec > 100) {          // and keep the display current
       watchdog_poke();
+      lcd_render();
+      lcd_scrub();
       delay(100);
       msec -= 100; }
    if (msec > 0) delay(msec); }
@@ -851,7 +1527,8 @@ void do_special_test(void) {
    //***  eventually solved by using snubbers across the 5V relay contacts.
 
    enter_idle_mode();
-   mode_message("special relay test");
+   lcdclear(); // (we're drawing for the spa water level menu)
+   center_message(1, "special relay test");
    center_message(2, "press a relay button");
    relay = 0xff;
    button = wait_for_button();
@@ -870,147 +1547,114 @@ void do_special_test(void) {
    enter_idle_mode(); }
 #endif
 
+//-------------------------------------------------------
+//  Mode table
+//-------------------------------------------------------
+
+#include "modes.h"              // the mode table
+
+void leave_mode (void) { // stop the current mode, but leave the equipment alone
+   uint16_t leds = 0;
+   for (int ndx = 0; ndx < NUM_MODES; ++ndx) leds |= mode_table[ndx].leds;
+   setLED (leds, LED_OFF);  // turn off all the mode LEDs
+   mode_message (NULLP); // "changing"
+   mode_timer = 0;
+   filter_autostarted = false; }
+
+void enter_idle_mode (void) {
+   leave_mode();
+   change_equipment(valve_config, PUMP_NONE, HEATING_NONE);  // turn off the heater and pumps
+   if (mode != MODE_IDLE) log_event(EV_IDLE);
+   mode = MODE_IDLE;
+   mode_message(" "); // blank mode message resets title line timing
+}
+
+void check_mode_interlocks(void) { // make sure every mode's equipment state is allowed
+   for (int ndx = 0; ndx < NUM_MODES; ++ndx) {
+      const struct mode_desc_t *desc = &mode_table[ndx];
+      uint16_t relays = equipment_relays(desc->valves, desc->pump, desc->heater);
+      assert_that(relays_allowed(relays), "mode %d interlock %d", ndx, interlock_violated(relays));
+      if (desc->alt_valves != VALVES_UNDEFINED) { // (which isn't a valve position)
+         relays = equipment_relays(desc->alt_valves, desc->pump, desc->heater);
+         assert_that(relays_allowed(relays), "mode %d alt interlock %d", ndx, interlock_violated(relays)); } } }
+
+void heater_disabled(void) {
+   if (mode != MODE_IDLE) enter_idle_mode();
+   lcd_post(LCD_HEATER_DISABLED, 2000, "heater disabled!"); }
+
+void start_mode(enum global_mode_t newmode) {
+   const struct mode_desc_t *desc = &mode_table[newmode];
+   if (desc->needs_heater && !config_data.heater_allowed) {
+      heater_disabled();
+      return; }
+   if (mode != MODE_IDLE) leave_mode();
+   setLED(desc->leds, LED_ON);
+   mode_message(NULLP); // "changing"
+   vconfig_t valves = desc->valves;
+   if (config_data.heater_allowed && desc->alt_valves != VALVES_UNDEFINED && valve_config == desc->alt_valves)
+      valves = desc->alt_valves; // we're already in the alternate configuration, so use it
+   change_equipment(valves, desc->pump, desc->heater);
+   mode_timer = desc->config_timeout ? *desc->config_timeout : desc->timeout;
+   mode = newmode;
+   log_event(desc->event);
+   mode_message(desc->label); }
+
+void toggle_mode(enum global_mode_t newmode) { // a mode button turns its mode on or off
+   if (mode == newmode) enter_idle_mode();
+   else start_mode(newmode); }
+
 //-------------------------------------------------------
 //  Button action routines
 //-------------------------------------------------------
 
 void heat_spa_pushed(void) {
-   if (mode == MODE_HEAT_SPA)  // turning off spa
-      enter_idle_mode();
-   else { // turning on spa
-      if (mode != MODE_IDLE) enter_idle_mode();
-      if (config_data.heater_allowed) {
-         setLED(HEAT_SPA_LED, LED_ON);
-         mode_message(NULLP); // "changing"
-         setvalveconfig(VALVES_HEAT_SPA);
-         pump_on(PUMP_SPA);
-         spa_heater_mode();
-         mode_timer = MODE_SPA_TIMEOUT;
-         mode = MODE_HEAT_SPA;
-         log_event(EV_HEAT_SPA);
-         mode_message("heating spa"); }
-      else {
-         mode_message("heater disabled!");
-         longdelay(2000);
-         mode_message(" "); } } }
+   toggle_mode(MODE_HEAT_SPA); }
 
 void heat_pool_pushed (void) {
-   if (mode == MODE_HEAT_POOL)  // turning off pool
-      enter_idle_mode();
-   else { // turning on pool
-      if (mode != MODE_IDLE) enter_idle_mode();
-      if (config_data.heater_allowed) {
-         setLED(HEAT_POOL_LED, LED_ON);
-         mode_message(NULLP); // "changing"
-         setvalveconfig(VALVES_HEAT_POOL);
-         pump_on(PUMP_POOL);
-         pool_heater_mode();
-         mode_timer = MODE_POOL_TIMEOUT;
-         log_event(EV_HEAT_POOL);
-         mode = MODE_HEAT_POOL;
-         mode_message("heating pool"); }
-      else {
-         mode_message("heater disabled!");
-         longdelay(2000);
-         mode_message(" "); } } }
-
-void spa_water_level_pushed (void) {
-   byte button;
-
-   if (mode == MODE_FILL_SPA || mode == MODE_EMPTY_SPA)   // stopping water level change
-      enter_idle_mode();
-   else { // starting water level change
-      if (mode != MODE_IDLE) enter_idle_mode();
-      if (config_data.heater_allowed) { // need heater plumbing path to fill or empty spa
-         setLED(SPA_WATER_LEVEL_LED, LED_ON);
-         lcdclear(); lcdprint("press \x02 to fill spa"); // uparrow
-         lcdsetCursor(0, 1); lcdprint("press \x01 to empty spa"); // downarrow
-         lcdsetCursor(0, 2); lcdprint("any other cancels");
-         #if DEBUG
-         Serial.println(":: press up / down to fill / empty spa");
-         #endif
-         button = wait_for_button();
-         mode_message(NULLP); // "changing"
-         if (button == UPARROW_BUTTON) {
-            setvalveconfig(VALVES_FILL_SPA);
-            pump_on(PUMP_POOL);
-            mode_timer = MODE_FILL_TIMEOUT;
-            log_event(EV_FILL_SPA);
-            mode = MODE_FILL_SPA;
-            mode_message("filling spa"); }
-         else if (button == DOWNARROW_BUTTON) {
-            setvalveconfig(VALVES_EMPTY_SPA);
-            pump_on(PUMP_SPA);
-            mode_timer = MODE_EMPTY_TIMEOUT;
-            mode = MODE_EMPTY_SPA;
-            log_event(EV_EMPTY_SPA);
-            mode_message("emptying spa"); }
-         #if ALLOW_SPECIAL_TEST_MODE
-         else if (button == MENU_BUTTON)
-            do_special_test();
-         #endif
-      }
-      else {
-         mode_message("heater disabled!");
-         longdelay(2000); } } }
+   toggle_mode(MODE_HEAT_POOL); }
 
 void filter_spa_pushed (void) {
-   if (mode == MODE_FILTER_SPA)   // turning off spa filtering
-      enter_idle_mode();
-   else { // turning on spa filtering
-      if (mode != MODE_IDLE) enter_idle_mode();
-      setLED(FILTER_SPA_LED, LED_ON);
-      mode_message(NULLP); // "changing"
-      // If we can't use the heater, we must filter the spa in the "heat pool" configuration.
-      // Otherwise we can use either the "heat pool" or "heat spa" configuration
-      if (!config_data.heater_allowed || (valve_config != VALVES_HEAT_POOL && valve_config != VALVES_HEAT_SPA))
-         setvalveconfig(VALVES_HEAT_POOL);
-      pump_on(PUMP_SPA);
-      mode_timer = config_data.filter_spa_mins;
-      log_event(EV_FILTER_SPA);
-      mode = MODE_FILTER_SPA;
-      mode_message("filtering spa"); } }
+   toggle_mode(MODE_FILTER_SPA); }
 
 void filter_pool_pushed (void) {
-   if (mode == MODE_FILTER_POOL)   // turning off pool filtering
+   toggle_mode(MODE_FILTER_POOL); }
+
+void spa_water_level_pushed (void) {
+   if (mode == MODE_FILL_SPA || mode == MODE_EMPTY_SPA)   // stopping water level change
       enter_idle_mode();
-   else { // turning on spa filtering
-      if (mode != MODE_IDLE) enter_idle_mode();
-      setLED(FILTER_POOL_LED, LED_ON);
-      mode_message(NULLP); // "changing"
-      // If we can't use the heater, we must filter the pool in the "heat spa" configuration.
-      // Otherwise we can use either the "heat pool" or "heat spa" configuration
-      if (!config_data.heater_allowed || (valve_config != VALVES_HEAT_POOL && valve_config != VALVES_HEAT_SPA))
-         setvalveconfig(VALVES_HEAT_SPA);
-      pump_on(PUMP_POOL);
-      mode_timer = config_data.filter_pool_mins;
-      mode = MODE_FILTER_POOL;
-      log_event(EV_FILTER_POOL);
-      mode_message("filtering pool"); } }
+   else if (!config_data.heater_allowed) // need heater plumbing path to fill or empty spa
+      heater_disabled();
+   else { // starting water level change: ask which, as a menu
+      setLED(SPA_WATER_LEVEL_LED, LED_ON);
+      ui_state = UI_WATER_LEVEL;
+      ui_drawing = true;
+      lcdclear(); lcdprint("press \x02 to fill spa"); // uparrow
+      lcdsetCursor(0, 1); lcdprint("press \x01 to empty spa"); // downarrow
+      lcdsetCursor(0, 2); lcdprint("any other cancels");
+      ui_drawing = false;
+      #if DEBUG
+      Serial.println(":: press up / down to fill / empty spa");
+      #endif
+   } }
+
+void water_level_step(byte button) { // the answer, from ui_step()
+   if (button == 0xff) return;
+   if (button == UPARROW_BUTTON)
+      start_mode(MODE_FILL_SPA);
+   else if (button == DOWNARROW_BUTTON)
+      start_mode(MODE_EMPTY_SPA);
+   #if ALLOW_SPECIAL_TEST_MODE
+   else if (button == MENU_BUTTON)
+      do_special_test();
+   #endif
+   else setLED(SPA_WATER_LEVEL_LED, LED_OFF); // cancelled: continue with whatever we were doing
+   ui_exit(); }
 
 void spa_jets_pushed (void) {
-   if (spa_jets_on) {  // turning off
-      setLED(SPA_JETS_LED, LED_OFF);
-      setrelay(SPA_JETS_PUMP_RELAY, RELAY_OFF);
-      spa_jets_timer = 0;
-      spa_jets_on = false; }
-   else { // turning on
-      setLED(SPA_JETS_LED, LED_ON);
-      setrelay(SPA_JETS_PUMP_RELAY, RELAY_ON);
-      spa_jets_timer = SPA_JETS_TIMEOUT;
-      spa_jets_on = true; } }
+   set_spa_jets(!spa_jets_on); }
 
 void pool_light_pushed (void) {
-   if (pool_light_on) {  // turning off
-      setLED(POOL_LIGHT_LED, LED_OFF);
-      setrelay(POOL_LIGHT_RELAY, RELAY_OFF);
-      light_timer = 0;
-      pool_light_on = false; }
-   else { // turning on
-      setLED(POOL_LIGHT_LED, LED_ON);
-      setrelay(POOL_LIGHT_RELAY, RELAY_ON);
-      light_timer = POOL_LIGHT_TIMEOUT;
-      pool_light_on = true; } }
+   set_pool_light(!pool_light_on); }
 
 //-------------------------------------------------------
 //  FLASH memory configuration routines
@@ -1020,7 +1664,10 @@ void pool_light_pushed (void) {
 #define ESP_PARTITION_TYPE_CONFIG (esp_partition_type_t)0x4E
 
 const esp_partition_t *config_partition = NULL;
-bool config_changed = false;
+
+RTC_NOINIT_ATTR struct checkpoint_t rtc_checkpoint; // state that survives a reset, but not a power loss
+struct checkpoint_t checkpoint = {0 };  // the latest state checkpoint in FLASH
+int checkpoint_next_slot = 0;           // where the next one goes in FLASH
 
 void write_config (void) {
    #if DEBUG
@@ -1029,7 +1676,9 @@ void write_config (void) {
    assert_that(esp_partition_erase_range(config_partition, 0, 4096) == ESP_OK,
                "can't erase config partition");
    assert_that(esp_partition_write(config_partition, 0, &config_data, sizeof(config_data)) == ESP_OK,
-               "can't write to config partition"); }
+               "can't write to config partition");
+   checkpoint_next_slot = 0; // the erase also removed the checkpoints
+   if (checkpoint_valid(&checkpoint)) checkpoint_append(); }
 
 void init_config(void) {
    char hdr_id[6];
@@ -1040,16 +1689,522 @@ void init_config(void) {
    if (memcmp(hdr_id, config_data.hdr_id, sizeof(hdr_id)) != 0) {//check for matching id string
       write_config(); // not there: write our default compiled-in config
       log_event(EV_INIT_CONFIG);
-      center_message(2, "initialized config"); }
+      boot_notice("initialized config"); }
    else { // ID seems good; read the whole header into RAM
       assert_that(esp_partition_read(config_partition, 0, &config_data, sizeof(config_data)) == ESP_OK,
                   "can't read config data from FLASH"); }
-   delay(1000); }
+   checkpoint_load(); }
+
+//-------------------------------------------------------
+//  state checkpoint routines
+//-------------------------------------------------------
+/* The few things we need to know after a restart are kept in a small
+   checkpoint record. One copy is in RTC memory, which survives everything
+   but a loss of power, and is updated every time around the main loop.
+   Another is in the FLASH config partition after the config data, appended
+   to a sequence of slots so that we only erase when they are all used. The
+   most recent valid slot is the current one. The timers and temperatures
+   change too often to write to FLASH, so that copy of them may be stale.
+
+   After a watchdog reset we resume the mode we were in. After any reset
+   that didn't remove power, the relay board still has the pump running
+   and the heater may be hot, so we keep the pump on for its cooldown. */
+
+#define CHECKPOINT_FIRST 1024 // FLASH offset of the first slot
+#define CHECKPOINT_SLOTS ((4096 - CHECKPOINT_FIRST) / CHECKPOINT_SIZE)
+static_assert(sizeof(config_data) <= CHECKPOINT_FIRST, "config data overlaps the checkpoints");
+static_assert(sizeof(struct checkpoint_t) == CHECKPOINT_SIZE, "bad checkpoint size");
+
+uint32_t checkpoint_checksum(const struct checkpoint_t *cp) {
+   const byte *ptr = (const byte *) cp;
+   uint32_t sum = 0x5a5a5a5a;
+   for (int ndx = 0; ndx < offsetof(struct checkpoint_t, checksum); ++ndx)
+      sum = ((sum << 5) | (sum >> 27)) ^ ptr[ndx];
+   return sum; }
+
+bool checkpoint_valid(const struct checkpoint_t *cp) {
+   return cp->magic == CHECKPOINT_MAGIC && cp->checksum == checkpoint_checksum(cp); }
+
+void checkpoint_append(void) { // write the checkpoint into the next FLASH slot
+   if (checkpoint_next_slot >= CHECKPOINT_SLOTS) {
+      write_config(); // all used: erase, rewrite the config, and start over at slot 0
+      return; }
+   assert_that(esp_partition_write(config_partition, CHECKPOINT_FIRST + checkpoint_next_slot * CHECKPOINT_SIZE,
+                                   &checkpoint, CHECKPOINT_SIZE) == ESP_OK,
+               "can't write checkpoint to FLASH");
+   ++checkpoint_next_slot; }
+
+void checkpoint_load(void) { // find the latest checkpoint in FLASH, and the next free slot
+   struct checkpoint_t cp;
+   checkpoint_next_slot = 0;
+   while (checkpoint_next_slot < CHECKPOINT_SLOTS) {
+      assert_that(esp_partition_read(config_partition, CHECKPOINT_FIRST + checkpoint_next_slot * CHECKPOINT_SIZE,
+                                     &cp, CHECKPOINT_SIZE) == ESP_OK,
+                  "can't read checkpoint from FLASH");
+      if (cp.magic == 0xffffffff) break; // erased: this is the next free slot
+      ++checkpoint_next_slot; // (a slot torn by a power failure is skipped)
+      if (checkpoint_valid(&cp)) checkpoint = cp; }
+   dprint("checkpoint: %d slots used, valves %d\n", checkpoint_next_slot, checkpoint.valve_config); }
+
+void checkpoint_save(void) { // record the current state, in FLASH only if it changed
+   struct checkpoint_t cp = {CHECKPOINT_MAGIC, (byte) valve_config, (byte) pump_status, (byte) mode };
+   cp.flags = (spa_jets_on ? CKP_SPA_JETS : 0) | (pool_light_on ? CKP_POOL_LIGHT : 0)
+              | (filter_autostarted ? CKP_FILTER_AUTOSTARTED : 0);
+   cp.target_temp = target_temp;
+   cp.heater_on = heater_on;
+   cp.heater_cooldown_secs = heater_cooldown_secs_left;
+   cp.mode_timer = mode_timer;
+   cp.spa_jets_timer = spa_jets_timer;
+   cp.light_timer = light_timer;
+   cp.checksum = checkpoint_checksum(&cp);
+   rtc_checkpoint = cp;
+   if (memcmp(&cp, &checkpoint, offsetof(struct checkpoint_t, target_temp)) != 0) {
+      checkpoint = cp;
+      if (config_partition) checkpoint_append(); } }
+
+bool power_was_lost(void) { // did the last reset remove power from the relay board too?
+   esp_reset_reason_t reason = esp_reset_reason();
+   return reason == ESP_RST_POWERON || reason == ESP_RST_BROWNOUT || reason == ESP_RST_UNKNOWN; }
+
+const struct checkpoint_t *checkpoint_latest(void) { // the most recent checkpoint we have
+   return checkpoint_valid(&rtc_checkpoint) ? &rtc_checkpoint : &checkpoint; }
+
+enum vconfig_t checkpoint_valves(void) { // where are the valves at startup, if we know?
+   enum vconfig_t valves = VALVES_UNDEFINED;
+   if (!power_was_lost()) {
+      // only the processor was reset; the relay board kept its power and its state,
+      // so the valves are where we last put them
+      valves = (enum vconfig_t) checkpoint_latest()->valve_config; }
+   // After a power loss the relays come up off, which drives the valves to the
+   // heat-spa position. They are already there only if that's where they were.
+   else if (checkpoint.valve_config == VALVES_HEAT_SPA) valves = VALVES_HEAT_SPA;
+   if (valves > VALVES_EMPTY_SPA) valves = VALVES_UNDEFINED;
+   dprint("reset reason %d, valves %d\n", esp_reset_reason(), valves);
+   return valves; }
+
+void checkpoint_restore(bool resume) { // set the relays at startup from the checkpoint
+   const struct checkpoint_t *cp = checkpoint_latest();
+   uint16_t relays;
+   valve_config = checkpoint_valves();
+   relays = valve_relays[valve_config];
+   if (!power_was_lost() && valve_config != VALVES_UNDEFINED && cp->pump != PUMP_NONE) {
+      // the pump is still running: leave it on, and start a cooldown if the heater was on
+      pump_status = cp->pump == PUMP_SPA ? PUMP_SPA : PUMP_POOL;
+      relays |= pump_status == PUMP_SPA ? SPA_PUMP_RELAY : POOL_PUMP_RELAY;
+      heater_cooldown_secs_left = cp->heater_on ? DELAY_HEATER_OFF : cp->heater_cooldown_secs; }
+   if (resume && !power_was_lost()) { // and so are the spa jets and pool light
+      if (cp->flags & CKP_SPA_JETS) relays |= SPA_JETS_PUMP_RELAY;
+      if (cp->flags & CKP_POOL_LIGHT) relays |= POOL_LIGHT_RELAY; }
+   if (!setrelay(relays, RELAY_ON)) { // (shouldn't happen)
+      pump_status = PUMP_NONE;
+      setrelay(valve_relays[valve_config], RELAY_ON); }
+   dprint("restored relays %04X, pump %d, cooldown %d\n", relays, pump_status, heater_cooldown_secs_left); }
+
+void checkpoint_resume(void) { // resume the mode we were in before an unplanned reset
+   struct checkpoint_t cp = *checkpoint_latest(); // (our changes will update it)
+   if (!checkpoint_valid(&cp) || cp.mode >= NUM_MODES) return;
+   if (cp.flags & CKP_SPA_JETS) {
+      set_spa_jets(true);
+      spa_jets_timer = cp.spa_jets_timer; }
+   if (cp.flags & CKP_POOL_LIGHT) {
+      set_pool_light(true);
+      light_timer = cp.light_timer; }
+   if (cp.mode != MODE_IDLE) {
+      start_mode((enum global_mode_t) cp.mode);
+      if (mode != cp.mode) return; // (the heater might have been disabled)
+      if (heater_mode == HEATING_SPA && cp.target_temp >= TEMP_MIN && cp.target_temp <= TEMP_MAX_SPA
+            || heater_mode == HEATING_POOL && cp.target_temp >= TEMP_MIN && cp.target_temp <= TEMP_MAX_POOL)
+         target_temp = cp.target_temp;
+      noInterrupts();
+      mode_timer = cp.mode_timer;
+      interrupts();
+      filter_autostarted = (cp.flags & CKP_FILTER_AUTOSTARTED) != 0;
+      log_eventf(EV_MODE_RESUMED, LOGFMT_MODE_RESUMED, cp.mode, cp.mode_timer); } }
+
+//-------------------------------------------------------
+//  long-term archive routines
+//-------------------------------------------------------
+/* The temperature history and the event log cover days, not seasons. For the
+   long term, a sample taken every minute is consolidated RRD-style into three
+   archives: 5-minute periods for a month, hourly periods for a year, and daily
+   periods for five years. Each period has the minimum, average, and maximum
+   temperature and the minutes the pool pump, spa pump, and heater were on.
+
+   Each archive is a ring of fixed-size records in the FLASH "archive"
+   partition, and a record is written once, when its period ends. A sector is
+   erased when we get to its first record, so an archive holds up to one
+   sector less than its size. At startup we find the newest record by looking
+   at the first record of each sector. Records are in time order, so a query
+   can do a binary search for where to start. The period that is accumulating
+   when we restart is lost, and nothing is recorded while the clock isn't set. */
+
+#define ESP_PARTITION_TYPE_ARCHIVE (esp_partition_type_t)0x4F
+#define ARCHIVE_SECTOR 4096
+#define ARCHIVE_EMPTY 0xffffffff  // the start time of an erased record
+static_assert(sizeof(struct archive_small_t) == 16, "bad small archive record size");
+static_assert(sizeof(struct archive_large_t) == 32, "bad large archive record size");
+
+struct archive_t {
+   const char *name;
+   uint16_t period_mins;      // how long each period is
+   uint16_t recsize;          // the size of a record in FLASH
+   uint16_t first_sector, num_sectors; // where it is in the partition
+   int num_slots;             // how many records fit
+   volatile int next_slot;    // where the next record goes
+   uint32_t last_start;       // the start of the newest record
+   struct archive_rec_t acc;  // the period we are accumulating
+} archives[NUM_ARCHIVES] = {
+   {"5min", 5, sizeof(struct archive_small_t), 0, 36 },      // 35 x 256 records: 31 days
+   {"hour", 60, sizeof(struct archive_small_t), 36, 36 },    // 35 x 256 records: 373 days
+   {"day", 24 * 60, sizeof(struct archive_large_t), 72, 16 } // 15 x 128 records: 5.2 years
+};
+#define ARCHIVE_SECTORS (72 + 16)
+
+const esp_partition_t *archive_partition = NULL;
+volatile bool archive_minute_due = false; // set once a minute by the interrupt routine
+
+uint32_t datetime_minutes(const struct datetime *dt) { // minutes since 1 Jan 2000
+   uint32_t days = dt->year * 365 + (dt->year + 3) / 4; // (2000 was a leap year)
+   for (int month = 1; month < dt->month; ++month) days += days_in_month[month];
+   if (dt->month > 2 && dt->year % 4 == 0) ++days;
+   days += dt->date - 1;
+   return (days * 24 + dt->hour % 12 + (dt->ampm ? 12 : 0)) * 60 + dt->min; }
+
+char *format_minutes(uint32_t minutes, char *string) { // as "yyyy-mm-dd hh:mm", at least 17 characters
+   int days = minutes / (24 * 60), year = 0, month = 1, length;
+   while (days >= (length = year % 4 == 0 ? 366 : 365)) {
+      days -= length;
+      ++year; }
+   while (days >= (length = days_in_month[month] + (month == 2 && year % 4 == 0))) {
+      days -= length;
+      ++month; }
+   sprintf(string, "20%02d-%02d-%02d %02d:%02d", year % 100, month, days + 1,
+           (int) (minutes / 60 % 24), (int) (minutes % 60));
+   return string; }
+
+uint16_t archive_checksum(const void *rec, int size) { // of all but the checksum at the end
+   const byte *ptr = (const byte *) rec;
+   uint16_t sum = 0x5a5a;
+   for (int ndx = 0; ndx < size - 2; ++ndx)
+      sum = ((sum << 3) | (sum >> 13)) ^ ptr[ndx];
+   return sum; }
+
+union archive_flash_t { // a record as it is in FLASH
+   struct archive_small_t small;
+   struct archive_large_t large;
+   byte bytes[sizeof(struct archive_large_t)]; };
+
+bool archive_read(struct archive_t *ar, int slot, struct archive_rec_t *rec, bool *erased) {
+   // read a record; false if it is erased, or was torn by a power failure while being written
+   union archive_flash_t buf;
+   if (esp_partition_read(archive_partition, ar->first_sector * ARCHIVE_SECTOR + slot * ar->recsize,
+                          &buf, ar->recsize) != ESP_OK) return false;
+   if (erased) {
+      *erased = true;
+      for (int ndx = 0; ndx < ar->recsize; ++ndx)
+         if (buf.bytes[ndx] != 0xff) *erased = false; }
+   memset(rec, 0, sizeof(*rec));
+#define copy(f) rec->f = ar->recsize == sizeof(buf.small) ? buf.small.f : buf.large.f
+   if (buf.small.start_min == ARCHIVE_EMPTY
+         || (ar->recsize == sizeof(buf.small) ? buf.small.checksum : buf.large.checksum)
+         != archive_checksum(&buf, ar->recsize)) return false;
+   copy(start_min); copy(temp_min); copy(temp_avg); copy(temp_max); copy(temp_samples);
+   copy(pool_pump_mins); copy(spa_pump_mins); copy(heater_mins);
+   return true;
+#undef copy
+}
+
+void archive_write(struct archive_t *ar, const struct archive_rec_t *rec) { // append a finished period
+   union archive_flash_t buf;
+   int slot = ar->next_slot;
+   uint32_t offset = ar->first_sector * ARCHIVE_SECTOR + slot * ar->recsize;
+   if (rec->start_min <= ar->last_start) return; // the clock went backwards: keep them in order
+   memset(&buf, 0, sizeof(buf));
+#define copy(f) if (ar->recsize == sizeof(buf.small)) buf.small.f = rec->f; else buf.large.f = rec->f
+   copy(start_min); copy(temp_min); copy(temp_avg); copy(temp_max); copy(temp_samples);
+   copy(pool_pump_mins); copy(spa_pump_mins); copy(heater_mins);
+#undef copy
+   if (ar->recsize == sizeof(buf.small)) buf.small.checksum = archive_checksum(&buf, ar->recsize);
+   else buf.large.checksum = archive_checksum(&buf, ar->recsize);
+   if ((slot * ar->recsize % ARCHIVE_SECTOR == 0 // the first record in a sector: erase it
+         && esp_partition_erase_range(archive_partition, offset, ARCHIVE_SECTOR) != ESP_OK)
+         || esp_partition_write(archive_partition, offset, &buf, ar->recsize) != ESP_OK) {
+      dprint("can't write %s archive at slot %d\n", ar->name, slot);
+      return; }
+   ar->last_start = rec->start_min;
+   ar->next_slot = (slot + 1) % ar->num_slots; }
+
+void archive_find_next(struct archive_t *ar) { // find where the next record goes
+   struct archive_rec_t rec;
+   int per_sector = ARCHIVE_SECTOR / ar->recsize, newest = -1, slot;
+   uint32_t newest_start = 0;
+   bool erased;
+   for (int sector = 0; sector < ar->num_sectors; ++sector) // which sector starts with the newest?
+      if (archive_read(ar, sector * per_sector, &rec, NULL) && (newest < 0 || rec.start_min > newest_start)) {
+         newest = sector;
+         newest_start = rec.start_min; }
+   ar->next_slot = 0;
+   ar->last_start = 0;
+   if (newest < 0) return; // it's empty
+   for (slot = newest * per_sector; slot < (newest + 1) * per_sector; ++slot) {
+      if (!archive_read(ar, slot, &rec, &erased)) {
+         if (!erased) slot = (newest + 1) * per_sector; // torn: skip the rest of the sector
+         break; }
+      ar->last_start = rec.start_min; }
+   ar->next_slot = slot % ar->num_slots; }
+
+void init_archive(void) {
+   // (with an older partitions.csv there is no archive partition, and we don't keep archives)
+   archive_partition = esp_partition_find_first(ESP_PARTITION_TYPE_ARCHIVE, ESP_PARTITION_SUBTYPE_ANY, NULLP);
+   if (archive_partition && archive_partition->size < ARCHIVE_SECTORS * ARCHIVE_SECTOR)
+      archive_partition = NULL;
+   if (!archive_partition) {
+      dprint("no FLASH archive partition\n");
+      return; }
+   for (int level = 0; level < NUM_ARCHIVES; ++level) {
+      struct archive_t *ar = &archives[level];
+      ar->num_slots = ar->num_sectors * (ARCHIVE_SECTOR / ar->recsize);
+      archive_find_next(ar);
+      dprint("%s archive: next slot %d of %d\n", ar->name, ar->next_slot, ar->num_slots); } }
+
+#define ARCHIVE_MAX_STEP 3 // minutes between readings of the clock that we believe without a second look
+
+void archive_minute(void) { // add this minute's sample to the period each archive is accumulating
+   static uint32_t last_minute = 0, jumped_minute = 0;
+   if (!archive_partition || datetime_invalid(now)) return; // ("now" was just read)
+   uint32_t minute = datetime_minutes(&now);
+   // One bad reading of the clock chip could start a period far in the future, and archive_write()
+   // would then refuse every record until the real time got there. So if the clock jumps, or this
+   // is the first reading, we skip the minute and only believe it if the next reading agrees.
+   if (last_minute == 0 || minute < last_minute || minute > last_minute + ARCHIVE_MAX_STEP) {
+      bool agrees = jumped_minute != 0 && minute >= jumped_minute && minute <= jumped_minute + ARCHIVE_MAX_STEP;
+      jumped_minute = minute;
+      if (!agrees) return; }
+   last_minute = minute;
+   jumped_minute = 0;
+   for (int level = 0; level < NUM_ARCHIVES; ++level) {
+      struct archive_t *ar = &archives[level];
+      struct archive_rec_t *acc = &ar->acc;
+      uint32_t start = minute - minute % ar->period_mins;
+      if (start != acc->start_min) { // a new period
+         if (acc->minutes) archive_write(ar, acc);
+         memset(acc, 0, sizeof(*acc));
+         acc->start_min = start;
+         acc->temp_min = acc->temp_avg = acc->temp_max = ARCHIVE_NO_TEMP; }
+      ++acc->minutes;
+      if (temp_valid) {
+         int16_t temp = temp_now;
+         if (acc->temp_samples == 0 || temp < acc->temp_min) acc->temp_min = temp;
+         if (acc->temp_samples == 0 || temp > acc->temp_max) acc->temp_max = temp;
+         acc->temp_sum += temp;
+         acc->temp_avg = acc->temp_sum / ++acc->temp_samples; }
+      if (pump_status == PUMP_POOL) ++acc->pool_pump_mins;
+      else if (pump_status == PUMP_SPA) ++acc->spa_pump_mins;
+      if (heater_on) ++acc->heater_mins; } }
+
+bool archive_dump(const char *level_name, int days, void *parm, void (*print)(void * parm, const char *line)) {
+   // write the records of the last "days" days as CSV lines; false if there is no such archive
+   struct archive_t *ar = NULL;
+   struct archive_rec_t rec;
+   char line[120], start[20], tmin[10], tavg[10], tmax[10];
+   for (int level = 0; level < NUM_ARCHIVES; ++level)
+      if (strcmp(level_name, archives[level].name) == 0) ar = &archives[level];
+   if (!ar || !archive_partition) return false;
+   struct datetime dt = now;
+   uint32_t now_min = datetime_invalid(dt) ? 0 : datetime_minutes(&dt);
+   uint32_t from = now_min > (uint32_t) days * 24 * 60 ? now_min - days * 24 * 60 : 0;
+   int next = ar->next_slot, per_sector = ARCHIVE_SECTOR / ar->recsize, oldest, count, lo, hi;
+   // The oldest record starts the sector after the one we're filling, or is the next
+   // slot itself if we're about to erase. If that's empty, we haven't wrapped around yet.
+   oldest = next % per_sector == 0 ? next : (next / per_sector + 1) % ar->num_sectors * per_sector;
+   if (archive_read(ar, oldest, &rec, NULL)) {
+      count = (next - oldest + ar->num_slots) % ar->num_slots;
+      if (count == 0) count = ar->num_slots; }
+   else {
+      oldest = 0;
+      count = next; }
+   for (lo = 0, hi = count; lo < hi; ) { // find the first that starts at or after "from"
+      int mid = (lo + hi) / 2;
+      if (archive_read(ar, (oldest + mid) % ar->num_slots, &rec, NULL) && rec.start_min >= from) hi = mid;
+      else lo = mid + 1; }
+   print(parm, "start, min temp, avg temp, max temp, temp minutes, pool pump minutes, spa pump minutes, heater minutes");
+   for (; lo < count; ++lo)
+      if (archive_read(ar, (oldest + lo) % ar->num_slots, &rec, NULL)) {
+         snprintf(line, sizeof(line), "%s, %s, %s, %s, %u, %u, %u, %u", format_minutes(rec.start_min, start),
+                  format_temp(rec.temp_min, tmin), format_temp(rec.temp_avg, tavg), format_temp(rec.temp_max, tmax),
+                  rec.temp_samples, rec.pool_pump_mins, rec.spa_pump_mins, rec.heater_mins);
+         print(parm, line); }
+   return true; }
+
+//-------------------------------------------------------
+//  daily rollup routines
+//-------------------------------------------------------
+/* So that questions like "when did the filter run last week?" don't need the
+   whole event log, the day's totals are accumulated a minute at a time and
+   logged as a "daily rollup" event just after midnight: minutes in each mode,
+   heater minutes and cycles, the temperature range, web requests, and errors
+   (interlock rejections and failed WiFi connections). A week is then 7 entries.
+   The totals are in RTC memory, so they survive a reset but not a power loss.
+   Heater cycles are counted a minute at a time too, which is much shorter
+   than the heater ever runs. The temperatures are logged in whole degrees, because
+   a log entry only has room for 12 arguments. */
+
+#define ROLLUP_MAGIC 0x524f4c32 // "ROL2"
+struct rollup_t {
+   uint32_t magic;
+   byte date;                   // the day of the month it's for
+   uint16_t mode_mins[NUM_MODES];
+   uint16_t heater_mins, heater_cycles;
+   int16_t temp_min, temp_max;  // tenths of a degree F (if temp_min > temp_max, there weren't any)
+   bool heater_was_on;
+   uint32_t web_requests, errors; };
+RTC_NOINIT_ATTR struct rollup_t rollup;
+int rollup_web_requests = 0, rollup_errors = 0; // the counts the last time we looked
+
+void rollup_start(void) {
+   memset(&rollup, 0, sizeof(rollup));
+   rollup.magic = ROLLUP_MAGIC;
+   rollup.date = now.date;
+   rollup.temp_min = INT16_MAX;
+   rollup.temp_max = INT16_MIN; }
+
+void rollup_minute(void) { // add this minute to the day's totals; "now" was just read
+   if (datetime_invalid(now)) return;
+   if (rollup.magic != ROLLUP_MAGIC) rollup_start(); // (the first time since power came on)
+   if (rollup.date != now.date) { // a new day: log yesterday's totals
+      log_eventf(EV_DAILY_ROLLUP, LOGFMT_DAILY_ROLLUP,
+                 rollup.mode_mins[MODE_HEAT_SPA], rollup.mode_mins[MODE_HEAT_POOL],
+                 rollup.mode_mins[MODE_FILL_SPA], rollup.mode_mins[MODE_EMPTY_SPA],
+                 rollup.mode_mins[MODE_FILTER_POOL], rollup.mode_mins[MODE_FILTER_SPA],
+                 rollup.heater_mins, rollup.heater_cycles,
+                 rollup.temp_min <= rollup.temp_max ? degrees_f(rollup.temp_min) : 0,
+                 rollup.temp_min <= rollup.temp_max ? degrees_f(rollup.temp_max) : 0,
+                 (int) rollup.web_requests, (int) rollup.errors);
+      bool heater_was_on = rollup.heater_was_on;
+      rollup_start();
+      rollup.heater_was_on = heater_was_on; }
+   if (mode < NUM_MODES) ++rollup.mode_mins[mode];
+   if (heater_on) {
+      ++rollup.heater_mins;
+      if (!rollup.heater_was_on) ++rollup.heater_cycles; }
+   rollup.heater_was_on = heater_on;
+   if (temp_valid) {
+      if (temp_now < rollup.temp_min) rollup.temp_min = temp_now;
+      if (temp_now > rollup.temp_max) rollup.temp_max = temp_now; }
+   int errors = interlock_rejections + connect_failures; // (these only increase)
+   rollup.web_requests += client_requests - rollup_web_requests;
+   rollup.errors += errors - rollup_errors;
+   rollup_web_requests = client_requests;
+   rollup_errors = errors; }
+
+//-------------------------------------------------------
+//  MQTT telemetry queue
+//-------------------------------------------------------
+/* If an MQTT broker is configured in Wifi_names.h, we publish our state to it.
+   The controller only puts messages into a queue in RAM, which never waits: if
+   the broker has been unreachable for so long that the queue is full, the oldest
+   message is discarded. The webserver task on core 0 takes them out in order
+   and publishes them; see mqtt_esp.cpp. A state message is queued when anything
+   changes, but not more than once a second, so changes that happen together go
+   in one message. A telemetry message is queued every minute. */
+
+#define MQTT_QUEUE_SIZE 200      // about 7K of RAM
+#define MQTT_STATE_MSECS 1000    // the least time between state messages
+#define MQTT_STATE_TEMP DEGREES(1) // the least temperature change for a state message
+#define MQTT_TELEMETRY_SECS 60   // the time between telemetry messages
+
+struct mqtt_msg_t mqtt_queue[MQTT_QUEUE_SIZE];
+int mqtt_oldest = 0, mqtt_count = 0;
+uint32_t mqtt_nextseq = 1, mqtt_dropped = 0;
+portMUX_TYPE mqtt_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void mqtt_enqueue(struct mqtt_msg_t *msg) {
+   portENTER_CRITICAL(&mqtt_lock);
+   if (mqtt_count >= MQTT_QUEUE_SIZE) { // full: lose the oldest
+      mqtt_oldest = (mqtt_oldest + 1) % MQTT_QUEUE_SIZE;
+      --mqtt_count;
+      ++mqtt_dropped; }
+   msg->seqnum = mqtt_nextseq++;
+   mqtt_queue[(mqtt_oldest + mqtt_count++) % MQTT_QUEUE_SIZE] = *msg;
+   portEXIT_CRITICAL(&mqtt_lock); }
+
+bool mqtt_peek(struct mqtt_msg_t *msg, uint32_t *dropped) { // get the oldest message, if there is one
+   bool gotone;
+   portENTER_CRITICAL(&mqtt_lock);
+   if ((gotone = mqtt_count > 0)) *msg = mqtt_queue[mqtt_oldest];
+   *dropped = mqtt_dropped;
+   portEXIT_CRITICAL(&mqtt_lock);
+   return gotone; }
+
+void mqtt_pop(uint32_t seqnum) { // remove a published message, unless it was discarded meanwhile
+   portENTER_CRITICAL(&mqtt_lock);
+   if (mqtt_count > 0 && mqtt_queue[mqtt_oldest].seqnum == seqnum) {
+      mqtt_oldest = (mqtt_oldest + 1) % MQTT_QUEUE_SIZE;
+      --mqtt_count; }
+   portEXIT_CRITICAL(&mqtt_lock); }
+
+void mqtt_state_check(void) { // called every time around the main loop
+   static struct mqtt_state_t last;
+   static unsigned long last_msecs = 0, telemetry_msecs = 0;
+   static bool first = true;
+   struct mqtt_msg_t msg;
+   if (!mqtt_configured) return;
+   memset(&msg, 0, sizeof(msg));
+   msg.state.mode = mode;
+   msg.state.heater_mode = heater_mode;
+   msg.state.heater_on = heater_on;
+   msg.state.pump = pump_status;
+   msg.state.valves = valve_config;
+   msg.state.spa_jets = spa_jets_on;
+   msg.state.pool_light = pool_light_on;
+   msg.state.temp_valid = temp_valid;
+   msg.state.temp = temp_valid ? temp_now : 0;
+   msg.state.target_temp = target_temp;
+   msg.state.relays = relay_status;
+   struct mqtt_state_t compare = msg.state; // (small temperature changes wait for the telemetry)
+   if (abs(compare.temp - last.temp) < MQTT_STATE_TEMP) compare.temp = last.temp;
+   unsigned long msecs = millis();
+   if (first || (memcmp(&compare, &last, sizeof(last)) != 0 && msecs - last_msecs >= MQTT_STATE_MSECS))
+      msg.kind = MQTT_STATE;
+   else if (msecs - telemetry_msecs >= MQTT_TELEMETRY_SECS * 1000UL) msg.kind = MQTT_TELEMETRY;
+   else return;
+   if (msg.kind == MQTT_STATE) {
+      last = msg.state;
+      last_msecs = msecs;
+      first = false; }
+   else telemetry_msecs = msecs;
+   msg.uptime_secs = msecs / 1000;
+   msg.time = now;
+   msg.mode_name = event_names[mode_table[mode].event];
+   msg.web_requests = client_requests;
+   mqtt_enqueue(&msg); }
 
 //-------------------------------------------------------
 // menu commands, including configuration programming
 //-------------------------------------------------------
 
+/* The menus are a state machine that loop() steps with each button push, and
+   each time around without one, so that heater control, the timeouts, and the
+   filter autostart keep running while someone is using them. While a menu is
+   showing it owns the display: the LCD routines ignore everybody else, and we
+   redraw the current mode's display when the menu exits. Configuration
+   changes are made to a copy, which is applied when we're done. */
+
+#define UI_RSSI_MSECS 250      // how often to update the signal strength
+#define UI_MESSAGE_MSECS 1500  // how long a message stays before the menu exits
+
+struct { // the state of the menus, besides ui_state
+   byte cmd;               // which menu or configuration command we're on
+   byte field;             // which field of the configuration setting
+   int eventnum;           // which event log entry is showing, or -1
+   uint32_t log_firstseq;  // the number of the oldest log entry at that time
+   struct config_t config; // the configuration being changed
+   struct config_t config_was; // what it was when the menu started
+   struct datetime time;   // the date and time being set
+   bool time_changed;
+   unsigned long msecs;    // when we last showed the RSSI, or when the message started
+} ui;
+
 // define the position of configurable fields in each programming message
 // rightmost character of the field, 0-origin
 
@@ -1068,31 +2223,8 @@ byte config_spafiltertime_columns [] = { // if setting spa filtering time
 byte config_heater_enable_columns [] = { // if setting heater enable disable
    11, 0xff }; // enable/disable
 
-int8_t get_config_changes (byte columns[], byte * field) {
-   // process arrow keys and return field value change (+1, -1), or 0 to stop
-   while (1) {
-      lcdsetCursor(columns[*field], CONFIG_ROW);
-      lcdblink();
-      switch (wait_for_button()) {  // wait for a button push
-         case MENU_BUTTON:
-            lcdnoBlink();
-            return 0;  // done
-         case UPARROW_BUTTON:
-            config_changed = true;
-            return +1;  // return "increment"
-         case DOWNARROW_BUTTON:
-            config_changed = true;
-            return -1;  // return "decrement"
-         case RIGHTARROW_BUTTON:
-            if (columns[++*field] == 0xff) *field = 0;
-            break;
-         case LEFTARROW_BUTTON:
-            if (*field == 0)
-               while (columns[++*field] != 0xff) ;
-            --*field;
-            break;
-         default: ; // ignore all other buttons
-      } } }
+byte config_wifi_power_columns [] = { // if setting WiFi power
+   1 + 3, 1 + 6, 1 + 17, 0xff }; // power save, transmit power, listen interval
 
 // adjust a field up or down, within specified bounds
 byte bound (byte value, int8_t delta /* only +-1 */ , byte min, byte max) {
@@ -1107,210 +2239,333 @@ void show_event(int eventnum) {
                "can't read log entry");
    struct logentry_t *plog = (struct logentry_t *) log_state.logdata;
    show_datetime(1, &plog->timestamp);
-   center_message(2, event_names[plog->event_type]);
-   memset(string, 0, sizeof(string)); // in case the message isn't zero-terminated
-   if (plog->event_msg[0]) memcpy(string, plog->event_msg, sizeof(string) - 1);
+   center_message(2, log_event_name(plog));
+   log_event_msg(plog, string, 21); // (at most one row)
    center_message(3, string); }
 
-bool show_eventlog(void) { //******** display the event log
-   char string[25];
-   int eventnum = -1; // haven't started yet
+void log_goto(int eventnum) { // go to log entry eventnum, where 1 is the oldest
+   if (eventnum <= log_state.numinuse / 2) {
+      flashlog_goto_oldest(&log_state);
+      while (--eventnum > 0) flashlog_goto_next(&log_state); }
+   else {
+      flashlog_goto_newest(&log_state);
+      for (int num = log_state.numinuse; num > eventnum; --num) flashlog_goto_prev(&log_state); } }
+
+void show_eventlog(void) { //******** display the event log
+   ui_state = UI_EVENTLOG;
+   ui.eventnum = -1; // haven't started yet
    center_messagef(0, "%d of %d entries", log_state.numinuse, log_state.numslots);
    center_message(1, "");
    center_message(2, LEFTARROW " and " RIGHTARROW " moves");
    center_message(3, "MENU exits");
-   if (log_state.numinuse == 0) return false; // skip if the log is empty
-   while (1) {
-      switch (wait_for_button()) {
-         case MENU_BUTTON:
-            return eventnum != -1;  // done; return true if we showed something
-         case RIGHTARROW_BUTTON: // go forward in time
-            if (eventnum < 0) {
-               flashlog_goto_oldest(&log_state); // start with oldest
-               eventnum = 1; }
-            else if (flashlog_goto_next(&log_state) == FLASHLOG_ERR_OK)   // otherwise do next newer
-               ++eventnum;
-            show_event(eventnum);
-            break;
-         case LEFTARROW_BUTTON: // go backward in time
-            if (eventnum < 0) {
-               flashlog_goto_newest(&log_state); // start with newest
-               eventnum = log_state.numinuse; }
-            else if (flashlog_goto_prev(&log_state) == FLASHLOG_ERR_OK)   // otherwise do next older
-               --eventnum;
-            show_event(eventnum);
-            break;
-         default: ;// ignore all other buttons
-      } } }
-
-bool set_time(void) {  //********* change the current date and time
-   int8_t delta;
-   byte field;
-
-   rtc_read(&now);
-   field = 0; // start with first field
-   while (true) {
-      show_datetime(CONFIG_ROW, &now); // show it in row 1
-      delta = get_config_changes(config_time_columns, &field);
-      if (delta == 0) break;
-      switch (field) {
-         case 0: // date
-            now.date = bound (now.date, delta, 1, days_in_month[now.month]);
-            break;
-         case 1: // month
-            now.month = bound (now.month, delta, 1, 12);
-            if (now.date > days_in_month[now.month])
-               now.date = days_in_month[now.month];
-            break;
-         case 2: // year
-            now.year = bound (now.year, delta, 0, 99);
-            break;
-         case 3:  // hour
-            now.hour = bound (now.hour, delta, 1, 12);
-            break;
-         case 4:  // minutes
-            now.min = bound (now.min, delta, 0, 59);
-            break;
-         case 5: // am/pm switch
-            now.ampm = now.ampm ^ 1;  // just reverse
-            break; } }
-   rtc_write(&now);  // write it into the realtime clock
-   return false; }
-
-bool set_filter_hour (void) {  //****** change when filtering starts each day
-   int8_t delta;
-   byte field;
-
-   field = 0; // start with first field
-   while (true) {
-      center_messagef(CONFIG_ROW, " %2d %s", config_data.filter_start_hour,
-                      config_data.filter_start_ampm ? "PM" : "AM"); // " 3 pm"
-      // get change to hour or am/pm
-      delta = get_config_changes(config_filterhour_columns, &field);
-      if (delta == 0) break;
-      switch (field) {
-         case 0:  // hour
-            config_data.filter_start_hour = bound (config_data.filter_start_hour, delta, 1, 12);
-            break;
-         case 1: // am/pm switch
-            config_data.filter_start_ampm = config_data.filter_start_ampm ^ 1;  // just reverse
-            break; } }
-   return false; }
-
-bool set_pool_filter_time (void) {  //******** change how long to filter the pool
-   int8_t delta;
-   byte field;
-
-   field = 0; // start with first (and only) field
-   while (true) {
-      center_messagef(CONFIG_ROW, " %3d minutes", config_data.filter_pool_mins);
-      delta = get_config_changes(config_poolfiltertime_columns, &field);
-      if (delta == 0) break;
-      switch (field) {
-         case 0:  // minutes from 5 to 120
-            config_data.filter_pool_mins = bound (config_data.filter_pool_mins, delta, 5, 120);
-            break; } }
-   return false; };
-
-bool set_spa_filter_time (void) {  //********* change how long to filter the spa
-   int8_t delta;
-   byte field;
-
-   field = 0; // start with first (and only) field
-   while (true) {
-      center_messagef(CONFIG_ROW, " %2d minutes", config_data.filter_spa_mins);
-      delta = get_config_changes(config_spafiltertime_columns, &field);
-      if (delta == 0) break;
-      switch (field) {
-         case 0:  // minutes from 5 to 60
-            config_data.filter_spa_mins = bound (config_data.filter_spa_mins, delta, 5, 60);
-            break; } }
-   return false; };
-
-bool enable_heater(void) { //********* enable or disable the use of the heater
-   int8_t delta;
-   byte field;
-
-   field = 0; // start with first (and only) field
-   while (true) {
-      center_messagef(CONFIG_ROW, "heater is %s", config_data.heater_allowed ? "enabled" : "disabled");
-      delta = get_config_changes(config_heater_enable_columns, &field);
-      if (delta == 0) break;
-      config_data.heater_allowed ^= 1; // reverse
-   }
-   return false; }
-
-const static struct  {  // configuration programming action routines
+   if (log_state.numinuse == 0) { // the log is empty: just show that for a while
+      ui_state = UI_MESSAGE;
+      ui.msecs = millis(); } }
+
+void eventlog_step(byte button) {
+   uint32_t firstseq = log_nextseq - log_state.numinuse;
+   if (button != RIGHTARROW_BUTTON && button != LEFTARROW_BUTTON) return;
+   if (ui.eventnum < 0) // start with the oldest or the newest
+      log_goto(ui.eventnum = button == RIGHTARROW_BUTTON ? 1 : log_state.numinuse);
+   else {
+      if (firstseq != ui.log_firstseq) { // entries were added since: find ours again
+         ui.eventnum += (int) (ui.log_firstseq - firstseq);
+         if (ui.eventnum < 1) ui.eventnum = 1;
+         log_goto(ui.eventnum); }
+      if (button == RIGHTARROW_BUTTON) { // go forward in time
+         if (flashlog_goto_next(&log_state) == FLASHLOG_ERR_OK) ++ui.eventnum; }
+      else if (flashlog_goto_prev(&log_state) == FLASHLOG_ERR_OK) --ui.eventnum; } // or backward
+   ui.log_firstseq = firstseq;
+   show_event(ui.eventnum); }
+
+void show_time_setting(void) {
+   show_datetime(CONFIG_ROW, &ui.time); }
+
+void change_time_setting(int8_t delta) {  //********* change the current date and time
+   switch (ui.field) {
+      case 0: // date
+         ui.time.date = bound (ui.time.date, delta, 1, days_in_month[ui.time.month]);
+         break;
+      case 1: // month
+         ui.time.month = bound (ui.time.month, delta, 1, 12);
+         if (ui.time.date > days_in_month[ui.time.month])
+            ui.time.date = days_in_month[ui.time.month];
+         break;
+      case 2: // year
+         ui.time.year = bound (ui.time.year, delta, 0, 99);
+         break;
+      case 3:  // hour
+         ui.time.hour = bound (ui.time.hour, delta, 1, 12);
+         break;
+      case 4:  // minutes
+         ui.time.min = bound (ui.time.min, delta, 0, 59);
+         break;
+      case 5: // am/pm switch
+         ui.time.ampm = ui.time.ampm ^ 1;  // just reverse
+         break; }
+   ui.time_changed = true; }
+
+void show_filter_hour(void) {
+   center_messagef(CONFIG_ROW, " %2d %s", ui.config.filter_start_hour,
+                   ui.config.filter_start_ampm ? "PM" : "AM"); } // " 3 pm"
+
+void change_filter_hour(int8_t delta) {  //****** change when filtering starts each day
+   switch (ui.field) {
+      case 0:  // hour
+         ui.config.filter_start_hour = bound (ui.config.filter_start_hour, delta, CONFIG_LIMITS(CF_FILTER_START_HOUR));
+         break;
+      case 1: // am/pm switch
+         ui.config.filter_start_ampm = ui.config.filter_start_ampm ^ 1;  // just reverse
+         break; } }
+
+void show_pool_filter_time(void) {
+   center_messagef(CONFIG_ROW, " %3d minutes", ui.config.filter_pool_mins); }
+
+void change_pool_filter_time(int8_t delta) {  //******** change how long to filter the pool
+   ui.config.filter_pool_mins = bound (ui.config.filter_pool_mins, delta, CONFIG_LIMITS(CF_FILTER_POOL_MINS)); }
+
+void show_spa_filter_time(void) {
+   center_messagef(CONFIG_ROW, " %2d minutes", ui.config.filter_spa_mins); }
+
+void change_spa_filter_time(int8_t delta) {  //********* change how long to filter the spa
+   ui.config.filter_spa_mins = bound (ui.config.filter_spa_mins, delta, CONFIG_LIMITS(CF_FILTER_SPA_MINS)); }
+
+void show_heater_enable(void) {
+   center_messagef(CONFIG_ROW, "heater is %s", ui.config.heater_allowed ? "enabled" : "disabled"); }
+
+void change_heater_enable(int8_t delta) { //********* enable or disable the use of the heater
+   ui.config.heater_allowed ^= 1; } // reverse
+
+static const char *wifi_power_save_names[] = {"none", "min", "max" };
+
+void show_wifi_power(void) {
+   center_messagef(CONFIG_ROW, "%-4s %2d dBm ivl %2d", wifi_power_save_names[ui.config.wifi_power_save],
+                   ui.config.wifi_tx_power, ui.config.wifi_listen_interval); } // "none 20 dBm ivl  3"
+
+void change_wifi_power(int8_t delta) { //********* set the WiFi power save mode and transmit power
+   switch (ui.field) {
+      case 0: // power save mode
+         ui.config.wifi_power_save = bound(ui.config.wifi_power_save, delta, CONFIG_LIMITS(CF_WIFI_POWER_SAVE));
+         break;
+      case 1: // transmit power in dBm
+         ui.config.wifi_tx_power = bound(ui.config.wifi_tx_power, delta, CONFIG_LIMITS(CF_WIFI_TX_POWER));
+         break;
+      case 2: // listen interval in beacons
+         ui.config.wifi_listen_interval = bound(ui.config.wifi_listen_interval, delta, CONFIG_LIMITS(CF_WIFI_LISTEN_INTERVAL));
+         break; } }
+
+const static struct  {  // configuration programming routines
    const char *title;
-   bool (*fct)(void); }
+   byte *columns;                 // where the fields are
+   void (*show)(void);            // show the setting
+   void (*change)(int8_t delta); }// change its current field up or down
 config_cmds [] = {
-   {"set time", set_time },
-   {"set filter hour", set_filter_hour },
-   {"set pool filter time", set_pool_filter_time },
-   {"set spa filter time", set_spa_filter_time },
-   {"enable heater", enable_heater },
-   {NULL, NULL } };
+   {"set time", config_time_columns, show_time_setting, change_time_setting },
+   {"set filter hour", config_filterhour_columns, show_filter_hour, change_filter_hour },
+   {"set pool filter time", config_poolfiltertime_columns, show_pool_filter_time, change_pool_filter_time },
+   {"set spa filter time", config_spafiltertime_columns, show_spa_filter_time, change_spa_filter_time },
+   {"enable heater", config_heater_enable_columns, show_heater_enable, change_heater_enable },
+   {"set WiFi power", config_wifi_power_columns, show_wifi_power, change_wifi_power },
+   {NULL, NULL, NULL, NULL } };
+
+void config_show_field(void) { // show the setting, with the cursor blinking on its current field
+   (config_cmds[ui.cmd].show)();
+   lcdsetCursor(config_cmds[ui.cmd].columns[ui.field], CONFIG_ROW);
+   lcdblink(); }
+
+void config_show_cmd(void) {
+   lcdnoBlink();
+   lcdclear();
+   lcdprint(config_cmds[ui.cmd].title); // show instruction on top line
+   lcdsetCursor(0, 2);
+   lcdprint("Arrows view, change");
+   lcdsetCursor(0, 3);
+   lcdprint("Then press \"menu\"");
+   config_show_field(); }
+
+void do_configuration (void) {
+   ui_state = UI_CONFIG;
+   ui.config = ui.config_was = config_data;
+   rtc_read(&ui.time);
+   ui.time_changed = false;
+   ui.cmd = ui.field = 0;
+   config_show_cmd(); }
+
+void config_step(byte button) {
+   byte *columns = config_cmds[ui.cmd].columns;
+   switch (button) {
+      case MENU_BUTTON: // done with this setting
+         if (config_cmds[ui.cmd].change == change_time_setting && ui.time_changed) {
+            rtc_write(&ui.time);  // write it into the realtime clock now, so it doesn't
+            now = ui.time; }      // lose the time spent on the rest of the settings
+         ui.field = 0;
+         if (config_cmds[++ui.cmd].title) config_show_cmd();
+         else config_done();
+         break;
+      case UPARROW_BUTTON:
+      case DOWNARROW_BUTTON:
+         (config_cmds[ui.cmd].change)(button == UPARROW_BUTTON ? +1 : -1);
+         config_show_field();
+         break;
+      case RIGHTARROW_BUTTON:
+         if (columns[++ui.field] == 0xff) ui.field = 0;
+         config_show_field();
+         break;
+      case LEFTARROW_BUTTON:
+         if (ui.field == 0)
+            while (columns[++ui.field] != 0xff) ;
+         --ui.field;
+         config_show_field();
+         break;
+      default: ; // ignore all other buttons
+   } }
 
-bool do_configuration (void) {
-   enter_idle_mode();   // stop everything
-   config_changed = false;
-   for (byte cmd = 0; config_cmds[cmd].title; ++cmd) { // do all config settings
-      lcdclear();
-      lcdprint(config_cmds[cmd].title); // show instruction on top line
-      lcdsetCursor(0, 2);
-      lcdprint("Arrows view, change");
-      lcdsetCursor(0, 3);
-      lcdprint("Then press \"menu\"");
-      if ((config_cmds[cmd].fct)()) // execute the configuration routine
-         break; // don't continue (only for "program" if it showed something)
-   }
+void config_done(void) { // all the settings have been seen: apply the changes
+   // Only the fields changed here are applied, onto the current configuration, so that
+   // a change from the web while the menu was showing isn't undone.
+   uint16_t fields = 0;
+   for (int ndx = 0; ndx < NUM_CONFIG_FIELDS; ++ndx) {
+      int offset = config_fields[ndx].offset;
+      if (((byte *)&ui.config)[offset] != ((byte *)&ui.config_was)[offset])
+         fields |= 1 << ndx; }
+   struct config_t newconfig = config_data;
+   config_merge(&newconfig, &ui.config, fields);
+   bool changed = ui.time_changed; // (the clock was set when its setting was done)
+   lcdnoBlink();
    lcdclear();
-   if (config_changed) {
-      write_config();  // write configuration into EPROM
-      log_event(EV_UPDATED_CONFIG);
-      center_message(0, "changes recorded");
-      longdelay(1500); }
-   return config_changed; }
-
-bool show_wifi_info(void) {
+   if (config_apply(&newconfig)) changed = true;
+   if (changed) ui_message("changes recorded");
+   else ui_exit(); }
+
+// Configuration changes from the web are validated by the webserver task into
+// config_webpending, then applied here by the main loop, without leaving the
+// current mode unless the change makes it unsafe. Only the fields the change
+// sets are applied, onto whatever the configuration is by then. Changes from
+// the menu are applied the same way.
+
+const char *config_set_field(struct config_t *config, uint16_t *fields, const char *name, long value) {
+   for (int ndx = 0; ndx < NUM_CONFIG_FIELDS; ++ndx)
+      if (strcmp(name, config_fields[ndx].name) == 0) {
+         if (value < config_fields[ndx].min || value > config_fields[ndx].max)
+            return "value out of range";
+         ((byte *)config)[config_fields[ndx].offset] = value;
+         *fields |= 1 << ndx;
+         return NULL; }
+   return "unknown field"; }
+
+void config_merge(struct config_t *config, const struct config_t *changes, uint16_t fields) {
+   // copy just the config_fields[] whose bits are set
+   for (int ndx = 0; ndx < NUM_CONFIG_FIELDS; ++ndx)
+      if (fields & (1 << ndx))
+         ((byte *)config)[config_fields[ndx].offset] = ((const byte *)changes)[config_fields[ndx].offset]; }
+
+bool config_apply(const struct config_t *newconfig) { // return false if nothing changed
+   if (memcmp(newconfig, &config_data, sizeof(config_data)) == 0) return false;
+   config_data = *newconfig;
+   write_config();  // write configuration into FLASH
+   wifi_set_power(config_data.wifi_power_save, config_data.wifi_tx_power, config_data.wifi_listen_interval);
+   log_event(EV_UPDATED_CONFIG);
+   const byte *filter_mins = mode_table[mode].config_timeout;
+   noInterrupts();
+   if (filter_mins && mode_timer > *filter_mins)
+      mode_timer = *filter_mins; // a shorter filter time applies now; a longer one next time
+   interrupts();
+   if (!config_data.heater_allowed && mode_table[mode].needs_heater)
+      heater_disabled(); // the one unsafe change: stop the mode
+   return true; }
+
+void config_apply_web(void) {
+   if (!config_webchanged) return;
+   struct config_t newconfig = config_data; // only the fields the web set, so that a
+   config_merge(&newconfig, &config_webpending, config_webfields); // menu change meanwhile stays
+   config_webchanged = false; // (now the webserver may use config_webpending again)
+   config_apply(&newconfig); }
+
+void show_wifi_info(void) {
+   ui_state = UI_WIFI_INFO;
    lcdclear();
    center_message(3, "press MENU");
    if (webserver_address[0]) {
       lcdprint(0, webserver_address);
       lcdprintf(1, "%d ok, %d bad", connect_successes, connect_failures);
-      lcdprintf(2, "%d requests", client_requests);
-      while (wait_for_button() != MENU_BUTTON) ;
+      lcdprintf(2, "%d requests", client_requests); }
+   else center_message(0, "not connected"); }
+
+void wifi_info_step(byte button) {
+   if (ui_state == UI_WIFI_INFO) {
+      if (button != MENU_BUTTON) return;
+      if (!webserver_address[0]) {
+         ui_exit();
+         return; }
       center_message(0, ""); center_message(1, ""); center_message(2, "");
-      do {
-         lcdprintf(0, "RSSI = %d   ", wifi_get_rssi()); // need mutex?
-         delay(250); }
-      while (check_for_button() != MENU_BUTTON);
-      return true; }
-   else center_message(0, "not connected");
-   while (wait_for_button() != MENU_BUTTON) ;
-   return true; }
+      ui_state = UI_WIFI_RSSI; // then show the signal strength until MENU
+      ui.msecs = millis() - UI_RSSI_MSECS; }
+   else if (button == MENU_BUTTON) {
+      ui_exit();
+      return; }
+   if (millis() - ui.msecs >= UI_RSSI_MSECS) {
+      ui.msecs = millis();
+      lcdprintf(0, "RSSI = %d   ", wifi_get_rssi()); } } // need mutex?
+
+const static struct  {  // menu action routines
+   const char *title;
+   void (*fct)(void); }
+menu_cmds [] = {
+   {"show event log?", show_eventlog },
+   {"show WiFi info?", show_wifi_info },
+   {"configure?", do_configuration },
+   {NULL, NULL } };
+
+void menu_show_cmd(void) {
+   lcdclear();
+   center_message(3, "MENU exits");
+   center_message(0, menu_cmds[ui.cmd].title);
+   center_message(1, UPARROW " if yes, " DOWNARROW " if no"); }
 
 void menu_pushed (void) {
-   const static struct  {  // menu action routines
-      const char *title;
-      bool (*fct)(void); }
-   menu_cmds [] = {
-      {"show event log?", show_eventlog },
-      {"show WiFi info?", show_wifi_info },
-      {"configure?", do_configuration },
-      {NULL, NULL } };
    setLED(MENU_LED, LED_ON);
-   for (byte cmd = 0; ; ) { //cycle through menu items
-      lcdclear();
-      center_message(3, "MENU exits");
-      bool doit = yesno(0, true, menu_cmds[cmd].title);
-      if (menu_button_pushed) break;
-      if (doit) {
-         (menu_cmds[cmd].fct)(); // execute the command routine
-         break; } // and exit
-      if (menu_cmds[++cmd].title == NULL) cmd = 0; } // go to the next operation
+   ui_state = UI_MENU;
+   ui_drawing = true;
+   ui.cmd = 0;
+   menu_show_cmd();
+   ui_drawing = false; }
+
+void menu_step(byte button) {
+   if (button == MENU_BUTTON) ui_exit();
+   else if (button == UPARROW_BUTTON) (menu_cmds[ui.cmd].fct)(); // execute the command routine
+   else if (button == DOWNARROW_BUTTON) { // go to the next one
+      if (menu_cmds[++ui.cmd].title == NULL) ui.cmd = 0;
+      menu_show_cmd(); } }
+
+void ui_message(const char *msg) { // show a message for a while, and then exit
    lcdclear();
-   setLED(MENU_LED, LED_OFF); }
+   center_message(0, msg);
+   ui_state = UI_MESSAGE;
+   ui.msecs = millis(); }
+
+void ui_exit(void) { // go back to the display for the current mode
+   ui_state = UI_NONE;
+   lcdnoBlink();
+   setLED(MENU_LED, LED_OFF);
+   mode_message(mode_table[mode].label); } // (which redraws the whole display)
+
+void ui_step(byte button) { // called by loop() while a menu is showing, with a button or 0xff
+   ui_drawing = true;
+   switch (ui_state) {
+      case UI_MENU: menu_step(button); break;
+      case UI_EVENTLOG:
+         if (button == MENU_BUTTON) ui_exit();
+         else eventlog_step(button);
+         break;
+      case UI_WIFI_INFO:
+      case UI_WIFI_RSSI: wifi_info_step(button); break;
+      case UI_CONFIG: config_step(button); break;
+      case UI_WATER_LEVEL: water_level_step(button); break;
+      case UI_MESSAGE:
+         if (millis() - ui.msecs >= UI_MESSAGE_MSECS) ui_exit();
+         break;
+      default: ui_exit(); }
+   ui_drawing = false; }
 
 
 
@@ -1327,12 +2582,6 @@ hw_timer_t *secondtimer = NULL;
 void IRAM_ATTR timerint() {
    static byte minute_timer = 60;  // prescale seconds into minutes
 
-   if (++title_timer == TITLE_LINE_TIME)  // changing title line
-      do_title2 = true;
-   else if (title_timer == 2 * TITLE_LINE_TIME) {
-      do_title1 = true;
-      title_timer = 0; }
-
    if (heater_cooldown_secs_left) --heater_cooldown_secs_left;
 
    if (minute_timer) --minute_timer;
@@ -1341,17 +2590,18 @@ void IRAM_ATTR timerint() {
       if (mode_timer) --mode_timer;
       if (spa_jets_timer) --spa_jets_timer;
       if (light_timer) --light_timer;
-      temphistory_add(); }  // maybe add to temp history
+      temphistory_add();    // maybe add to temp history
+      archive_minute_due = true; }
 
    if (!have_tempsensor) { // no temp sensor: simulate the heater
       static int simulation_secs = 0;
       if (heater_on) {
          if (++simulation_secs >= 60) { // +1 degree every minute
-            if (simulated_temp < 150) ++simulated_temp;
+            if (simulated_temp < DEGREES(150)) simulated_temp += DEGREES(1);
             simulation_secs = 0; } }
       else { // heater off
          if (++simulation_secs >= 2 * 60) { // -1 degree every 2 minutes
-            if (simulated_temp >= 60) --simulated_temp;
+            if (simulated_temp >= DEGREES(60)) simulated_temp -= DEGREES(1);
             simulation_secs = 0; } } } }
 
 // rotary encoder interrupt: one of the pins changed
@@ -1414,11 +2664,140 @@ void temp_change (int8_t direction) {
           rotary_encoder_stackpointer - rotary_encoder_stackstart, new_highwater);
    if (heater_mode != HEATING_NONE) { //heater is running
       if (direction < 0) {  // decreasing temp
-         if (target_temp > TEMP_MIN) --target_temp; }
+         if (target_temp > TEMP_MIN) target_temp -= DEGREES(1); }
       else {  // increasing temp
          if (heater_mode == HEATING_SPA && target_temp < TEMP_MAX_SPA
                || heater_mode == HEATING_POOL && target_temp < TEMP_MAX_POOL)
-            ++target_temp; } } }
+            target_temp += DEGREES(1); } } }
+
+//-------------------------------------------------------
+//  Bulk export
+//-------------------------------------------------------
+
+/* Everything we know, in binary, for analysis somewhere else by the decoder in
+   tools/poolspa_export.c. It's a header, then sections that each start with a
+   4-character tag and a 4-byte length, so a decoder can skip what it doesn't
+   know. All numbers are little-endian. The sections describe themselves: the
+   names of the events, config fields, and counters, the log message formats,
+   and the sizes of the C types in the binary log arguments are all included.
+
+   "PSCX" version(2) 0(2)         the header
+   "ABI " sizes of int, long, long long, double, void *
+   "NOW " datetime(8)             when this was exported
+   "CNTR" {namelen(1) name value(4)}...  the values of names ending in "_tenths" are signed
+   "CFLD" count(1) {namelen(1) name offset(1) min(1) max(1)}...
+   "CONF" the config_t
+   "EVNM" count(1) {name 0}...    the names of the event types
+   "MODE" count(1) event(1)...    the events that start each mode, idle first, then
+          count(1) event(1)...    the events after which we're idle
+   "LFMT" count(1) {format 0}...  the formats of log entries with binary arguments
+   "LOG " entrysize(2) binaryflag(2) firstseq(4) {logentry_t}...  oldest first
+   "TEMP" entrysize(2) firstseq(4) {temphist_t}...  oldest first
+   "END " */
+
+void *export_parm;
+void (*export_write)(void *parm, const void *data, int len);
+
+void export_bytes(const void *data, int len) {
+   export_write(export_parm, data, len); }
+
+void export_uint(uint32_t value, int len) { // little-endian, whatever we are
+   byte bytes[4];
+   for (int ndx = 0; ndx < len; ++ndx) bytes[ndx] = value >> (8 * ndx);
+   export_bytes(bytes, len); }
+
+void export_section(const char *tag, uint32_t len) {
+   export_bytes(tag, 4);
+   export_uint(len, 4); }
+
+void export_name(const char *name) { // with a 1-byte length
+   export_uint(strlen(name), 1);
+   export_bytes(name, strlen(name)); }
+
+void export_strings(const char *tag, const char **strings, int count) {
+   uint32_t len = 1;
+   for (int ndx = 0; ndx < count; ++ndx) len += strlen(strings[ndx]) + 1;
+   export_section(tag, len);
+   export_uint(count, 1);
+   for (int ndx = 0; ndx < count; ++ndx) export_bytes(strings[ndx], strlen(strings[ndx]) + 1); }
+
+void export_dump(void *parm, void (*write)(void *parm, const void *data, int len)) {
+   export_parm = parm;
+   export_write = write;
+   export_bytes(EXPORT_MAGIC, 4);
+   export_uint(EXPORT_VERSION, 2);
+   export_uint(0, 2);
+
+   export_section("ABI ", 5);
+   export_uint(sizeof(int), 1); export_uint(sizeof(long), 1); export_uint(sizeof(long long), 1);
+   export_uint(sizeof(double), 1); export_uint(sizeof(void *), 1);
+
+   export_section("NOW ", sizeof(now));
+   export_bytes(&now, sizeof(now));
+
+   const struct {
+      const char *name;
+      uint32_t value; }
+   counters[] = {
+      {"millis", (uint32_t) millis() }, {"log_nextseq", log_nextseq }, {"temphist_nextseq", temphist_nextseq },
+      {"log_slots", (uint32_t) log_state.numslots }, {"mode", mode }, {"target_temp_tenths", (uint32_t) (int32_t) target_temp },
+      {"temp_now_tenths", (uint32_t) (int32_t) temp_now }, {"temp_valid", temp_valid },
+      {"temp_crc_errors", tempfilter.crc_errors }, {"temp_implausible", tempfilter.implausible },
+      {"temp_rate_limited", tempfilter.rate_limited },
+      {"wifi_connects", (uint32_t) connect_successes }, {"wifi_connect_failures", (uint32_t) connect_failures },
+      {"web_requests", (uint32_t) client_requests } };
+   uint32_t len = 0;
+   for (int ndx = 0; ndx < sizeof(counters) / sizeof(counters[0]); ++ndx) len += 1 + strlen(counters[ndx].name) + 4;
+   export_section("CNTR", len);
+   for (int ndx = 0; ndx < sizeof(counters) / sizeof(counters[0]); ++ndx) {
+      export_name(counters[ndx].name);
+      export_uint(counters[ndx].value, 4); }
+
+   len = 1;
+   for (int ndx = 0; ndx < NUM_CONFIG_FIELDS; ++ndx) len += 1 + strlen(config_fields[ndx].name) + 3;
+   export_section("CFLD", len);
+   export_uint(NUM_CONFIG_FIELDS, 1);
+   for (int ndx = 0; ndx < NUM_CONFIG_FIELDS; ++ndx) {
+      export_name(config_fields[ndx].name);
+      export_uint(config_fields[ndx].offset, 1);
+      export_uint(config_fields[ndx].min, 1);
+      export_uint(config_fields[ndx].max, 1); }
+   export_section("CONF", sizeof(config_data));
+   export_bytes(&config_data, sizeof(config_data));
+
+   export_strings("EVNM", event_names, EV_NUM_EVENTS);
+   export_section("MODE", 1 + NUM_MODES + 2);
+   export_uint(NUM_MODES, 1);
+   for (int ndx = 0; ndx < NUM_MODES; ++ndx) export_uint(mode_table[ndx].event, 1);
+   export_uint(1, 1);
+   export_uint(EV_STARTUP, 1); // (but after a watchdog restart we might resume)
+   export_strings("LFMT", log_formats, LOGFMT_NUM_FORMATS);
+
+   int count = log_state.numinuse; // (it's ok if an entry is added while we go)
+   export_section("LOG ", 8 + count * LOG_DATASIZE);
+   export_uint(LOG_DATASIZE, 2);
+   export_uint(LOG_BINARY, 2);
+   export_uint(log_nextseq - count, 4);
+   if (count > 0) flashlog_goto_oldest(&log_state);
+   for (int ndx = 0; ndx < count; ++ndx) {
+      static byte blank[LOG_DATASIZE] = {0 };
+      bool ok = flashlog_read(&log_state) == FLASHLOG_ERR_OK;
+      export_bytes(ok ? log_state.logdata : blank, LOG_DATASIZE); // (keep the length right)
+      if (ok) flashlog_goto_next(&log_state); }
+
+   uint32_t nextseq = temphist_nextseq;
+   int next = temphist_next;
+   count = temphist_count;
+   export_section("TEMP", 6 + count * sizeof(struct temphist_t));
+   export_uint(sizeof(struct temphist_t), 2);
+   export_uint(nextseq - count, 4);
+   int ndx = next - count;
+   if (ndx < 0) ndx += TEMPHIST_ENTRIES;
+   for (int cnt = 0; cnt < count; ++cnt) {
+      export_bytes(&temphist[ndx], sizeof(struct temphist_t));
+      if (++ndx >= TEMPHIST_ENTRIES) ndx = 0; }
+
+   export_section("END ", 0); }
 
 //-------------------------------------------------------
 //  Initialization
@@ -1426,6 +2805,36 @@ void temp_change (int8_t direction) {
 
 void webserver_task(void *parm);  // our webserver task, in webserver.cpp
 TaskHandle_t webserver_task_handle = NULL;
+volatile bool controller_ready = false;  // the webserver waits for this
+volatile unsigned long wifi_ready_msecs = 0;
+
+// Startup is timed in phases for the boot profile log entry. WiFi connects on
+// the other core at the same time, so it is timed separately, and the entry
+// is made when both are done.
+unsigned long boot_phase_msecs[NUM_BOOT_PHASES];
+unsigned long boot_phase_start = 0, boot_ready_msecs = 0;
+bool boot_profile_logged = false;
+
+void boot_phase_done(enum boot_phase_t phase) {
+   unsigned long msecs = millis();
+   boot_phase_msecs[phase] = msecs - boot_phase_start;
+   boot_phase_start = msecs; }
+
+void log_boot_profile(void) {
+   log_eventf(EV_BOOT_PROFILE, LOGFMT_BOOT_PROFILE,
+              (int) boot_phase_msecs[BOOT_LCD], (int) boot_phase_msecs[BOOT_LOG], (int) boot_phase_msecs[BOOT_CONFIG],
+              (int) boot_phase_msecs[BOOT_CLOCK], (int) boot_phase_msecs[BOOT_TEMPSENSOR],
+              (int) boot_ready_msecs, (int) wifi_ready_msecs);
+   boot_profile_logged = true; }
+
+// Messages about startup problems are collected and shown together at the end
+// of setup(), instead of each one holding things up for a second.
+const char *boot_notices[3];
+int num_boot_notices = 0;
+
+void boot_notice(const char *msg) {
+   dprint("%s\n", msg);
+   if (num_boot_notices < 3) boot_notices[num_boot_notices++] = msg; }
 
 void outpin(byte pinnum, byte starting_state) {  // configure an output pin
    digitalWrite(pinnum, starting_state);
@@ -1439,6 +2848,7 @@ void inpin(byte pinnum) {  // configure an input pin
 void setup (void) {  // initialization starts here
 
    bool watchdog_triggered = watchdog_setup();  // start the watchdog timer
+   boot_phase_start = millis();
 
    #if DEBUG
    Serial.begin(115200);
@@ -1447,6 +2857,7 @@ void setup (void) {  // initialization starts here
    #endif
 
    cpu_core = xPortGetCoreID(); // record which CPU core we're running on
+
    lcd_start();
    #if DEBUG
    Serial.print("LCD started, running on core ");
@@ -1460,18 +2871,47 @@ void setup (void) {  // initialization starts here
    outpin(LED_DRIVER_LE, LOW);
    outpin(LED_DRIVER_OD, LOW);
    setLED(0, LED_OFF);  // turn off all LEDs
-   setrelay(0, RELAY_OFF); // make sure all relays are off
+   outpin(TEMPSENSOR_PIN, HIGH); // start charging the temp sensor's parasitic power capacitor
+   unsigned long tempsensor_powered = millis();
+   interlocks_init();
+   check_mode_interlocks();
    inpin(PUSHBUTTON_IN);
    Wire.begin();   // start onewire for temperature sensor and realtime clock
+   boot_phase_done(BOOT_LCD);
 
    // initialize the log
    assert_that(flashlog_open(NULL, LOG_DATASIZE, &log_state) == FLASHLOG_ERR_OK, "can't open log");
+   log_nextseq = log_state.numinuse + 1;
    center_messagef(2, "%d of %d events", log_state.numinuse, log_state.numslots);
    #if DEBUG
    //dump_log();
    #endif
-   delay(1000);
+   boot_phase_done(BOOT_LOG);
+
+   #if WEBSERVER
+   // start the web server task as soon as the log is open, so WiFi connects while we do
+   // everything else, and anything the task logs while it connects has somewhere to go
+   esp_err_t err = xTaskCreatePinnedToCore( // start the webserver task
+                      webserver_task,
+                      "webserver",
+                      32768, // stack size
+                      NULL, // parameter
+                      0, // priority
+                      &webserver_task_handle, // where to put the task handle
+                      1 - cpu_core); // which CPU core it should run on: not ours
+   assert_that(err == pdPASS, "can't create webserver task, err %d", err);
+   #if WATCHDOG
+   err = esp_task_wdt_add(webserver_task_handle);
+   assert_that(err == ESP_OK, "can't add webserver task to WDT, err %d", err);
+   // disableCore0WDT(); // doesn't work
+   #endif
+   #endif
+
    init_config();  // get or set configuration data from FLASH
+   init_archive(); // find where we are in the long-term archives
+   wifi_set_power(config_data.wifi_power_save, config_data.wifi_tx_power, config_data.wifi_listen_interval);
+   checkpoint_restore(watchdog_triggered); // see what we know about the valves and pumps
+   boot_phase_done(BOOT_CONFIG);
 
    // start a timer that interrupts once a second
    secondtimer = timerBegin(0, 80, true);
@@ -1485,10 +2925,11 @@ void setup (void) {  // initialization starts here
       rtc_write (&clock_init); // reset if bad
       if (datetime_invalid(now)) {// if still invalid, it's broken or not present
          no_clock = true; } }
+   boot_phase_done(BOOT_CLOCK);
 
    // temperature sensor
-   outpin(TEMPSENSOR_PIN, HIGH);
-   delay(250); // wait for parasitic power capacitor to charge?
+   unsigned long charged = millis() - tempsensor_powered;
+   if (charged < 250) delay(250 - charged); // wait for parasitic power capacitor to charge?
    have_tempsensor = tempsensor.search(tempsensor_addr)  // find temp sensor
                      && (OneWire::crc8(tempsensor_addr, 7) == tempsensor_addr[7]); // with ok CRC
    if (have_tempsensor) {
@@ -1497,6 +2938,7 @@ void setup (void) {  // initialization starts here
       tempsensor.reset();
       tempsensor.select(tempsensor_addr);
       tempsensor.write_bytes(set_10_bit_resolution, 4, 1); }
+   boot_phase_done(BOOT_TEMPSENSOR);
 
    // rotary encoder for temperature control
    #if ROTARY_ENCODER
@@ -1517,42 +2959,37 @@ void setup (void) {  // initialization starts here
 
    // make log entries
 
-   log_event( // make an initial "power on" event log entry
-      watchdog_triggered ? EV_WATCHDOG_RESET :  EV_STARTUP);
-   if (watchdog_triggered) {
-      center_message(2, "Watchdog triggered!");
-      delay(1000); }
+   log_eventf( // make an initial "power on" event log entry
+      watchdog_triggered ? EV_WATCHDOG_RESET :  EV_STARTUP,
+      LOGFMT_RESET_REASON, esp_reset_reason());
+   if (watchdog_triggered)
+      boot_notice("Watchdog triggered!");
 
    if (no_clock) {
       log_event(EV_CLOCK_BAD);
-      center_message(2, "no clock!");
-      delay(1000); }
+      boot_notice("no clock!"); }
 
    if (!have_tempsensor) {
       log_event(EV_TEMPSENSOR_BAD);
-      center_message(2, "no temp sensor!");
-      delay(1000); }
+      boot_notice("no temp sensor!"); }
 
-   #if WEBSERVER
-   // start the web server
-   esp_err_t err = xTaskCreatePinnedToCore( // start the webserver task
-                      webserver_task,
-                      "webserver",
-                      32768, // stack size
-                      NULL, // parameter
-                      0, // priority
-                      &webserver_task_handle, // where to put the task handle
-                      1 - cpu_core); // which CPU core it should run on: not ours
-   assert_that(err == pdPASS, "can't create webserver task, err %d", err);
-   #if WATCHDOG
-   err = esp_task_wdt_add(webserver_task_handle);
-   assert_that(err == ESP_OK, "can't add webserver task to WDT, err %d", err);
-   // disableCore0WDT(); // doesn't work
-   #endif
+   controller_ready = true; // let the webserver start serving pages
+   lcdclear();
+   for (int ndx = 0; ndx < num_boot_notices; ++ndx)
+      center_message(ndx + 1, boot_notices[ndx]);
+
+   if (watchdog_triggered) checkpoint_resume(); // resume what we were doing
+   if (mode == MODE_IDLE) {
+      if (pump_status != PUMP_NONE)
+         change_equipment(valve_config, PUMP_NONE, HEATING_NONE); // after the heater cools down
+      if (valve_config == VALVES_UNDEFINED)
+         setvalveconfig(VALVES_HEAT_SPA); } // put the valves into a known state
+   checkpoint_save();
+   boot_ready_msecs = millis();
+   #if !WEBSERVER
+   log_boot_profile();
    #endif
 
-   setvalveconfig(VALVES_HEAT_SPA); // put the valves into a known state
-
 }
 
 
@@ -1583,31 +3020,46 @@ boolean if_zero (volatile unsigned int *counter) {
 // The main polling loop for activities
 
 void loop (void) {
-   char string[25];
+   char string[25], temp[10];
    unsigned int timer;
    byte button;
 
    watchdog_poke();
+   checkpoint_save(); // in case of a reset
+   #if !WEBSERVER
+   dtrace_flush(); // (otherwise the webserver task does it)
+   #endif
+   if (!boot_profile_logged && (wifi_ready_msecs || millis() > 60000UL))
+      log_boot_profile(); // WiFi connected, or is taking too long
 
    //show our IP address when we first become connected
    static bool ip_address_shown = false;
    if (!ip_address_shown && webserver_address[0]) {
-      center_message(0, "IP address");
-      lcdprint(1, webserver_address);
-      ip_address_shown = true;
-      longdelay(3000);
-      center_message(1, ""); }
-
-   // Alternate the top-line title
-   if (do_title1) {
-      center_message(0, TITLE);
-      do_title1 = false; }
-   else if (do_title2) {
-      show_current_time(0);
-      do_title2 = false; }
-
-   // Check for button pushes
-   if ((button = check_for_button()) != 0xFF)
+      lcd_post(LCD_IP_LABEL, 3000, "IP address");
+      lcd_post(LCD_IP_ADDRESS, 3000, "%s", webserver_address);
+      ip_address_shown = true; }
+
+   // keep the title and the time for the top line current
+   static unsigned long clock_msecs = 0;
+   if (clock_msecs == 0 || millis() - clock_msecs >= LCD_ROTATE_MSECS) {
+      clock_msecs = millis();
+      rtc_read(&now);
+      lcd_post(LCD_TITLE, 0, "%s", TITLE);
+      lcd_post(LCD_CLOCK, 0, "%s", format_datetime(&now, string)); }
+
+   config_apply_web(); // any configuration change from the web
+   mqtt_state_check(); // publish any change
+
+   if (archive_minute_due) { // add to the long-term archives and the daily totals
+      archive_minute_due = false;
+      rtc_read(&now);
+      archive_minute();
+      rollup_minute(); }
+
+   // Check for button pushes, which go to the menu if one is showing
+   button = check_for_button();
+   if (ui_state != UI_NONE) ui_step(button);
+   else if (button != 0xFF)
       (button_actions[button])(); // do the action routine
 
    // Check for the time to autostart daily filtering routine
@@ -1626,8 +3078,9 @@ void loop (void) {
    interrupts();
    if (timer) {   // display the current mode's "time left" message
       if (timer >= 60)
-         center_messagef(2, " %d hr %d min left ", timer / 60, timer % 60);
-      else center_messagef(2, " %d min left", timer % 60); }
+         lcd_post(LCD_TIME_LEFT, 0, " %d hr %d min left ", timer / 60, timer % 60);
+      else lcd_post(LCD_TIME_LEFT, 0, " %d min left", timer % 60); }
+   else lcd_remove(LCD_TIME_LEFT);
 
    // check if this mode has timed out
    if (if_zero(&mode_timer) && mode != MODE_IDLE) { // timed out
@@ -1637,24 +3090,24 @@ void loop (void) {
          enter_idle_mode(); }
 
    // have the spa jets timed out?
-   if (spa_jets_on && if_zero(&spa_jets_timer)) {
-      setLED(SPA_JETS_LED, LED_OFF);
-      setrelay(SPA_JETS_PUMP_RELAY, RELAY_OFF);
-      spa_jets_on = false; }
+   if (spa_jets_on && if_zero(&spa_jets_timer))
+      set_spa_jets(false);
 
    // has the pool light timed out?
-   if (pool_light_on && if_zero(&light_timer)) {
-      setLED(POOL_LIGHT_LED, LED_OFF);
-      setrelay(POOL_LIGHT_RELAY, RELAY_OFF);
-      pool_light_on = false; }
+   if (pool_light_on && if_zero(&light_timer))
+      set_pool_light(false);
 
    // display the water temperature and turn the heater on or off
 
-   if (pump_status == PUMP_NONE)  //pump is off
+   if (pump_status == PUMP_NONE) { //pump is off
       temp_valid = false;
+      temp_filter_reset(&tempfilter); } // (the water in the pipe won't be what's in the tub)
+   else if (!read_temp(&temp_now)) { // pump is on, but there's no good temperature
+      temp_valid = false;
+      if (tempfilter.bad_in_row >= TEMP_MAX_BAD_READS && heater_mode != HEATING_NONE) {
+         if (heater_on) heater_pause(); // don't heat blind
+         lcd_post(LCD_TEMP, 0, "set %s" TEMP_UNIT " is ?", format_temp(target_temp, string)); } }
    else { //pump is on
-      temp_now = read_temp();
-
       if (heater_mode == HEATING_NONE) {
          // We're not heating, but one of the pumps is running.
          // Display the temperature if water is flowing through the heater,
@@ -1664,29 +3117,29 @@ void loop (void) {
             sprintf(string, " ");
             temp_valid = false; }
          else {
-            sprintf(string, "temperature: %dF", temp_now);
+            sprintf(string, "temperature: %s" TEMP_UNIT, format_temp(temp_now, temp));
             temp_valid = true; } }
 
       else {  // either HEATING_SPA or HEATING_POOL
          // (Do we need to enforce a minimum time between heater changes
          //  here, to avoid damage? Or can the heater cope?)
          if (heater_on) {
-            if (temp_now >= target_temp) { // turn heater off
-               setrelay(HEAT_SPA_RELAY + HEAT_POOL_RELAY, RELAY_OFF);
-               setLED(TEMPCTL_BLUE_LED, LED_ON);
-               setLED(TEMPCTL_RED_LED, LED_OFF);
-               heater_cooldown_secs_left = DELAY_HEATER_OFF;
-               heater_on = false; } }
-#define TEMP_HYSTERESIS 2  // hysteresis in degrees Fahrenheit
+            if (temp_now >= target_temp) // turn heater off
+               heater_pause(); }
+#define TEMP_HYSTERESIS DEGREES(2)  // hysteresis in tenths of a degree Fahrenheit
          else { // heater off
-            if (temp_now <= target_temp - TEMP_HYSTERESIS) { // turn heater on
-               setrelay(heater_mode == HEATING_SPA ? HEAT_SPA_RELAY : HEAT_POOL_RELAY, RELAY_ON);
+            if (temp_now <= target_temp - TEMP_HYSTERESIS // turn heater on
+                  && setrelay(heater_mode == HEATING_SPA ? HEAT_SPA_RELAY : HEAT_POOL_RELAY, RELAY_ON)) {
                setLED(TEMPCTL_BLUE_LED, LED_OFF);
                setLED(TEMPCTL_RED_LED, LED_ON);
                heater_on = true; } }
-         center_messagef(3, "temp set %d, is %d", target_temp, temp_now);
+         lcd_post(LCD_TEMP, 0, "set %s" TEMP_UNIT " is %s" TEMP_UNIT,
+                  format_temp(target_temp, string), format_temp(temp_now, temp));
          temp_valid = true; } }
 
+   lcd_render(); // show whatever changed on the display
+   lcd_scrub();  // and repair any damage to it
+
 } // repeat loop
 
 //*
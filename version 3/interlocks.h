@@ -0,0 +1,85 @@
+//-------------------------------------------------------------------------------------
+//  Relay interlocks for the pool/spa controller
+//
+//  This is included by controller_03.ino, and by tools/interlock_test.cpp, which
+//  checks the rules and the mode table on a workstation.
+//-------------------------------------------------------------------------------------
+
+#include <string.h>
+
+/* Relay interlocks
+
+   Whatever order the rest of the program changes the relays in, some combinations must
+   never happen: the heater firing with no water flowing through it, for example. Each
+   interlock rule says that when any of the "when" relays are on, the "mask" relays must
+   (or must not) be in the "value" state. The valves are relays too: each one is on for
+   VALVE_LEFT and off for VALVE_RIGHT.
+
+   There are only 1024 combinations of the 10 relays, so at startup we evaluate the rules
+   for all of them and remember which are ok in a bitmap. Checking a new relay state in
+   setrelay() is then just one bit lookup. */
+
+#define PUMP_RELAYS (POOL_PUMP_RELAY | SPA_PUMP_RELAY)
+#define VALVE_RELAYS (POOL_VALVE_RELAY | SPA_VALVE_RELAY | HEATER_VALVE_RELAY)
+#define USED_RELAYS 0xff03
+#define VALVE_BITS(pool, spa, heater) ( \
+   ((pool) == RELAY_ON ? POOL_VALVE_RELAY : 0) | \
+   ((spa) == RELAY_ON ? SPA_VALVE_RELAY : 0) | \
+   ((heater) == RELAY_ON ? HEATER_VALVE_RELAY : 0))
+
+static const uint16_t valve_relays[] = { // the relays for each valve configuration
+   0, // VALVES_UNDEFINED (not used)
+   VALVE_BITS(VALVE_RIGHT, VALVE_RIGHT, VALVE_RIGHT), // VALVES_HEAT_SPA
+   VALVE_BITS(VALVE_LEFT, VALVE_LEFT, VALVE_LEFT),    // VALVES_HEAT_POOL
+   VALVE_BITS(VALVE_LEFT, VALVE_RIGHT, VALVE_RIGHT),  // VALVES_FILL_SPA
+   VALVE_BITS(VALVE_RIGHT, VALVE_RIGHT, VALVE_LEFT) };// VALVES_EMPTY_SPA
+
+static const struct interlock_t {
+   uint16_t when;   // when any of these relays are on,
+   uint16_t mask;   // then these relays
+   uint16_t value;  // must (or must not) be in this state
+   bool must_not; }
+interlocks[] = {
+   {HEAT_SPA_RELAY,  PUMP_RELAYS,     SPA_PUMP_RELAY,  false }, // 0: heat spa only with the spa pump
+   {HEAT_SPA_RELAY,  VALVE_RELAYS,    VALVE_BITS(VALVE_RIGHT, VALVE_RIGHT, VALVE_RIGHT), false }, // 1: and "heat spa" valves
+   {HEAT_POOL_RELAY, PUMP_RELAYS,     POOL_PUMP_RELAY, false }, // 2: heat pool only with the pool pump
+   {HEAT_POOL_RELAY, VALVE_RELAYS,    VALVE_BITS(VALVE_LEFT, VALVE_LEFT, VALVE_LEFT), false }, // 3: and "heat pool" valves
+   {HEAT_SPA_RELAY,  HEAT_POOL_RELAY, 0,               false }, // 4: not heating both
+   {POOL_PUMP_RELAY, SPA_PUMP_RELAY,  0,               false }, // 5: not both pumps
+   // 6-9: a pump only with one of the four valve configurations
+   {PUMP_RELAYS, VALVE_RELAYS, VALVE_BITS(VALVE_RIGHT, VALVE_LEFT, VALVE_RIGHT), true },
+   {PUMP_RELAYS, VALVE_RELAYS, VALVE_BITS(VALVE_RIGHT, VALVE_LEFT, VALVE_LEFT),  true },
+   {PUMP_RELAYS, VALVE_RELAYS, VALVE_BITS(VALVE_LEFT, VALVE_RIGHT, VALVE_LEFT),  true },
+   {PUMP_RELAYS, VALVE_RELAYS, VALVE_BITS(VALVE_LEFT, VALVE_LEFT, VALVE_RIGHT),  true } };
+#define NUM_INTERLOCKS (sizeof(interlocks) / sizeof(interlocks[0]))
+
+uint32_t relays_ok[1024 / 32]; // bitmap of the relay states that satisfy all the interlocks
+bool interlocks_ready = false;
+
+int relay_index(uint16_t relays) { // compress the 10 used bits of the relay word
+   return ((relays >> 6) & 0x3fc) | (relays & 0x03); }
+
+int interlock_violated(uint16_t relays) { // return the first violated rule, or -1 if none
+   for (unsigned rule = 0; rule < NUM_INTERLOCKS; ++rule) {
+      const struct interlock_t *il = &interlocks[rule];
+      if ((relays & il->when) && ((relays & il->mask) == il->value) == il->must_not)
+         return rule; }
+   return -1; }
+
+void interlocks_init(void) { // precompute the bitmap of the ok relay states
+   memset(relays_ok, 0, sizeof(relays_ok));
+   for (uint32_t relays = 0; relays <= 0xffff; ++relays)
+      if ((relays & ~USED_RELAYS) == 0 && interlock_violated(relays) < 0) {
+         int ndx = relay_index(relays);
+         relays_ok[ndx >> 5] |= 1UL << (ndx & 31); }
+   interlocks_ready = true; }
+
+bool relays_allowed(uint16_t relays) {
+   int ndx = relay_index(relays);
+   return (relays & ~USED_RELAYS) == 0 && (relays_ok[ndx >> 5] & (1UL << (ndx & 31))); }
+
+uint16_t equipment_relays(vconfig_t valves, pump_status_t pump, heater_t heater) {
+   // the relays that are on for this equipment state
+   return valve_relays[valves]
+          | (pump == PUMP_SPA ? SPA_PUMP_RELAY : pump == PUMP_POOL ? POOL_PUMP_RELAY : 0)
+          | (heater == HEATING_SPA ? HEAT_SPA_RELAY : heater == HEATING_POOL ? HEAT_POOL_RELAY : 0); }
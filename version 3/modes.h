@@ -0,0 +1,65 @@
+//-------------------------------------------------------------------------------------
+//  The mode table for the pool/spa controller
+//
+//  This is included by controller_03.ino, and by tools/interlock_test.cpp, which
+//  checks every mode against the relay interlocks on a workstation.
+//-------------------------------------------------------------------------------------
+
+/* Each mode is described by an entry in this table, in global_mode_t order, and they are
+   all started by the same routine. When changing from one mode to another we don't go
+   through idle mode, so that the equipment that both modes use keeps running.
+
+   The filter modes can use either the "heat spa" or the "heat pool" valve configuration,
+   whichever the valves are already in. But if the heater isn't allowed to be used, we must
+   filter the spa in the "heat pool" configuration and the pool in the "heat spa" one. */
+
+struct mode_desc_t {
+   enum global_mode_t mode;     // (for checking the order)
+   vconfig_t valves;            // the valve configuration
+   vconfig_t alt_valves;        // an alternate valve configuration, if the heater is allowed
+   pump_status_t pump;          // which pump runs
+   heater_t heater;             // what the heater heats
+   bool needs_heater;           // does it need the heater plumbing path?
+   unsigned int timeout;        // minutes before it turns off
+   const byte *config_timeout;  // or the configuration field that has the minutes
+   uint16_t leds;               // which button LED is on
+   enum event_t event;          // what we log when it starts
+   const char label[21]; };     // what we display (which must fit)
+
+constexpr struct mode_desc_t mode_table[] = {
+   // mode            valves            alt_valves        pump       heater        needs_heater
+   //                 timeout             config_timeout                 leds                 event           label
+   {MODE_IDLE,        VALVES_UNDEFINED, VALVES_UNDEFINED, PUMP_NONE, HEATING_NONE, false,
+                      0,                  NULL,                          0,                   EV_IDLE,        " " },
+   {MODE_HEAT_SPA,    VALVES_HEAT_SPA,  VALVES_UNDEFINED, PUMP_SPA,  HEATING_SPA,  true,
+                      MODE_SPA_TIMEOUT,   NULL,                          HEAT_SPA_LED,        EV_HEAT_SPA,    "heating spa" },
+   {MODE_HEAT_POOL,   VALVES_HEAT_POOL, VALVES_UNDEFINED, PUMP_POOL, HEATING_POOL, true,
+                      MODE_POOL_TIMEOUT,  NULL,                          HEAT_POOL_LED,       EV_HEAT_POOL,   "heating pool" },
+   {MODE_FILL_SPA,    VALVES_FILL_SPA,  VALVES_UNDEFINED, PUMP_POOL, HEATING_NONE, true,
+                      MODE_FILL_TIMEOUT,  NULL,                          SPA_WATER_LEVEL_LED, EV_FILL_SPA,    "filling spa" },
+   {MODE_EMPTY_SPA,   VALVES_EMPTY_SPA, VALVES_UNDEFINED, PUMP_SPA,  HEATING_NONE, true,
+                      MODE_EMPTY_TIMEOUT, NULL,                          SPA_WATER_LEVEL_LED, EV_EMPTY_SPA,   "emptying spa" },
+   {MODE_FILTER_POOL, VALVES_HEAT_SPA,  VALVES_HEAT_POOL, PUMP_POOL, HEATING_NONE, false,
+                      0,                  &config_data.filter_pool_mins, FILTER_POOL_LED,     EV_FILTER_POOL, "filtering pool" },
+   {MODE_FILTER_SPA,  VALVES_HEAT_POOL, VALVES_HEAT_SPA,  PUMP_SPA,  HEATING_NONE, false,
+                      0,                  &config_data.filter_spa_mins,  FILTER_SPA_LED,      EV_FILTER_SPA,  "filtering spa" } };
+
+// compile-time checks of the mode table: add new modes here too
+#define CHECK_MODE(m) \
+   static_assert(mode_table[m].mode == m, "mode_table isn't in global_mode_t order"); \
+   static_assert(mode_table[m].heater == HEATING_NONE \
+      || (mode_table[m].heater == HEATING_SPA && mode_table[m].pump == PUMP_SPA && mode_table[m].valves == VALVES_HEAT_SPA) \
+      || (mode_table[m].heater == HEATING_POOL && mode_table[m].pump == PUMP_POOL && mode_table[m].valves == VALVES_HEAT_POOL), \
+      "a heating mode doesn't have its pump and valves"); \
+   static_assert(mode_table[m].heater == HEATING_NONE || mode_table[m].needs_heater, "a heating mode doesn't need the heater"); \
+   static_assert(m == MODE_IDLE || mode_table[m].timeout > 0 || mode_table[m].config_timeout != NULL, "a mode has no timeout"); \
+   static_assert((mode_table[m].leds & (SPA_JETS_LED | POOL_LIGHT_LED | MENU_LED)) == 0, "a mode uses a non-mode LED");
+static_assert(sizeof(mode_table) / sizeof(mode_table[0]) == NUM_MODES, "mode_table has the wrong number of entries");
+CHECK_MODE(MODE_IDLE)
+CHECK_MODE(MODE_HEAT_SPA)
+CHECK_MODE(MODE_HEAT_POOL)
+CHECK_MODE(MODE_FILL_SPA)
+CHECK_MODE(MODE_EMPTY_SPA)
+CHECK_MODE(MODE_FILTER_POOL)
+CHECK_MODE(MODE_FILTER_SPA)
+#undef CHECK_MODE
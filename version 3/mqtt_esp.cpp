@@ -0,0 +1,146 @@
+//file: mqtt_esp.cpp
+/* ----------------------------------------------------------------------------------------
+   MQTT telemetry for the pool/spa controller
+
+   This runs on the alternate core 0 CPU, called from the webserver task's idle
+   loop. If MQTT_BROKER_URI is defined in Wifi_names.h, we publish the messages
+   the controller queues (see "MQTT telemetry queue" in the main module) as JSON:
+      <topic>/state      mode, heater, pumps, valves, relays, and temperatures,
+                         whenever something changes (retained)
+      <topic>/telemetry  the same, plus uptime and web requests, every minute
+      <topic>/status     "online", or "offline" as our last will (retained)
+
+   The messages are published in order, one at a time, with QoS 1. The next one
+   isn't sent until the broker acknowledges the last one, so while the broker is
+   unreachable they stay queued in RAM, and they are replayed in order when it
+   returns. A message might be delivered twice, so each one has a sequence
+   number, and "dropped" counts the ones lost because the queue overflowed.
+
+   See the main module for other details and the change log.
+   ----------------------------------------------------------------------------------------
+   Copyright (c) 2022 Len Shustek
+   The MIT License (MIT)
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+   and associated documentation files (the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all copies or
+   substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+   BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+   DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+   ------------------------------------------------------------------------------------------------*/
+
+#include "Wifi_names.h"
+#include "controller_03.h"
+#include "Arduino.h"
+
+#ifndef MQTT_BROKER_URI
+
+const bool mqtt_configured = false;
+void mqtt_check(void) { }
+
+#else
+
+#include <mqtt_client.h>
+#ifndef MQTT_TOPIC
+   #define MQTT_TOPIC "poolspa"
+#endif
+#define MQTT_ACK_MSECS 15000  // send it again if it isn't acknowledged by then
+
+const bool mqtt_configured = true;
+esp_mqtt_client_handle_t mqtt_client = NULL;
+volatile bool mqtt_connected = false;   // these are set by the event handler, in the MQTT task
+volatile bool mqtt_reconnected = false;
+volatile int mqtt_acked_id = -1;        // the last message the broker acknowledged (only the queued messages use QoS 1)
+int mqtt_sent_id = -1;                  // the message we're waiting for, or -1
+uint32_t mqtt_sent_seqnum;
+unsigned long mqtt_sent_msecs;
+
+static const char *heater_names[] = {"none", "spa", "pool" };
+static const char *pump_names[] = {"none", "spa", "pool" };
+static const char *valve_names[] = {"unknown", "heat spa", "heat pool", "fill spa", "empty spa" };
+
+static void mqtt_event_handler(void *arg, esp_event_base_t base, int32_t event_id, void *event_data) {
+   esp_mqtt_event_handle_t event = (esp_mqtt_event_handle_t) event_data;
+   switch (event->event_id) {
+      case MQTT_EVENT_CONNECTED:
+         mqtt_connected = mqtt_reconnected = true;
+         break;
+      case MQTT_EVENT_DISCONNECTED:
+         mqtt_connected = false;
+         break;
+      case MQTT_EVENT_PUBLISHED:
+         mqtt_acked_id = event->msg_id;
+         break;
+      default: break; } }
+
+void mqtt_start(void) {
+   esp_mqtt_client_config_t config;
+   memset(&config, 0, sizeof(config));
+   config.uri = MQTT_BROKER_URI;
+   config.client_id = MQTT_TOPIC;
+   config.lwt_topic = MQTT_TOPIC "/status";
+   config.lwt_msg = "offline";
+   config.lwt_qos = 1;
+   config.lwt_retain = 1;
+   if ((mqtt_client = esp_mqtt_client_init(&config)) == NULL) return;
+   esp_mqtt_client_register_event(mqtt_client, MQTT_EVENT_ANY, &mqtt_event_handler, NULL);
+   esp_mqtt_client_start(mqtt_client); // (it connects, and reconnects, by itself)
+   dprint("MQTT client started for %s\n", MQTT_BROKER_URI); }
+
+int mqtt_format(const struct mqtt_msg_t *msg, uint32_t dropped, char *buf, int size) {
+   const struct mqtt_state_t *st = &msg->state;
+   char temp[10] = "null", target_temp[10];
+   if (st->temp_valid) format_temp(st->temp, temp);
+   int len = snprintf(buf, size,
+                      "{\"seq\":%lu,\"time\":\"20%02d-%02d-%02dT%02d:%02d:%02d\",\"mode\":\"%s\","
+                      "\"heater\":\"%s\",\"heater_on\":%s,\"pump\":\"%s\",\"valves\":\"%s\","
+                      "\"spa_jets\":%s,\"pool_light\":%s,\"temp\":%s,\"target_temp\":%s,\"temp_unit\":\"" TEMP_UNIT "\",\"relays\":\"%04X\"",
+                      (unsigned long) msg->seqnum, msg->time.year, msg->time.month, msg->time.date,
+                      msg->time.hour % 12 + (msg->time.ampm ? 12 : 0), msg->time.min, msg->time.sec, msg->mode_name,
+                      heater_names[st->heater_mode % 3], st->heater_on ? "true" : "false", pump_names[st->pump % 3],
+                      valve_names[st->valves % 5], st->spa_jets ? "true" : "false", st->pool_light ? "true" : "false",
+                      temp, format_temp(st->target_temp, target_temp), st->relays);
+   if (msg->kind == MQTT_TELEMETRY && len < size)
+      len += snprintf(buf + len, size - len, ",\"uptime\":%lu,\"web_requests\":%d",
+                      (unsigned long) msg->uptime_secs, msg->web_requests);
+   if (len < size) len += snprintf(buf + len, size - len, ",\"dropped\":%lu}", (unsigned long) dropped);
+   return len < size ? len : size - 1; }
+
+void mqtt_check(void) { // publish the next queued message, if we can
+   struct mqtt_msg_t msg;
+   uint32_t dropped;
+   char payload[400];
+   if (!mqtt_client) {
+      if (webserver_address[0]) mqtt_start(); // wait until we have a network
+      return; }
+   if (!mqtt_connected) {
+      mqtt_sent_id = -1; // (we'll send it again when we reconnect)
+      return; }
+   if (mqtt_reconnected) {
+      mqtt_reconnected = false;
+      // (QoS 0, so no ack for it gets mixed up with the one we wait for; it is retained anyway)
+      esp_mqtt_client_enqueue(mqtt_client, MQTT_TOPIC "/status", "online", 0, 0, 1, true); }
+   if (mqtt_sent_id >= 0) { // waiting for an acknowledgement
+      if (mqtt_acked_id == mqtt_sent_id) {
+         mqtt_pop(mqtt_sent_seqnum);
+         mqtt_sent_id = -1; }
+      else if (millis() - mqtt_sent_msecs < MQTT_ACK_MSECS) return; }
+   if (!mqtt_peek(&msg, &dropped)) return;
+   int len = mqtt_format(&msg, dropped, payload, sizeof(payload));
+   int id = esp_mqtt_client_enqueue(mqtt_client,
+                                    msg.kind == MQTT_STATE ? MQTT_TOPIC "/state" : MQTT_TOPIC "/telemetry",
+                                    payload, len, 1, msg.kind == MQTT_STATE, true);
+   if (id < 0) return; // (its outbox is full; try again later)
+   mqtt_sent_id = id;
+   mqtt_sent_seqnum = msg.seqnum;
+   mqtt_sent_msecs = millis(); }
+
+#endif
+//*
@@ -0,0 +1,73 @@
+//--------------------------------------------------------------------------------------
+//  Host test of the pool/spa controller's relay interlocks and mode table
+//
+//  This runs on a workstation, not the controller. It compiles the controller's own
+//  interlock rules and mode table, and checks them:
+//   - for every one of the 2^10 relay states, relays_allowed() (the bitmap that
+//     setrelay() uses) agrees with interlock_violated() (the rules)
+//   - every allowed state is safe: the heater only with its own pump and valves,
+//     never both pumps, and a pump only with one of the four valve configurations
+//   - every mode in the mode table, in its alternate valve configuration too, is
+//     allowed, which is what the controller asserts at startup
+//
+//     c++ -std=c++11 -I.. -o interlock_test interlock_test.cpp
+//     ./interlock_test
+//
+//  It prints what's wrong and exits with 1 if anything is.
+//--------------------------------------------------------------------------------------
+
+#include <stdio.h>
+
+#define HIGH 1  // (as Arduino has them)
+#define LOW 0
+#include "controller_03.h"
+struct config_t config_data;  // (the mode table points into it)
+#include "interlocks.h"
+#include "modes.h"
+
+int failures = 0;
+
+void fail(const char *msg, unsigned value, int rule) {
+   printf("%s: %04X, rule %d\n", msg, value, rule);
+   ++failures; }
+
+bool valves_are(uint16_t relays, vconfig_t config) {
+   return (relays & VALVE_RELAYS) == valve_relays[config]; }
+
+int main(void) {
+   interlocks_init();
+
+   int states = 0, allowed = 0;
+   for (uint32_t relays = 0; relays <= 0xffff; ++relays) {
+      int rule = interlock_violated(relays);
+      if (relays & ~USED_RELAYS) { // not a relay we have
+         if (relays_allowed(relays)) fail("unused relay allowed", relays, rule);
+         continue; }
+      ++states;
+      if (relays_allowed(relays) != (rule < 0)) fail("bitmap disagrees with rules", relays, rule);
+      if (!relays_allowed(relays)) continue;
+      ++allowed;
+      if ((relays & HEAT_SPA_RELAY) && ((relays & PUMP_RELAYS) != SPA_PUMP_RELAY || !valves_are(relays, VALVES_HEAT_SPA)))
+         fail("spa heater without its pump and valves", relays, rule);
+      if ((relays & HEAT_POOL_RELAY) && ((relays & PUMP_RELAYS) != POOL_PUMP_RELAY || !valves_are(relays, VALVES_HEAT_POOL)))
+         fail("pool heater without its pump and valves", relays, rule);
+      if ((relays & PUMP_RELAYS) == PUMP_RELAYS) fail("both pumps", relays, rule);
+      if ((relays & PUMP_RELAYS) && !valves_are(relays, VALVES_HEAT_SPA) && !valves_are(relays, VALVES_HEAT_POOL)
+            && !valves_are(relays, VALVES_FILL_SPA) && !valves_are(relays, VALVES_EMPTY_SPA))
+         fail("pump with the valves in between", relays, rule); }
+   if (states != 1024) fail("wrong number of relay states", states, -1);
+
+   for (int ndx = 0; ndx < NUM_MODES; ++ndx) {
+      const struct mode_desc_t *desc = &mode_table[ndx];
+      uint16_t relays = equipment_relays(desc->valves, desc->pump, desc->heater);
+      if (!relays_allowed(relays)) {
+         printf("mode %d: ", ndx);
+         fail("not allowed", relays, interlock_violated(relays)); }
+      if (desc->alt_valves != VALVES_UNDEFINED) {
+         relays = equipment_relays(desc->alt_valves, desc->pump, desc->heater);
+         if (!relays_allowed(relays)) {
+            printf("mode %d: ", ndx);
+            fail("alternate valves not allowed", relays, interlock_violated(relays)); } } }
+
+   printf("%d relay states, %d allowed, %d modes: %d failures\n", states, allowed, NUM_MODES, failures);
+   return failures ? 1 : 0; }
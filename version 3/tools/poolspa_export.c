@@ -0,0 +1,476 @@
+//--------------------------------------------------------------------------------------
+//  Decoder and analyzer for the pool/spa controller's /export.bin
+//
+//  This runs on a workstation, not the controller. It reads the binary export,
+//  writes each table as a CSV file, and prints a summary: event counts, how
+//  long each mode ran, and how fast the water heated.
+//
+//     cc -O2 -o poolspa_export poolspa_export.c
+//     curl -o export.bin http://<controller address>/export.bin
+//     ./poolspa_export [-o outputdir] export.bin
+//
+//  It writes events.csv, temps.csv, config.csv, and counters.csv. The export
+//  describes itself (see "Bulk export" in controller_03.ino), so this doesn't
+//  need to change when events, log formats, or config fields are added. But
+//  if the format version changes, this has to be taught the new version.
+//--------------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#define EXPORT_VERSION 2
+#define MAX_NAMES 256
+#define HEATING_MIN_MINUTES 15  // the shortest heating run we report
+#define HEATING_MAX_GAP_SECS 180 // a longer gap between temperatures ends a run
+
+typedef unsigned char byte;
+
+struct datetime { // as the controller's realtime clock has it
+   byte sec, min, hour /*1-12*/, ampm, day /*1-7*/, date, month, year /*00-99*/; };
+
+struct { // what we learned from the export
+   int abi_int, abi_long, abi_longlong, abi_double, abi_pointer;
+   struct datetime now;
+   int num_events;
+   char *event_names[MAX_NAMES];
+   int num_modes;
+   int mode_events[MAX_NAMES];  // the event that starts each mode
+   int num_restarts;
+   int restart_events[MAX_NAMES]; // the events after which we're idle
+   int num_formats;
+   char *log_formats[MAX_NAMES];
+   int num_counters;
+   char *counter_names[MAX_NAMES];
+   uint32_t counter_values[MAX_NAMES];
+   int num_fields;
+   struct {
+      char *name;
+      int offset, min, max; } fields[MAX_NAMES];
+   const byte *config;
+   int config_len;
+   const byte *log;
+   int log_entrysize, log_binaryflag, log_count;
+   uint32_t log_firstseq;
+   const byte *temps;
+   int temp_entrysize, temp_count;
+   uint32_t temp_firstseq; } ex;
+
+const char *outdir = ".";
+
+void fatal(const char *msg, ...) {
+   va_list args;
+   va_start(args, msg);
+   fprintf(stderr, "poolspa_export: ");
+   vfprintf(stderr, msg, args);
+   fprintf(stderr, "\n");
+   va_end(args);
+   exit(1); }
+
+uint32_t get_uint(const byte *ptr, int len) { // little-endian
+   uint32_t value = 0;
+   for (int ndx = len - 1; ndx >= 0; --ndx) value = (value << 8) | ptr[ndx];
+   return value; }
+
+//------------------------------------------------------------------
+//  reading the sections
+//------------------------------------------------------------------
+
+struct reader_t { // a position in a section
+   const byte *ptr, *end; };
+
+uint32_t read_uint(struct reader_t *rd, int len) {
+   if (rd->ptr + len > rd->end) fatal("section is too short");
+   uint32_t value = get_uint(rd->ptr, len);
+   rd->ptr += len;
+   return value; }
+
+char *read_name(struct reader_t *rd) { // with a 1-byte length
+   int len = read_uint(rd, 1);
+   if (rd->ptr + len > rd->end) fatal("section is too short");
+   char *name = malloc(len + 1);
+   memcpy(name, rd->ptr, len);
+   name[len] = 0;
+   rd->ptr += len;
+   return name; }
+
+int read_strings(struct reader_t *rd, char **strings) { // a count, then 0-terminated strings
+   int count = read_uint(rd, 1);
+   for (int ndx = 0; ndx < count; ++ndx) {
+      const byte *end = memchr(rd->ptr, 0, rd->end - rd->ptr);
+      if (!end) fatal("string isn't terminated");
+      strings[ndx] = strdup((const char *) rd->ptr);
+      rd->ptr = end + 1; }
+   return count; }
+
+void read_export(const byte *data, long size) {
+   if (size < 8 || memcmp(data, "PSCX", 4) != 0) fatal("this isn't a controller export");
+   int version = get_uint(data + 4, 2);
+   if (version != EXPORT_VERSION) fatal("export version %d, but we only know version %d", version, EXPORT_VERSION);
+   for (long offset = 8; ; ) {
+      if (offset + 8 > size) fatal("export is truncated");
+      char tag[5];
+      memcpy(tag, data + offset, 4);
+      tag[4] = 0;
+      uint32_t len = get_uint(data + offset + 4, 4);
+      offset += 8;
+      if (offset + len > size) fatal("section \"%s\" is truncated", tag);
+      struct reader_t rd = {data + offset, data + offset + len };
+      if (strcmp(tag, "END ") == 0) return;
+      else if (strcmp(tag, "ABI ") == 0) {
+         ex.abi_int = read_uint(&rd, 1); ex.abi_long = read_uint(&rd, 1); ex.abi_longlong = read_uint(&rd, 1);
+         ex.abi_double = read_uint(&rd, 1); ex.abi_pointer = read_uint(&rd, 1); }
+      else if (strcmp(tag, "NOW ") == 0) {
+         if (len < sizeof(struct datetime)) fatal("section is too short");
+         memcpy(&ex.now, rd.ptr, sizeof(struct datetime)); }
+      else if (strcmp(tag, "CNTR") == 0)
+         while (rd.ptr < rd.end && ex.num_counters < MAX_NAMES) {
+            ex.counter_names[ex.num_counters] = read_name(&rd);
+            ex.counter_values[ex.num_counters++] = read_uint(&rd, 4); }
+      else if (strcmp(tag, "CFLD") == 0) {
+         ex.num_fields = read_uint(&rd, 1);
+         for (int ndx = 0; ndx < ex.num_fields; ++ndx) {
+            ex.fields[ndx].name = read_name(&rd);
+            ex.fields[ndx].offset = read_uint(&rd, 1);
+            ex.fields[ndx].min = read_uint(&rd, 1);
+            ex.fields[ndx].max = read_uint(&rd, 1); } }
+      else if (strcmp(tag, "CONF") == 0) {
+         ex.config = rd.ptr;
+         ex.config_len = len; }
+      else if (strcmp(tag, "EVNM") == 0)
+         ex.num_events = read_strings(&rd, ex.event_names);
+      else if (strcmp(tag, "MODE") == 0) {
+         ex.num_modes = read_uint(&rd, 1);
+         for (int ndx = 0; ndx < ex.num_modes; ++ndx) ex.mode_events[ndx] = read_uint(&rd, 1);
+         ex.num_restarts = read_uint(&rd, 1);
+         for (int ndx = 0; ndx < ex.num_restarts; ++ndx) ex.restart_events[ndx] = read_uint(&rd, 1); }
+      else if (strcmp(tag, "LFMT") == 0)
+         ex.num_formats = read_strings(&rd, ex.log_formats);
+      else if (strcmp(tag, "LOG ") == 0) {
+         ex.log_entrysize = read_uint(&rd, 2);
+         ex.log_binaryflag = read_uint(&rd, 2);
+         ex.log_firstseq = read_uint(&rd, 4);
+         if (ex.log_entrysize < 10) fatal("log entries are too small");
+         ex.log = rd.ptr;
+         ex.log_count = (rd.end - rd.ptr) / ex.log_entrysize; }
+      else if (strcmp(tag, "TEMP") == 0) {
+         ex.temp_entrysize = read_uint(&rd, 2);
+         ex.temp_firstseq = read_uint(&rd, 4);
+         if (ex.temp_entrysize < (int) sizeof(struct datetime)) fatal("temperature entries are too small");
+         ex.temps = rd.ptr;
+         ex.temp_count = (rd.end - rd.ptr) / ex.temp_entrysize; }
+      // (other sections are from a newer controller, and we skip them)
+      offset += len; } }
+
+//------------------------------------------------------------------
+//  formatting
+//------------------------------------------------------------------
+
+int datetime_valid(const struct datetime *dt) { // (not checking the day, which might be a temperature)
+   return dt->sec <= 59 && dt->min <= 59 && dt->hour >= 1 && dt->hour <= 12
+          && dt->date >= 1 && dt->date <= 31 && dt->month >= 1 && dt->month <= 12 && dt->year <= 99; }
+
+time_t datetime_secs(const struct datetime *dt) { // seconds since 1970, or 0 if it's not valid
+   if (!datetime_valid(dt)) return 0;
+   struct tm tm = {0 };
+   tm.tm_year = dt->year + 100;
+   tm.tm_mon = dt->month - 1;
+   tm.tm_mday = dt->date;
+   tm.tm_hour = dt->hour % 12 + (dt->ampm ? 12 : 0);
+   tm.tm_min = dt->min;
+   tm.tm_sec = dt->sec;
+   return timegm(&tm); } // (the clock has local time, but we only care about differences)
+
+char *format_secs(time_t secs, char *buf, int bufsize) {
+   if (secs == 0) buf[0] = 0;
+   else strftime(buf, bufsize, "%Y-%m-%d %H:%M:%S", gmtime(&secs));
+   return buf; }
+
+void render_args(const char *format, const byte *args, int argslen, char *out, int outsize) {
+   // format the binary arguments of a log entry, which have the controller's type sizes
+   int outlen = 0, argndx = 0;
+   const char *fmt = format;
+#define FETCH(len, var) { \
+      if (argndx + (len) > argslen || (len) > 8) goto truncated; \
+      var = 0; \
+      for (int ndx = (len) - 1; ndx >= 0; --ndx) var = (var << 8) | args[argndx + ndx]; \
+      argndx += (len); }
+#define EMIT(arg) { \
+      outlen += snprintf(out + outlen, outsize - outlen, spec, arg); \
+      if (outlen >= outsize) outlen = outsize - 1; }
+   while (*fmt && outlen < outsize - 1) {
+      if (*fmt != '%' || fmt[1] == '%') { // copy ordinary characters
+         out[outlen++] = *fmt;
+         fmt += *fmt == '%' ? 2 : 1;
+         continue; }
+      char spec[40];
+      int speclen = 0, longs = 0;
+      uint64_t value;
+      spec[speclen++] = *fmt++;
+      while (*fmt && strchr("-+ #0", *fmt) && speclen < 10) spec[speclen++] = *fmt++; // flags
+      for (int part = 0; part < 2; ++part) { // width, then precision
+         if (part == 1) {
+            if (*fmt != '.') break;
+            spec[speclen++] = *fmt++; }
+         if (*fmt == '*') {
+            FETCH(ex.abi_int, value);
+            speclen += sprintf(spec + speclen, "%d", (int) (int32_t) value);
+            ++fmt; }
+         else while (*fmt >= '0' && *fmt <= '9' && speclen < 25) spec[speclen++] = *fmt++; }
+      for (; *fmt && strchr("hlLqjzt", *fmt); ++fmt) // length modifiers, which we redo
+         if (*fmt == 'q' || *fmt == 'j') longs = 2;
+         else if (*fmt == 'l' || *fmt == 'z' || *fmt == 't') ++longs;
+      char conv = *fmt;
+      if (*fmt) ++fmt;
+      if (conv && strchr("diouxXc", conv)) {
+         int len = longs >= 2 ? ex.abi_longlong : longs == 1 ? ex.abi_long : ex.abi_int;
+         FETCH(len, value);
+         if (conv == 'c') {
+            strcpy(spec + speclen, "c");
+            EMIT((int) value); }
+         else {
+            if ((conv == 'd' || conv == 'i') && len < 8 && (value >> (8 * len - 1)) & 1)
+               value |= ~(uint64_t) 0 << (8 * len); // sign-extend
+            sprintf(spec + speclen, "ll%c", conv);
+            EMIT((long long) value); } }
+      else if (conv && strchr("feEgGaA", conv)) {
+         double arg;
+         FETCH(ex.abi_double, value);
+         memcpy(&arg, &value, sizeof(arg));
+         sprintf(spec + speclen, "%c", conv);
+         EMIT(arg); }
+      else if (conv == 'p') {
+         FETCH(ex.abi_pointer, value);
+         strcpy(spec, "0x%llx");
+         EMIT((unsigned long long) value); }
+      else if (conv == 's') {
+         char str[256];
+         if (argndx >= argslen || argndx + 1 + args[argndx] > argslen) goto truncated;
+         memcpy(str, args + argndx + 1, args[argndx]);
+         str[args[argndx]] = 0;
+         argndx += 1 + args[argndx];
+         strcpy(spec + speclen, "s");
+         EMIT(str); }
+      else break; }
+   out[outlen] = 0;
+   return;
+truncated:
+   snprintf(out + outlen, outsize - outlen, "?");
+#undef FETCH
+#undef EMIT
+}
+
+const char *event_name(int event_type) {
+   return event_type < ex.num_events ? ex.event_names[event_type] : "???"; }
+
+long long counter_value(int ndx) { // the "_tenths" counters are signed
+   const char *name = ex.counter_names[ndx];
+   int len = strlen(name);
+   if (len >= 7 && strcmp(name + len - 7, "_tenths") == 0) return (int32_t) ex.counter_values[ndx];
+   return ex.counter_values[ndx]; }
+
+void log_entry(int ndx, struct datetime *dt, int *event_type, char *msg, int msgsize) {
+   // decode log entry ndx, in the controller's logentry_t layout
+   const byte *entry = ex.log + ndx * ex.log_entrysize;
+   const byte *msgdata = entry + sizeof(struct datetime) + 2;
+   int msglen = ex.log_entrysize - sizeof(struct datetime) - 2;
+   memcpy(dt, entry, sizeof(struct datetime));
+   int type = get_uint(entry + sizeof(struct datetime), 2);
+   *event_type = type & ~ex.log_binaryflag;
+   if (type & ex.log_binaryflag) {
+      if (msgdata[0] < ex.num_formats)
+         render_args(ex.log_formats[msgdata[0]], msgdata + 1, msglen - 1, msg, msgsize);
+      else snprintf(msg, msgsize, "format %d?", msgdata[0]); }
+   else { // text, maybe not 0-terminated
+      int len = msglen < msgsize - 1 ? msglen : msgsize - 1;
+      memcpy(msg, msgdata, len);
+      msg[len] = 0; } }
+
+void temp_entry(int ndx, time_t *secs, double *temp) { // the temperature in degrees F
+   const byte *entry = ex.temps + ndx * ex.temp_entrysize;
+   struct datetime dt;
+   memcpy(&dt, entry, sizeof(dt));
+   if (ex.temp_entrysize >= (int) sizeof(dt) + 2) // tenths of a degree follow the time
+      *temp = (int16_t) (entry[sizeof(dt)] | entry[sizeof(dt) + 1] << 8) / 10.;
+   else *temp = dt.day; // older controllers put whole degrees where the day of the week was
+   *secs = datetime_secs(&dt); }
+
+//------------------------------------------------------------------
+//  the CSV files
+//------------------------------------------------------------------
+
+FILE *open_csv(const char *name, const char *heading) {
+   char path[1000];
+   snprintf(path, sizeof(path), "%s/%s", outdir, name);
+   FILE *file = fopen(path, "w");
+   if (!file) fatal("can't create %s", path);
+   fprintf(file, "%s\n", heading);
+   return file; }
+
+void csv_string(FILE *file, const char *str) { // quoted if it needs to be
+   if (!strpbrk(str, ",\"\n")) {
+      fputs(str, file);
+      return; }
+   putc('"', file);
+   for (; *str; ++str) {
+      if (*str == '"') putc('"', file);
+      putc(*str, file); }
+   putc('"', file); }
+
+void write_csv_files(void) {
+   char timestr[30], msg[300];
+   FILE *file = open_csv("events.csv", "seq,time,event,message");
+   for (int ndx = 0; ndx < ex.log_count; ++ndx) {
+      struct datetime dt;
+      int event_type;
+      log_entry(ndx, &dt, &event_type, msg, sizeof(msg));
+      fprintf(file, "%lu,%s,", (unsigned long) (ex.log_firstseq + ndx), format_secs(datetime_secs(&dt), timestr, sizeof(timestr)));
+      csv_string(file, event_name(event_type));
+      putc(',', file);
+      csv_string(file, msg);
+      putc('\n', file); }
+   fclose(file);
+
+   file = open_csv("temps.csv", "seq,time,temp,raw");
+   for (int ndx = 0; ndx < ex.temp_count; ++ndx) {
+      time_t secs;
+      double temp;
+      temp_entry(ndx, &secs, &temp);
+      fprintf(file, "%lu,%s,%.1f,", (unsigned long) (ex.temp_firstseq + ndx), format_secs(secs, timestr, sizeof(timestr)), temp);
+      if (ex.temp_entrysize >= (int) sizeof(struct datetime) + 4) { // the unfiltered reading follows
+         const byte *raw = ex.temps + ndx * ex.temp_entrysize + sizeof(struct datetime) + 2;
+         fprintf(file, "%.1f", (int16_t) (raw[0] | raw[1] << 8) / 10.); }
+      putc('\n', file); }
+   fclose(file);
+
+   file = open_csv("config.csv", "field,value,min,max");
+   for (int ndx = 0; ndx < ex.num_fields; ++ndx)
+      if (ex.fields[ndx].offset < ex.config_len)
+         fprintf(file, "%s,%d,%d,%d\n", ex.fields[ndx].name, ex.config[ex.fields[ndx].offset],
+                 ex.fields[ndx].min, ex.fields[ndx].max);
+   fclose(file);
+
+   file = open_csv("counters.csv", "name,value");
+   for (int ndx = 0; ndx < ex.num_counters; ++ndx)
+      fprintf(file, "%s,%lld\n", ex.counter_names[ndx], counter_value(ndx));
+   fclose(file); }
+
+//------------------------------------------------------------------
+//  the summary
+//------------------------------------------------------------------
+
+struct { // when each mode started, from the log
+   time_t secs;
+   int mode; } *timeline;
+int timeline_count = 0;
+
+int mode_of_event(int event_type) { // which mode an event starts, or -1
+   for (int mode = 0; mode < ex.num_modes; ++mode)
+      if (ex.mode_events[mode] == event_type) return mode;
+   for (int ndx = 0; ndx < ex.num_restarts; ++ndx)
+      if (ex.restart_events[ndx] == event_type) return 0; // idle
+   return -1; }
+
+const char *mode_name(int mode) {
+   return mode >= 0 && mode < ex.num_modes ? event_name(ex.mode_events[mode]) : "unknown"; }
+
+int mode_at(time_t secs) { // what mode we were in then
+   int mode = -1;
+   for (int ndx = 0; ndx < timeline_count && timeline[ndx].secs <= secs; ++ndx)
+      mode = timeline[ndx].mode;
+   return mode; }
+
+void summarize(void) {
+   char timestr[30], msg[300];
+   time_t now_secs = datetime_secs(&ex.now);
+   printf("exported %s: %d log entries (numbers %lu to %lu), %d temperatures\n",
+          format_secs(now_secs, timestr, sizeof(timestr)), ex.log_count, (unsigned long) ex.log_firstseq,
+          (unsigned long) (ex.log_firstseq + ex.log_count - 1), ex.temp_count);
+
+   // count the events, and make the timeline of modes
+   int *event_counts = calloc(ex.num_events + 1, sizeof(int));
+   timeline = calloc(ex.log_count + 1, sizeof(*timeline));
+   for (int ndx = 0; ndx < ex.log_count; ++ndx) {
+      struct datetime dt;
+      int event_type;
+      log_entry(ndx, &dt, &event_type, msg, sizeof(msg));
+      ++event_counts[event_type < ex.num_events ? event_type : ex.num_events];
+      time_t secs = datetime_secs(&dt);
+      int mode = mode_of_event(event_type);
+      if (mode >= 0 && secs) {
+         timeline[timeline_count].secs = secs;
+         timeline[timeline_count++].mode = mode; } }
+   printf("\nevent counts:\n");
+   for (int event_type = 0; event_type <= ex.num_events; ++event_type)
+      if (event_counts[event_type])
+         printf("  %6d  %s\n", event_counts[event_type], event_type < ex.num_events ? ex.event_names[event_type] : "(unknown)");
+
+   // how long each mode ran
+   printf("\nmode runtimes:\n");
+   for (int mode = 1; mode < ex.num_modes; ++mode) {
+      double hours = 0;
+      int runs = 0;
+      for (int ndx = 0; ndx < timeline_count; ++ndx)
+         if (timeline[ndx].mode == mode) {
+            time_t end = ndx + 1 < timeline_count ? timeline[ndx + 1].secs : now_secs;
+            if (end > timeline[ndx].secs) hours += (end - timeline[ndx].secs) / 3600.;
+            ++runs; }
+      printf("  %-16s %4d runs, %8.1f hours\n", mode_name(mode), runs, hours); }
+
+   // how fast the water heated or cooled, from runs of temperatures
+   printf("\ntemperature runs of %d minutes or more:\n", HEATING_MIN_MINUTES);
+   double rate_sum[MAX_NAMES] = {0 };
+   int rate_count[MAX_NAMES] = {0 };
+   for (int start = 0; start < ex.temp_count; ) {
+      time_t first_secs, secs, last_secs;
+      double first_temp, temp, last_temp;
+      int end;
+      temp_entry(start, &first_secs, &first_temp);
+      last_secs = first_secs; last_temp = first_temp;
+      for (end = start + 1; end < ex.temp_count; ++end) {
+         temp_entry(end, &secs, &temp);
+         if (!first_secs || !secs || secs - last_secs > HEATING_MAX_GAP_SECS || secs < last_secs) break;
+         last_secs = secs; last_temp = temp; }
+      double minutes = (last_secs - first_secs) / 60.;
+      if (first_secs && minutes >= HEATING_MIN_MINUTES) {
+         double rate = (last_temp - first_temp) / (minutes / 60);
+         int mode = mode_at(first_secs);
+         printf("  %s  %5.0f min  %5.1f to %5.1f F  %+6.1f F/hour  %s\n", format_secs(first_secs, timestr, sizeof(timestr)),
+                minutes, first_temp, last_temp, rate, mode_name(mode));
+         if (mode >= 0 && mode < MAX_NAMES) {
+            rate_sum[mode] += rate;
+            ++rate_count[mode]; } }
+      start = end; }
+   printf("\naverage rates:\n");
+   for (int mode = 0; mode < ex.num_modes && mode < MAX_NAMES; ++mode)
+      if (rate_count[mode])
+         printf("  %-16s %+6.1f F/hour over %d runs\n", mode_name(mode), rate_sum[mode] / rate_count[mode], rate_count[mode]);
+
+   printf("\ncounters:\n");
+   for (int ndx = 0; ndx < ex.num_counters; ++ndx)
+      printf("  %-24s %lld\n", ex.counter_names[ndx], counter_value(ndx)); }
+
+int main(int argc, char **argv) {
+   const char *filename = NULL;
+   for (int arg = 1; arg < argc; ++arg) {
+      if (strcmp(argv[arg], "-o") == 0 && arg + 1 < argc) outdir = argv[++arg];
+      else if (argv[arg][0] == '-') filename = NULL, arg = argc;
+      else filename = argv[arg]; }
+   if (!filename) {
+      fprintf(stderr, "use: poolspa_export [-o outputdir] export.bin\n");
+      return 1; }
+   FILE *file = fopen(filename, "rb");
+   if (!file) fatal("can't open %s", filename);
+   fseek(file, 0, SEEK_END);
+   long size = ftell(file);
+   fseek(file, 0, SEEK_SET);
+   byte *data = malloc(size > 0 ? size : 1);
+   if (fread(data, 1, size, file) != (size_t) size) fatal("can't read %s", filename);
+   fclose(file);
+   read_export(data, size);
+   write_csv_files();
+   summarize();
+   return 0; }
@@ -11,9 +11,23 @@
    every 5 seconds.
 
    The home page also has navigation buttons to these subpages:
-     /log         show the whole event log
+     /log         show the whole event log, or with ?after=n only the entries after number n
+     /debuglog    show the recent debugging output
+     /wifitest    measure the WiFi link from the browser, and show its history
+     /login       log in with the web password, which is needed to push buttons
+     /logout      log out
+     /config      view or change the configuration, as a form or as JSON (?json)
+     /export.bin  download everything in binary, for tools/poolspa_export.c
+     /archive     the long-term archive as CSV: ?res=5min, hour, or day, and &days=n
      /visitors    show the list of IP addresses who visited
-     /temps       show the temperature history when the pool or spa was being heated
+     /temps       show the temperature history when the pool or spa was being heated,
+                  or with ?after=n only the entries after number n
+
+   If we can't connect to the house WiFi network for a minute, we also start our own
+   access point, so someone at the equipment can still use a phone. While it is up we
+   answer every DNS query with our own address and redirect unknown pages to the home
+   page, which makes phones show it as a "captive portal". We go back to being only a
+   station a while after the house network returns.
 
    See the main module for other details and the change log.
    ----------------------------------------------------------------------------------------
@@ -74,11 +88,34 @@
 //#include <http_parser.h>
 #include "Arduino.h"
 #include "lwip/sockets.h"
+#include "mbedtls/sha256.h"
+#include "esp_system.h"
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
 #define MAX_IP_ADDRESSES 50     // maximum visitors we keep track of
-#define ESP_MAX_RETRY   3       // maximum retries to connect to WiFi
+#define WIFI_RETRY_FIRST_MSECS 250     // first wait before reconnecting to WiFi, doubling each time
+#define WIFI_RETRY_MAX_MSECS 8000      // up to this, forever
+#define WIFI_ATTEMPT_TIMEOUT_MSECS 15000 // how long to wait for an attempt that hasn't finished
+#define WIFI_RETRY_SOFTAP_MSECS 30000  // the wait while our access point is up, since scans disturb it
+#define SOFTAP_START_MSECS 60000       // start our access point after this long without the network
+#define SOFTAP_STOP_MSECS 30000        // and stop it after the network has been back this long
+#define SOFTAP_MAX_CLIENTS 4
+#define DNS_PORT 53
+#define LINKHIST_DELTA_MINS 5          // minutes between WiFi link history entries
+#define LINKHIST_ENTRIES (24*60/LINKHIST_DELTA_MINS) // how many to keep: one day
+#define WIFITEST_MAX_BYTES 262144      // the largest throughput test
+
+#define RATE_BURST 10          // requests a client can make all at once
+#define RATE_PER_SEC 2         // and then how many per second
+#define RATE_POST_COST 3       // how many requests a POST counts as
+#define WEB_MAX_SOCKETS 7      // connections the server keeps open (the ESP-IDF default)
+#define SHED_LAG_MSECS 1000    // refuse requests if the controller hasn't run for this long
+#define SHED_MAX_SOCKETS WEB_MAX_SOCKETS // or if this many are open, counting the request's own
+#define SHED_RETRY_SECS 2      // and ask them to come back after this long
+
+#define SESSION_HOURS (7*24)   // how long a login lasts
+#define SESSION_MAC_BYTES 16   // how much of the HMAC-SHA256 we use
 typedef uint32_t IPV4address;
 
 #define HTML_DOWNARROW   "&#8595;"   // HTML arrow symbols
@@ -93,6 +130,7 @@ typedef uint32_t IPV4address;
 //******** status info that the main task in the other CPU displays
 
 char webserver_address[25] = {0 }; // for the main program to display
+static httpd_handle_t server = NULL;
 int connect_successes = 0;
 int connect_failures = 0;
 int client_requests = 0;
@@ -103,11 +141,19 @@ struct client_t { // history of the clients whose web browsers made requests
    IPV4address ip_address;
    long count;
    struct datetime first_time, recent_time;
+   long tokens;                // rate-limiting bucket, in thousandths of a request
+   unsigned long token_time;   // when it was last filled
+   long refused;               // how many requests we refused
+   uint32_t session_expiry;    // the session cookie we last verified for it
+   byte session_mac[SESSION_MAC_BYTES];
    bool gave_password; }
 clients[MAX_IP_ADDRESSES],
         *current_client;
-long requests_processed = 0;
+long requests_processed = 0, requests_shed = 0;
 long wifi_connects = 0, wifi_connectfails = 0, wifi_disconnects = 0, wifi_resets = 0;
+unsigned long wifi_last_outage_msecs = 0, wifi_max_outage_msecs = 0, wifi_total_outage_msecs = 0;
+void wifi_stats_dump(void * parm, void (*print)(void * parm, const char *line, ...));
+esp_err_t captive_portal_handler(httpd_req_t *req, httpd_err_code_t err);
 
 char *format_ip_address(IPV4address addr, char *str) {
    // str should be at least 21 bytes long:  xxx.xxx.xxx.xxx:nnnn
@@ -129,6 +175,10 @@ struct client_t * remember_ip_address(httpd_req_t *req, IPV4address addr) { // r
    clients[min_ndx].ip_address = addr; // create a new entry for it
    clients[min_ndx].count = 1;
    clients[min_ndx].gave_password = false;
+   clients[min_ndx].tokens = RATE_BURST * 1000L;
+   clients[min_ndx].token_time = millis();
+   clients[min_ndx].refused = 0;
+   clients[min_ndx].session_expiry = 0;
    clients[min_ndx].first_time = clients[min_ndx].recent_time = now;
    return &clients[min_ndx]; }
 
@@ -145,7 +195,134 @@ IPV4address get_remote_ip(httpd_req_t *req) {
    else dprint("Error getting client's IP address\n");
    return v4addr; }
 
-void report_ip_address(httpd_req_t *req, const char *content) {
+/* Requests are rate-limited per client with a token bucket: a client can
+   make RATE_BURST requests at once, and then RATE_PER_SEC a second. Beyond
+   that we answer 429. Independently, we shed all load with 503 if the
+   controller task hasn't run recently or too many connections are open, so
+   that the web can never get in the way of running the pumps and heater. */
+
+bool client_allowed(struct client_t *client, int cost) { // take tokens from its bucket, if it has them
+   unsigned long msecs = millis();
+   unsigned long elapsed = MIN(msecs - client->token_time, RATE_BURST * 1000UL); // (enough to fill it)
+   client->tokens = MIN(client->tokens + (long) (elapsed * RATE_PER_SEC), RATE_BURST * 1000L);
+   client->token_time = msecs;
+   if (client->tokens < cost * 1000L) return false;
+   client->tokens -= cost * 1000L;
+   return true; }
+
+bool overloaded(void) { // should we shed load?
+   size_t nfds = WEB_MAX_SOCKETS; // (which must be at least the server's max_open_sockets)
+   int fds[WEB_MAX_SOCKETS];
+   if (millis() - controller_heartbeat > SHED_LAG_MSECS) return true;
+   esp_err_t err = httpd_get_client_list(server, &nfds, fds);
+   if (err != ESP_OK) {
+      dprint("ESP err %d getting the web client list\n", err);
+      return false; } // (so a problem here doesn't refuse everything)
+   return nfds >= SHED_MAX_SOCKETS; }
+
+void refuse_request(httpd_req_t *req, const char *status, int retry_secs) {
+   char retry[12];
+   snprintf(retry, sizeof(retry), "%d", retry_secs);
+   httpd_resp_set_status(req, status);
+   httpd_resp_set_hdr(req, "Retry-After", retry);
+   httpd_resp_set_hdr(req, "Connection", "close");
+   httpd_resp_send(req, status, HTTPD_RESP_USE_STRLEN); }
+
+bool admit_request(httpd_req_t *req, struct client_t *client, int cost) {
+   // return false, having sent the refusal, if we won't handle this request
+   if (overloaded()) {
+      ++requests_shed;
+      refuse_request(req, "503 Service Unavailable", SHED_RETRY_SECS);
+      return false; }
+   if (!client_allowed(client, cost)) {
+      ++client->refused;
+      refuse_request(req, "429 Too Many Requests",
+                     (cost * 1000 - client->tokens) / (RATE_PER_SEC * 1000) + 1);
+      return false; }
+   return true; }
+
+//*********** session authentication routines  ********
+
+/* Pushing buttons needs a login, but looking doesn't. Logging in with the web
+   password gets a session cookie: an expiration time and the client's IP
+   address, signed with HMAC-SHA256 using a random key chosen at startup. So
+   a reboot logs everyone out, and we keep no session table. Checking a cookie
+   uses only the stack, and compares in constant time. The last cookie verified
+   for each client is remembered, so usually we don't even recompute the HMAC. */
+
+byte session_key[32];
+
+void session_init(void) {
+   esp_fill_random(session_key, sizeof(session_key)); }
+
+uint32_t session_now(void) { // seconds since startup, which is good enough since the key changes
+   return (uint32_t) (esp_timer_get_time() / 1000000); }
+
+void session_hmac(uint32_t expiry, IPV4address addr, byte *mac) {
+   // compute HMAC-SHA256(key, expiry | address), per RFC 2104
+   byte inner[64 + 8], outer[64 + 32];
+   for (int ndx = 0; ndx < 64; ++ndx) {
+      byte keybyte = ndx < sizeof(session_key) ? session_key[ndx] : 0;
+      inner[ndx] = keybyte ^ 0x36;
+      outer[ndx] = keybyte ^ 0x5c; }
+   memcpy(inner + 64, &expiry, 4);
+   memcpy(inner + 68, &addr, 4);
+   mbedtls_sha256_ret(inner, sizeof(inner), outer + 64, 0);
+   byte hash[32];
+   mbedtls_sha256_ret(outer, sizeof(outer), hash, 0);
+   memcpy(mac, hash, SESSION_MAC_BYTES); }
+
+bool equal_constant_time(const byte *a, const byte *b, int len) {
+   byte diff = 0;
+   for (int ndx = 0; ndx < len; ++ndx) diff |= a[ndx] ^ b[ndx];
+   return diff == 0; }
+
+int hex_digit(char ch) {
+   if (ch >= '0' && ch <= '9') return ch - '0';
+   if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+   if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+   return -1; }
+
+bool session_valid(httpd_req_t *req, struct client_t *client) { // does it have a good session cookie?
+   char cookies[200];
+   byte token[4 + SESSION_MAC_BYTES], mac[SESSION_MAC_BYTES];
+   uint32_t expiry;
+   if (httpd_req_get_hdr_value_len(req, "Cookie") >= sizeof(cookies)
+         || httpd_req_get_hdr_value_str(req, "Cookie", cookies, sizeof(cookies)) != ESP_OK)
+      return false;
+   const char *value = cookies; // find our cookie, and not one like "xsession="
+   while ((value = strstr(value, "session=")) && value != cookies && value[-1] != ' ' && value[-1] != ';')
+      ++value;
+   if (!value) return false;
+   value += 8;
+   for (int ndx = 0; ndx < sizeof(token); ++ndx) { // decode the hex
+      int hi = hex_digit(value[2 * ndx]), lo = hi < 0 ? -1 : hex_digit(value[2 * ndx + 1]);
+      if (lo < 0) return false;
+      token[ndx] = (hi << 4) | lo; }
+   memcpy(&expiry, token, 4);
+   if ((int32_t) (expiry - session_now()) <= 0) return false; // expired
+   if (client->session_expiry == expiry // the one we verified before?
+         && equal_constant_time(client->session_mac, token + 4, SESSION_MAC_BYTES))
+      return true;
+   session_hmac(expiry, client->ip_address, mac);
+   if (!equal_constant_time(mac, token + 4, SESSION_MAC_BYTES)) return false;
+   client->session_expiry = expiry; // remember it
+   memcpy(client->session_mac, mac, SESSION_MAC_BYTES);
+   return true; }
+
+void session_cookie(struct client_t *client, char *cookie, int size) { // make a new session cookie
+   byte token[4 + SESSION_MAC_BYTES];
+   uint32_t expiry = session_now() + SESSION_HOURS * 3600UL;
+   memcpy(token, &expiry, 4);
+   session_hmac(expiry, client->ip_address, token + 4);
+   int len = snprintf(cookie, size, "session=");
+   for (int ndx = 0; ndx < sizeof(token) && len + 3 < size; ++ndx)
+      len += snprintf(cookie + len, size - len, "%02x", token[ndx]);
+   snprintf(cookie + len, size - len, "; Max-Age=%lu; Path=/; HttpOnly; SameSite=Strict",
+            SESSION_HOURS * 3600UL); }
+
+bool report_ip_address(httpd_req_t *req, const char *content) {
+   // record who made the request, and return false if we refused it
    IPV4address addr = get_remote_ip(req);
    char str[30];
    ++client_requests;
@@ -154,7 +331,8 @@ void report_ip_address(httpd_req_t *req, const char *content) {
           req->method == HTTP_GET ? "GET" : req->method == HTTP_POST ? "POST" : "???",
           req->uri,
           content);
-   remember_ip_address(req, addr); }
+   current_client = remember_ip_address(req, addr);
+   return admit_request(req, current_client, req->method == HTTP_POST ? RATE_POST_COST : 1); }
 
 void sort_clients(void) { // sort the client array by most recent visit time
    int next = 1;  // next element to sort in the insertion sort
@@ -172,6 +350,8 @@ void sort_clients(void) { // sort the client array by most recent visit time
 
 void visitors_dump(void * parm, void (*print)(void * parm, const char *line, ...)) {
    sort_clients();
+   if (requests_shed)
+      print(parm, "%ld requests refused because we were busy<br><br>\r\n", requests_shed);
    for (int ndx = 0; ndx < MAX_IP_ADDRESSES; ++ndx)
       if (clients[ndx].count > 0) {
          char buf[30], datestr[30];
@@ -181,9 +361,290 @@ void visitors_dump(void * parm, void (*print)(void * parm, const char *line, ...
                format_datetime(&clients[ndx].first_time, datestr));
          if (compare_datetime(&clients[ndx].recent_time, &clients[ndx].first_time) != 0)
             print(parm, ", recently at %s", format_datetime(&clients[ndx].recent_time, datestr));
+         if (clients[ndx].refused)
+            print(parm, ", %ld refused", clients[ndx].refused);
          print(parm, "%s<br>\r\n",
                clients[ndx].gave_password ? "; password given" : ""); } }
 
+//*********** gzip compression  ********
+
+/* The big pages, like the log and the temperature history, are very repetitive
+   text, so they are compressed as they are sent if the browser accepts gzip.
+   This is a minimal deflate encoder: LZ77 matching in a 2K window with short
+   hash chains, and only the fixed Huffman codes, so there are no code tables
+   to build or send. That gets most of what a full compressor would, in about
+   16K of RAM. (The ROM's miniz compressor needs more than 10 times that.) */
+
+#define GZ_WINDOW 2048     // the LZ77 window, a power of 2
+#define GZ_HASH_BITS 11    // for the hash table of 3-byte strings
+#define GZ_MAX_CHAIN 8     // how many earlier strings with the same hash we try
+#define GZ_INSIZE 4096     // how much input we compress at a time
+#define GZ_OUTSIZE 2048    // compressed output is sent in chunks of this size
+#define GZ_MIN_MATCH 3
+#define GZ_MAX_MATCH 258
+
+struct {
+   httpd_req_t *req;
+   esp_err_t err;      // the first send error
+   uint32_t base;      // the stream position of data[0]
+   uint32_t crc;
+   uint32_t bitbuf;    // bits not yet in outbuf, least significant first
+   int bitcount;
+   int histlen;        // how much of data[] is the window of earlier input
+   int outlen;
+   uint16_t head[1 << GZ_HASH_BITS]; // (16-bit) position of the latest string with each hash
+   uint16_t prev[GZ_WINDOW];         // position of the string before that with the same hash
+   byte data[GZ_WINDOW + GZ_INSIZE];
+   byte outbuf[GZ_OUTSIZE]; } gz;
+
+static const uint16_t gz_len_base[29] = {
+   3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+   35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const byte gz_len_extra[29] = {
+   0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t gz_dist_base[30] = {
+   1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+   257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint32_t gz_crc_nibble[16] = {
+   0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+   0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C };
+
+void gz_send(void) {
+   if (gz.outlen > 0 && gz.err == ESP_OK)
+      gz.err = httpd_resp_send_chunk(gz.req, (const char *) gz.outbuf, gz.outlen);
+   gz.outlen = 0; }
+
+void gz_byte(byte value) {
+   gz.outbuf[gz.outlen++] = value;
+   if (gz.outlen >= GZ_OUTSIZE) gz_send(); }
+
+void gz_bits(uint32_t value, int count) { // deflate packs bits starting with the least significant
+   gz.bitbuf |= value << gz.bitcount;
+   gz.bitcount += count;
+   while (gz.bitcount >= 8) {
+      gz_byte(gz.bitbuf & 0xff);
+      gz.bitbuf >>= 8;
+      gz.bitcount -= 8; } }
+
+void gz_code(uint32_t code, int count) { // but Huffman codes go most significant bit first
+   uint32_t reversed = 0;
+   for (int bit = 0; bit < count; ++bit, code >>= 1)
+      reversed = (reversed << 1) | (code & 1);
+   gz_bits(reversed, count); }
+
+void gz_symbol(int symbol) { // a literal or length symbol, in the fixed Huffman code
+   if (symbol < 144) gz_code(0x30 + symbol, 8);
+   else if (symbol < 256) gz_code(0x190 + symbol - 144, 9);
+   else if (symbol < 280) gz_code(symbol - 256, 7);
+   else gz_code(0xc0 + symbol - 280, 8); }
+
+void gz_match(int len, int dist) { // a copy of len bytes from dist bytes back
+   int code = 0;
+   while (code < 28 && gz_len_base[code + 1] <= len) ++code;
+   gz_symbol(257 + code);
+   gz_bits(len - gz_len_base[code], gz_len_extra[code]);
+   code = 0;
+   while (code < 29 && gz_dist_base[code + 1] <= dist) ++code;
+   gz_code(code, 5);
+   gz_bits(dist - gz_dist_base[code], code < 4 ? 0 : code / 2 - 1); }
+
+void gz_crc(const byte *data, int len) {
+   for (; len > 0; --len) {
+      gz.crc ^= *data++;
+      gz.crc = (gz.crc >> 4) ^ gz_crc_nibble[gz.crc & 15];
+      gz.crc = (gz.crc >> 4) ^ gz_crc_nibble[gz.crc & 15]; } }
+
+uint32_t gz_hash(const byte *str) {
+   return ((str[0] << 16 | str[1] << 8 | str[2]) * 2654435761u) >> (32 - GZ_HASH_BITS); }
+
+void gz_insert(int pos) { // add the string at data[pos] to the hash chains
+   uint32_t hash = gz_hash(gz.data + pos);
+   uint16_t position = gz.base + pos;
+   gz.prev[position & (GZ_WINDOW - 1)] = gz.head[hash];
+   gz.head[hash] = position; }
+
+void gz_begin(httpd_req_t *req) {
+   static const byte header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff }; // deflate, no name, no time
+   memset(gz.head, 0, sizeof(gz.head));
+   memset(gz.prev, 0, sizeof(gz.prev));
+   gz.req = req;
+   gz.err = ESP_OK;
+   gz.base = 0;
+   gz.crc = 0xffffffff;
+   gz.bitbuf = gz.bitcount = gz.histlen = gz.outlen = 0;
+   for (unsigned ndx = 0; ndx < sizeof(header); ++ndx) gz_byte(header[ndx]);
+   gz_bits(0, 1); // not the final block...
+   gz_bits(1, 2); } // ...and it uses the fixed Huffman codes
+
+void gz_compress_piece(const byte *input, int len) { // up to GZ_INSIZE bytes
+   memcpy(gz.data + gz.histlen, input, len);
+   gz_crc(input, len);
+   int end = gz.histlen + len;
+   for (int pos = gz.histlen; pos < end; ) {
+      int best_len = 0, best_dist = 0;
+      if (end - pos >= GZ_MIN_MATCH) { // look for the longest earlier match
+         int max_len = MIN(end - pos, GZ_MAX_MATCH);
+         uint16_t position = gz.base + pos, candidate = gz.head[gz_hash(gz.data + pos)];
+         for (int chain = 0; chain < GZ_MAX_CHAIN; ++chain) {
+            int dist = (uint16_t) (position - candidate);
+            if (dist == 0 || dist > GZ_WINDOW || dist > pos) break; // (stale entries end up here)
+            const byte *str = gz.data + pos;
+            int match_len = 0;
+            while (match_len < max_len && str[match_len] == str[match_len - dist]) ++match_len;
+            if (match_len > best_len) {
+               best_len = match_len;
+               best_dist = dist;
+               if (match_len == max_len) break; }
+            uint16_t next = gz.prev[candidate & (GZ_WINDOW - 1)];
+            if ((uint16_t) (position - next) <= dist) break; // the chain doesn't go further back
+            candidate = next; } }
+      if (best_len >= GZ_MIN_MATCH) {
+         gz_match(best_len, best_dist);
+         for (int last = pos + best_len; pos < last; ++pos)
+            if (end - pos >= GZ_MIN_MATCH) gz_insert(pos); }
+      else {
+         gz_symbol(gz.data[pos]);
+         if (end - pos >= GZ_MIN_MATCH) gz_insert(pos);
+         ++pos; } }
+   if (end > GZ_WINDOW) { // keep only the window for the next piece
+      memmove(gz.data, gz.data + end - GZ_WINDOW, GZ_WINDOW);
+      gz.base += end - GZ_WINDOW;
+      gz.histlen = GZ_WINDOW; }
+   else gz.histlen = end; }
+
+esp_err_t gz_compress(const char *input, int len) {
+   for (int piece; len > 0 && gz.err == ESP_OK; input += piece, len -= piece) {
+      piece = MIN(len, GZ_INSIZE);
+      gz_compress_piece((const byte *) input, piece); }
+   return gz.err; }
+
+esp_err_t gz_finish(void) {
+   gz_symbol(256);  // end of the block
+   gz_bits(1, 1);   // then an empty final block, because we didn't know which was last
+   gz_bits(1, 2);
+   gz_symbol(256);
+   if (gz.bitcount) gz_bits(0, 8 - gz.bitcount); // (flush the last partial byte)
+   uint32_t crc = ~gz.crc, size = gz.base + gz.histlen;
+   for (int ndx = 0; ndx < 4; ++ndx) gz_byte(crc >> (8 * ndx));
+   for (int ndx = 0; ndx < 4; ++ndx) gz_byte(size >> (8 * ndx));
+   gz_send();
+   return gz.err; }
+
+//*********** buffered response writer  ********
+
+/* Pages are built from many small pieces, and sending each one as its own HTTP
+   chunk costs a chunk header and a TCP send, which is slow on a weak link. So
+   the pieces are collected here and sent in chunks of up to RESP_BUFSIZE, gzip
+   compressed if the browser takes that. The server handles one request at a
+   time, so one buffer serves them all. After a send fails, the rest of the
+   response is discarded. */
+
+#define RESP_BUFSIZE 4096
+
+struct {
+   esp_err_t err;  // the first send error
+   bool gzip;      // whether we're compressing
+   int len;        // how much is buffered
+   char buf[RESP_BUFSIZE]; } resp_writer;
+
+void resp_begin(httpd_req_t *req, bool compress) { // start a chunked response
+   char encodings[100] = "";
+   httpd_req_get_hdr_value_str(req, "Accept-Encoding", encodings, sizeof(encodings)); // (truncated is ok)
+   resp_writer.err = ESP_OK;
+   resp_writer.gzip = compress && strstr(encodings, "gzip") != NULL;
+   resp_writer.len = 0;
+   if (resp_writer.gzip) {
+      httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+      httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+      gz_begin(req); } }
+
+void resp_flush(httpd_req_t *req) {
+   if (resp_writer.len > 0 && resp_writer.err == ESP_OK)
+      resp_writer.err = resp_writer.gzip ? gz_compress(resp_writer.buf, resp_writer.len)
+                        : httpd_resp_send_chunk(req, resp_writer.buf, resp_writer.len);
+   resp_writer.len = 0; }
+
+void resp_write_bytes(httpd_req_t *req, const char *data, int len) {
+   while (len > 0 && resp_writer.err == ESP_OK) {
+      int room = MIN(len, RESP_BUFSIZE - resp_writer.len);
+      memcpy(resp_writer.buf + resp_writer.len, data, room);
+      resp_writer.len += room;
+      data += room; len -= room;
+      if (resp_writer.len >= RESP_BUFSIZE) resp_flush(req); } }
+
+void resp_write(httpd_req_t *req, const char *str) {
+   resp_write_bytes(req, str, strlen(str)); }
+
+void resp_vprintf(httpd_req_t *req, const char *format, va_list args) { // format right into the buffer
+   for (int tries = 0; tries < 2 && resp_writer.err == ESP_OK; ++tries) {
+      va_list argcopy;
+      va_copy(argcopy, args);
+      int room = RESP_BUFSIZE - resp_writer.len;
+      int len = vsnprintf(resp_writer.buf + resp_writer.len, room, format, argcopy);
+      va_end(argcopy);
+      if (len < room || resp_writer.len == 0) { // it fit, or never will and is truncated
+         resp_writer.len += MIN(len, room - 1);
+         break; }
+      resp_flush(req); } } // no room: send what we have, and try again
+
+void resp_printf(httpd_req_t *req, const char *format, ...) {
+   va_list args;
+   va_start(args, format);
+   resp_vprintf(req, format, args);
+   va_end(args); }
+
+esp_err_t resp_end(httpd_req_t *req) { // finish the response
+   resp_flush(req);
+   if (resp_writer.gzip && resp_writer.err == ESP_OK) resp_writer.err = gz_finish();
+   if (resp_writer.err == ESP_OK) resp_writer.err = httpd_resp_send_chunk(req, NULL, 0);
+   return resp_writer.err; }
+
+//*********** conditional requests  ********
+
+/* Pages that only change when something is added get an ETag made from the
+   number of the next entry, so a browser that already has the latest version
+   is answered "304 Not Modified" before we read FLASH or format anything. The
+   numbering restarts at startup, so the tag also has a random number chosen
+   then. "?after=n" gets just the entries after number n, as plain text lines
+   that each start with the entry's number. */
+
+uint32_t etag_boot = 0;
+
+void make_etag(char *etag, int size, char kind, uint32_t version) {
+   if (etag_boot == 0) etag_boot = esp_random() | 1;
+   snprintf(etag, size, "W/\"%08lx-%c%lu\"", (unsigned long) etag_boot, kind, (unsigned long) version); }
+
+bool not_modified(httpd_req_t *req, const char *etag) { // if so, we answer 304 Not Modified
+   // (the etag is in the header until the response is sent, so the caller keeps it)
+   char client_etags[100] = "";
+   httpd_resp_set_hdr(req, "ETag", etag);
+   httpd_resp_set_hdr(req, "Cache-Control", "no-cache"); // (which means "check with us first")
+   httpd_req_get_hdr_value_str(req, "If-None-Match", client_etags, sizeof(client_etags));
+   if (strstr(client_etags, etag) == NULL) return false;
+   httpd_resp_set_status(req, "304 Not Modified");
+   httpd_resp_set_hdr(req, "Connection", "close");
+   httpd_resp_send(req, NULL, 0);
+   return true; }
+
+bool get_after(httpd_req_t *req, uint32_t *after) { // is there an "?after=n"?
+   char query[30], value[12];
+   if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK
+         || httpd_query_key_value(query, "after", value, sizeof(value)) != ESP_OK)
+      return false;
+   *after = strtoul(value, NULL, 10);
+   return true; }
+
+void text_GET_printer(void * parm, const char *line) {
+   resp_printf((httpd_req_t *)parm, "%s\n", line); }
+
+void send_entries_after(httpd_req_t *req, uint32_t after,
+                        void (*dump)(void *parm, void (*print)(void * parm, const char *line), uint32_t after)) {
+   httpd_resp_set_type(req, "text/plain");
+   httpd_resp_set_hdr(req, "Connection", "close");
+   resp_begin(req, true);
+   dump(req, &text_GET_printer, after);
+   resp_end(req); }
+
 //*********** common routines for responses  ********
 
 #define BUT_H_SPACING_PX 60  // button separation in pixels
@@ -210,6 +671,10 @@ const char *response_headers[] = { // an array of pointers to remaining headers
    "<a href='/log'><button>log</button></a>&emsp;\r\n",
    "<a href='/temps'><button>temperature history</button></a>&emsp;\r\n",
    "<a href='/visitors'><button>visitors</button></a>&emsp;\r\n",
+   "<a href='/debuglog'><button>debug log</button></a>&emsp;\r\n",
+   "<a href='/wifitest'><button>WiFi test</button></a>&emsp;\r\n",
+   "<a href='/config'><button>configuration</button></a>&emsp;\r\n",
+   "<a href='/login'><button>log in</button></a>&emsp;\r\n",
    0 };
 
 //<input type="button" onclick="window.location.href='https://www.w3docs.com';" value="w3docs" />
@@ -218,17 +683,24 @@ const char *response_headers[] = { // an array of pointers to remaining headers
 
 void send_standard_headers(httpd_req_t *req, bool homepage) {
    httpd_resp_set_hdr(req, "Connection", "close");
-   httpd_resp_send_chunk(req, RESPONSE_PROLOG, HTTPD_RESP_USE_STRLEN);
+   resp_begin(req, true);
+   resp_write(req, RESPONSE_PROLOG);
    if (homepage) // add HTML code to auto-refresh the home page
-      httpd_resp_send_chunk(req, RESPONSE_REFRESH_HEADER, HTTPD_RESP_USE_STRLEN);
+      resp_write(req, RESPONSE_REFRESH_HEADER);
    for (const char **ptr = response_headers; *ptr; ++ptr)
-      httpd_resp_send_chunk(req, *ptr, HTTPD_RESP_USE_STRLEN);
+      resp_write(req, *ptr);
    if (!homepage) // add the "home" navigation button
-      httpd_resp_send_chunk(req, RESPONSE_HOMEBUTTON, HTTPD_RESP_USE_STRLEN); }
+      resp_write(req, RESPONSE_HOMEBUTTON); }
 
 void send_standard_close(httpd_req_t *req) {
-   httpd_resp_send_chunk(req, " </body></html>\n", HTTPD_RESP_USE_STRLEN);
-   httpd_resp_send_chunk(req, NULL, 0); }
+   resp_write(req, " </body></html>\n");
+   resp_end(req); }
+
+void redirect(httpd_req_t *req, const char *location) {
+   httpd_resp_set_status(req, "303 See Other");
+   httpd_resp_set_hdr(req, "Location", location);
+   httpd_resp_set_hdr(req, "Connection", "close");
+   httpd_resp_send(req, NULL, 0); }
 
 void expand_arrows_and_blanks(httpd_req_t *req, int row) {
    // expand our arrow symbols into HTML arrows, blanks into &nbsp, then send to client
@@ -251,67 +723,76 @@ void expand_arrows_and_blanks(httpd_req_t *req, int row) {
          dst += sprintf(dst, "<u>%c</u>", *src); } // underline where blinking cursor is
       else *dst++ = *src; }
    strcpy(dst, "<br>\n");
-   httpd_resp_send_chunk(req, outmsg, HTTPD_RESP_USE_STRLEN); }
+   resp_write(req, outmsg); }
 
 void show_lcd_screen(httpd_req_t *req) {
-   httpd_resp_send_chunk(req, "<p class=\"lcd\">\r\n", HTTPD_RESP_USE_STRLEN); // start LCD  box
+   resp_write(req, "<p class=\"lcd\">\r\n"); // start LCD  box
    for (int row = 0; row < 4; ++row)  // show contents of the LCD display
       expand_arrows_and_blanks(req, row);
-   httpd_resp_send_chunk(req, "</p>\n", HTTPD_RESP_USE_STRLEN); }
+   resp_write(req, "</p>\n"); }
 
 void show_buttons(httpd_req_t *req) {
-#define BUTLINESIZE 300
    //we use the root (instead of /pushbutton) for the POST so that it will be the home page that is refreshed automatically
-   httpd_resp_send_chunk(req, "<br><form action=\"/\" method=\"post\">\n", HTTPD_RESP_USE_STRLEN);
-   {
-      char line[BUTLINESIZE];
-      //display the temperature control rotary, with curved arrow button on either side to cause it to rotate
-      httpd_resp_send_chunk(req, "<div style=\"height:60px;display:flex;align-items:center\"><button class=\"arrowbutton\" type=\"submit\" name=\"temp\" value=\"up\">&cudarrl;</button>", HTTPD_RESP_USE_STRLEN);
-      //don't add \r\n to avoid whitespace between arrows and the button symbol
-      snprintf(line, sizeof(line), "<button style=\"height:35px;width:35px;margin:0px;"
+   resp_write(req, "<br><form action=\"/\" method=\"post\">\n");
+   //display the temperature control rotary, with curved arrow button on either side to cause it to rotate
+   resp_write(req, "<div style=\"height:60px;display:flex;align-items:center\"><button class=\"arrowbutton\" type=\"submit\" name=\"temp\" value=\"up\">&cudarrl;</button>");
+   //don't add \r\n to avoid whitespace between arrows and the button symbol
+   resp_printf(req, "<button style=\"height:35px;width:35px;margin:0px;"
                //"position:relative; top:50%%; transform:translateY(-50%%);" // center vertically
                "border:4px solid gray; border-radius:50%%; background-color:%s\"></button>",
                heater_mode == HEATING_NONE ? "LightGray" : heater_on ? "Red" : "LightBlue");
-      httpd_resp_send_chunk(req, line, HTTPD_RESP_USE_STRLEN);
-      httpd_resp_send_chunk(req, "<button class=\"arrowbutton\" type=\"submit\" name=\"temp\" value=\"down\">&larrpl;</button></div>&nbsp;&nbsp;temperature<br>\r\n", HTTPD_RESP_USE_STRLEN);
+   resp_write(req, "<button class=\"arrowbutton\" type=\"submit\" name=\"temp\" value=\"down\">&larrpl;</button></div>&nbsp;&nbsp;temperature<br>\r\n");
 
-      // start a table with the button in row 1
-      httpd_resp_send_chunk(req, "<br><br><table><tbody><tr>\r\n", HTTPD_RESP_USE_STRLEN);
-      for (int but = 0; but < NUM_BUTTONS; ++but) { // draw the buttons
-         snprintf(line, sizeof(line), "<td class=\"tablecell\"><button class=\"button\"%s type=\"submit\" name=\"button\" value=\"%d\"> </button></td>\r\n",
+   // start a table with the button in row 1
+   resp_write(req, "<br><br><table><tbody><tr>\r\n");
+   for (int but = 0; but < NUM_BUTTONS; ++but) // draw the buttons
+      resp_printf(req, "<td class=\"tablecell\"><button class=\"button\"%s type=\"submit\" name=\"button\" value=\"%d\"> </button></td>\r\n",
                   leds_on & led_masks[but] ? " style=\"border-color:LimeGreen\"" : "", // add green ring color if the light is on
                   but); // the button number
-         httpd_resp_send_chunk(req, line, HTTPD_RESP_USE_STRLEN); }
-      httpd_resp_send_chunk(req, "</tr>\r\n", HTTPD_RESP_USE_STRLEN); }
-   {
-      // draw the labels in rows 2, 3, and 4
-      char row[BUTLINESIZE];
-      static const char *button_labels[NUM_BUTTONS][3] = {
-         "heat", "spa", "<b>&larr;</b>",
-         "heat", "pool", "<b>&rarr;</b>",
-         "spa", "jets", "<b>&darr;</b>",
-         "pool", "light", "<b>&uarr;</b>",
-         "filter", "spa", " ",
-         "filter", "pool", " ",
-         "spa", "level", " ",
-         "program", " ", " " };
-      for (int rownum = 0; rownum < 3; ++rownum) {
-         int rowchars;
-         rowchars = snprintf(row, sizeof(row), "<tr>");
-         for (int but = 0; but < NUM_BUTTONS; ++but) {
-            rowchars += snprintf(row + rowchars, sizeof(row) - rowchars,
-                                 "<td class=\"tablecell\">%s</td>",
-                                 button_labels[but][rownum]); }
-         snprintf(row + rowchars, sizeof(row) - rowchars, "</tr>\r\n");
-         httpd_resp_send_chunk(req, row, HTTPD_RESP_USE_STRLEN); }
-      httpd_resp_send_chunk(req, "</table></form></div>\r\n", HTTPD_RESP_USE_STRLEN); } }
+   resp_write(req, "</tr>\r\n");
+
+   // draw the labels in rows 2, 3, and 4
+   static const char *button_labels[NUM_BUTTONS][3] = {
+      "heat", "spa", "<b>&larr;</b>",
+      "heat", "pool", "<b>&rarr;</b>",
+      "spa", "jets", "<b>&darr;</b>",
+      "pool", "light", "<b>&uarr;</b>",
+      "filter", "spa", " ",
+      "filter", "pool", " ",
+      "spa", "level", " ",
+      "program", " ", " " };
+   for (int rownum = 0; rownum < 3; ++rownum) {
+      resp_write(req, "<tr>");
+      for (int but = 0; but < NUM_BUTTONS; ++but)
+         resp_printf(req, "<td class=\"tablecell\">%s</td>", button_labels[but][rownum]);
+      resp_write(req, "</tr>\r\n"); }
+   resp_write(req, "</table></form></div>\r\n"); }
 
 
 //******************** / (root)  **********************************
 
 // handler for root URI
+uint32_t root_state_hash(void) { // of everything the home page shows, for its ETag
+   uint32_t hash = 2166136261u; // FNV-1a
+   byte state[sizeof(lcdbuf) + 8];
+   memcpy(state, lcdbuf, sizeof(lcdbuf));
+   state[sizeof(lcdbuf)] = leds_on;
+   state[sizeof(lcdbuf) + 1] = leds_on >> 8;
+   state[sizeof(lcdbuf) + 2] = heater_mode;
+   state[sizeof(lcdbuf) + 3] = heater_on;
+   state[sizeof(lcdbuf) + 4] = lcd_cursorblinking;
+   state[sizeof(lcdbuf) + 5] = lcdrow;
+   state[sizeof(lcdbuf) + 6] = lcdcol;
+   state[sizeof(lcdbuf) + 7] = 0;
+   for (int ndx = 0; ndx < sizeof(state); ++ndx)
+      hash = (hash ^ state[ndx]) * 16777619u;
+   return hash; }
+
 esp_err_t root_GET_handler(httpd_req_t *req) {
-   report_ip_address(req, "");
+   if (!report_ip_address(req, "")) return ESP_OK;
+   char etag[30];
+   make_etag(etag, sizeof(etag), 'S', root_state_hash());
+   if (not_modified(req, etag)) return ESP_OK;
    send_standard_headers(req, true);
    show_lcd_screen(req);
    show_buttons(req);
@@ -327,12 +808,17 @@ static const httpd_uri_t root = {
 //********************  /log  **********************************
 
 void log_GET_printer(void * parm, const char *line) {
-   char buf[210];
-   snprintf(buf, sizeof(buf), "%s<br>\n", line);
-   httpd_resp_send_chunk((httpd_req_t *)parm, buf, HTTPD_RESP_USE_STRLEN); }
+   resp_printf((httpd_req_t *)parm, "%s<br>\n", line); }
 
 esp_err_t log_GET_handler(httpd_req_t *req) {
-   report_ip_address(req, "");
+   if (!report_ip_address(req, "")) return ESP_OK;
+   char etag[30];
+   uint32_t after;
+   make_etag(etag, sizeof(etag), 'L', log_nextseq);
+   if (not_modified(req, etag)) return ESP_OK;
+   if (get_after(req, &after)) {
+      send_entries_after(req, after, &log_dump_after);
+      return ESP_OK; }
    send_standard_headers(req, false);
    log_dump(req, &log_GET_printer);
    send_standard_close(req);
@@ -343,18 +829,32 @@ static const httpd_uri_t log_uri = {
    .method    = HTTP_GET,
    .handler   = log_GET_handler };
 
+//********************  /debuglog  **********************************
+
+esp_err_t debuglog_GET_handler(httpd_req_t *req) {
+   if (!report_ip_address(req, "")) return ESP_OK;
+   send_standard_headers(req, false);
+   dtrace_dump(req, &log_GET_printer);
+   send_standard_close(req);
+   return ESP_OK; }
+
+static const httpd_uri_t debuglog_uri = {
+   .uri       = "/debuglog",
+   .method    = HTTP_GET,
+   .handler   = debuglog_GET_handler };
+
 //********************  /visitors  **********************************
 
 void visitors_GET_printer(void * parm, const char *line, ...) {
-   char buf[250];
    va_list arg_ptr;
    va_start(arg_ptr, line);
-   vsnprintf(buf, sizeof(buf), line, arg_ptr);
-   httpd_resp_send_chunk((httpd_req_t *)parm, buf, HTTPD_RESP_USE_STRLEN); }
+   resp_vprintf((httpd_req_t *)parm, line, arg_ptr);
+   va_end(arg_ptr); }
 
 esp_err_t visitors_GET_handler(httpd_req_t *req) {
-   report_ip_address(req, "");
+   if (!report_ip_address(req, "")) return ESP_OK;
    send_standard_headers(req, false);
+   wifi_stats_dump(req, &visitors_GET_printer);
    visitors_dump(req, &visitors_GET_printer);
    send_standard_close(req);
    return ESP_OK; }
@@ -367,12 +867,17 @@ static const httpd_uri_t visitors_uri = {
 //********************  /temp  **********************************
 
 void temp_GET_printer(void * parm, const char *line) {
-   char buf[100];
-   snprintf(buf, sizeof(buf), "%s<br>\n", line);
-   httpd_resp_send_chunk((httpd_req_t *)parm, buf, HTTPD_RESP_USE_STRLEN); }
+   resp_printf((httpd_req_t *)parm, "%s<br>\n", line); }
 
 esp_err_t temps_GET_handler(httpd_req_t *req) {
-   report_ip_address(req, "");
+   if (!report_ip_address(req, "")) return ESP_OK;
+   char etag[30];
+   uint32_t after;
+   make_etag(etag, sizeof(etag), 'T', temphist_nextseq);
+   if (not_modified(req, etag)) return ESP_OK;
+   if (get_after(req, &after)) {
+      send_entries_after(req, after, &temphistory_dump_after);
+      return ESP_OK; }
    send_standard_headers(req, false);
    temphistory_dump(req, &temp_GET_printer);
    send_standard_close(req);
@@ -383,6 +888,51 @@ static const httpd_uri_t gettemps = {
    .method    = HTTP_GET,
    .handler   = temps_GET_handler };
 
+//********************  /export.bin  **********************************
+
+// everything, in binary, for tools/poolspa_export.c to decode and analyze
+
+void export_GET_writer(void * parm, const void *data, int len) {
+   resp_write_bytes((httpd_req_t *)parm, (const char *) data, len); }
+
+esp_err_t export_GET_handler(httpd_req_t *req) {
+   if (!report_ip_address(req, "")) return ESP_OK;
+   httpd_resp_set_type(req, "application/octet-stream");
+   httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"poolspa_export.bin\"");
+   httpd_resp_set_hdr(req, "Connection", "close");
+   resp_begin(req, true);
+   export_dump(req, &export_GET_writer);
+   return resp_end(req); }
+
+static const httpd_uri_t export_uri = {
+   .uri       = "/export.bin",
+   .method    = HTTP_GET,
+   .handler   = export_GET_handler };
+
+//********************  /archive  **********************************
+
+// the long-term archive as CSV text: "?res=5min", "hour", or "day", and "&days=n"
+
+esp_err_t archive_GET_handler(httpd_req_t *req) {
+   if (!report_ip_address(req, "")) return ESP_OK;
+   char query[40], res[8] = "hour", value[8];
+   int days = 7;
+   if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+      httpd_query_key_value(query, "res", res, sizeof(res));
+      if (httpd_query_key_value(query, "days", value, sizeof(value)) == ESP_OK)
+         days = MIN(MAX(atoi(value), 1), 10 * 366); }
+   httpd_resp_set_type(req, "text/plain");
+   httpd_resp_set_hdr(req, "Connection", "close");
+   resp_begin(req, true);
+   if (!archive_dump(res, days, req, &text_GET_printer))
+      resp_printf(req, "no \"%s\" archive; use res=5min, hour, or day\n", res);
+   return resp_end(req); }
+
+static const httpd_uri_t archive_uri = {
+   .uri       = "/archive",
+   .method    = HTTP_GET,
+   .handler   = archive_GET_handler };
+
 //********************  /favicon **********************************
 
 esp_err_t favicon_GET_handler(httpd_req_t *req) {
@@ -390,7 +940,7 @@ esp_err_t favicon_GET_handler(httpd_req_t *req) {
    httpd_resp_set_hdr(req, "Content-Type", "image/jpg");
    extern char iconimagejpg[]; // binary jpg encoding of the image
    extern int iconimagesize;   // its length
-   report_ip_address(req, "");
+   if (!report_ip_address(req, "")) return ESP_OK;
    httpd_resp_send(req, iconimagejpg, iconimagesize);
    return ESP_OK; }
 
@@ -409,7 +959,10 @@ static esp_err_t button_POST_handler(httpd_req_t *req) {
    // for some reason, req->content_len is zero even though there is data!
    datalen = httpd_req_recv(req, postdata, sizeof(postdata) - 1); // read bytes anyway
    postdata[datalen] = 0; // make it a C string
-   report_ip_address(req, postdata);
+   if (!report_ip_address(req, postdata)) return ESP_OK;
+   if (!session_valid(req, current_client)) { // only logged-in users can push buttons
+      redirect(req, "/login");
+      return ESP_OK; }
    int button;
    if (sscanf(postdata, "button=%d", &button) == 1
          && button >= 0 && button <= 7) {
@@ -434,22 +987,362 @@ static const httpd_uri_t send_button_push = {
    .handler   = button_POST_handler,
    .user_ctx  = NULL };
 
+//********************  /wifitest  **********************************
+
+/* The WiFi self-test page runs a script in the browser that times a series of
+   tiny requests for the latency, and one large one for the throughput, because
+   that's what using the pages is like. The same page shows the current radio
+   settings and a history of the signal strength. */
+
+struct linkhist_t { // history of the WiFi link quality
+   struct datetime timestamp;
+   int8_t rssi; } // 0 if we weren't connected
+linkhist[LINKHIST_ENTRIES];
+int linkhist_next = 0, linkhist_count = 0;
+unsigned long linkhist_time = 0;
+
+void linkhist_add(void) { // called periodically from the webserver's idle loop
+   if (millis() - linkhist_time >= LINKHIST_DELTA_MINS * 60000UL) {
+      linkhist_time = millis();
+      linkhist[linkhist_next].timestamp = now;
+      linkhist[linkhist_next].rssi = wifi_get_rssi(); // (0 if not connected)
+      if (linkhist_count < LINKHIST_ENTRIES) ++linkhist_count;
+      if (++linkhist_next >= LINKHIST_ENTRIES) linkhist_next = 0; } }
+
+static const char wifitest_script[] =
+   "<p id='result'>testing...</p>\r\n"
+   "<script>\r\n"
+   "async function wifitest() {\r\n"
+   " let times = [];\r\n"
+   " for (let i = 0; i < 20; ++i) {\r\n"
+   "  let start = performance.now();\r\n"
+   "  await fetch('/wifitest?ping=' + i, {cache: 'no-store'});\r\n"
+   "  times.push(performance.now() - start); }\r\n"
+   " times.sort((a, b) => a - b);\r\n"
+   " let avg = times.reduce((a, b) => a + b) / times.length;\r\n"
+   " let start = performance.now();\r\n"
+   " let data = await (await fetch('/wifitest?bytes=65536', {cache: 'no-store'})).arrayBuffer();\r\n"
+   " let secs = (performance.now() - start) / 1000;\r\n"
+   " document.getElementById('result').innerHTML = 'latency: min ' + times[0].toFixed(0)\r\n"
+   "  + ' msec, median ' + times[10].toFixed(0) + ' msec, max ' + times[19].toFixed(0)\r\n"
+   "  + ' msec, average ' + avg.toFixed(0) + ' msec<br>throughput: '\r\n"
+   "  + (data.byteLength * 8 / secs / 1000).toFixed(0) + ' kbit/sec'; }\r\n"
+   "wifitest();\r\n"
+   "</script>\r\n";
+
+esp_err_t wifitest_GET_handler(httpd_req_t *req) {
+   char query[40], value[12];
+   if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+      // (these don't count as visits, and pings aren't rate-limited)
+      struct client_t *client = remember_ip_address(req, get_remote_ip(req));
+      if (httpd_query_key_value(query, "ping", value, sizeof(value)) == ESP_OK) {
+         if (!admit_request(req, client, 0)) return ESP_OK;
+         httpd_resp_set_type(req, "text/plain");
+         httpd_resp_send(req, "ok", HTTPD_RESP_USE_STRLEN);
+         return ESP_OK; }
+      if (httpd_query_key_value(query, "bytes", value, sizeof(value)) == ESP_OK) {
+         if (!admit_request(req, client, RATE_BURST / 2)) return ESP_OK;
+         static const char filler[1024] = {0 };
+         long bytes = MIN(MAX(atol(value), 0), WIFITEST_MAX_BYTES);
+         httpd_resp_set_type(req, "application/octet-stream");
+         resp_begin(req, false); // (zeroes would compress too well to measure anything)
+         for (; bytes > 0; bytes -= sizeof(filler))
+            resp_write_bytes(req, filler, MIN(bytes, (long) sizeof(filler)));
+         return resp_end(req); } }
+   if (!report_ip_address(req, "")) return ESP_OK;
+   send_standard_headers(req, false);
+   wifi_ps_type_t ps = WIFI_PS_NONE;
+   int8_t tx_power = 0;
+   wifi_config_t config;
+   esp_wifi_get_ps(&ps);
+   esp_wifi_get_max_tx_power(&tx_power);
+   esp_wifi_get_config(WIFI_IF_STA, &config);
+   visitors_GET_printer(req, "RSSI %d dBm, power save %s, transmit power %d.%02d dBm, listen interval %d<br>\r\n",
+                        wifi_get_rssi(), ps == WIFI_PS_NONE ? "none" : ps == WIFI_PS_MIN_MODEM ? "minimum" : "maximum",
+                        tx_power / 4, (tx_power % 4) * 25, config.sta.listen_interval);
+   resp_write(req, wifitest_script);
+   wifi_stats_dump(req, &visitors_GET_printer);
+   if (linkhist_count == 0) visitors_GET_printer(req, "no WiFi link history yet<br>\r\n");
+   int ndx = linkhist_next - linkhist_count;
+   if (ndx < 0) ndx += LINKHIST_ENTRIES;
+   for (int cnt = 0; cnt < linkhist_count; ++cnt) {
+      char datestr[30];
+      if (linkhist[ndx].rssi) visitors_GET_printer(req, "%s: RSSI %d<br>\r\n", format_datetime(&linkhist[ndx].timestamp, datestr), linkhist[ndx].rssi);
+      else visitors_GET_printer(req, "%s: not connected<br>\r\n", format_datetime(&linkhist[ndx].timestamp, datestr));
+      if (++ndx >= LINKHIST_ENTRIES) ndx = 0; }
+   send_standard_close(req);
+   return ESP_OK; }
+
+static const httpd_uri_t wifitest_uri = {
+   .uri       = "/wifitest",
+   .method    = HTTP_GET,
+   .handler   = wifitest_GET_handler };
+
+//********************  /login and /logout  **********************************
+
+static const char login_form[] =
+   "<form method='post' action='/login'>password: <input type='password' name='password' autofocus>\r\n"
+   "<input type='submit' value='log in'></form>\r\n";
+
+void url_decode(char *str) { // decode form data in place
+   char *out = str;
+   for (; *str; ++str, ++out) {
+      int hi, lo;
+      if (*str == '+') *out = ' ';
+      else if (*str == '%' && (hi = hex_digit(str[1])) >= 0 && (lo = hex_digit(str[2])) >= 0) {
+         *out = (hi << 4) | lo;
+         str += 2; }
+      else *out = *str; }
+   *out = 0; }
+
+esp_err_t login_GET_handler(httpd_req_t *req) {
+   if (!report_ip_address(req, "")) return ESP_OK;
+   send_standard_headers(req, false);
+   resp_write(req, session_valid(req, current_client)
+                         ? "You are logged in. <a href='/logout'><button>log out</button></a>\r\n" : login_form);
+   send_standard_close(req);
+   return ESP_OK; }
+
+esp_err_t login_POST_handler(httpd_req_t *req) {
+   char postdata[100], password[64], expected[64];
+   int datalen = httpd_req_recv(req, postdata, sizeof(postdata) - 1);
+   if (datalen < 0) { // the client went away or was too slow
+      dprint("login POST receive error %d\n", datalen);
+      if (datalen == HTTPD_SOCK_ERR_TIMEOUT) httpd_resp_send_408(req);
+      else httpd_resp_send_500(req);
+      return ESP_OK; }
+   postdata[datalen] = 0;
+   if (!report_ip_address(req, "(password)")) return ESP_OK;
+   memset(password, 0, sizeof(password)); // (so the comparison covers the same bytes every time)
+   memset(expected, 0, sizeof(expected));
+   if (strncmp(postdata, "password=", 9) == 0) {
+      url_decode(postdata + 9);
+      strncpy(password, postdata + 9, sizeof(password) - 1); }
+   strncpy(expected, WEB_PASSWORD, sizeof(expected) - 1);
+   if (password[0] && equal_constant_time((byte *) password, (byte *) expected, sizeof(password))) {
+      char cookie[120];
+      session_cookie(current_client, cookie, sizeof(cookie));
+      current_client->gave_password = true;
+      dprint("login from IP %08X\n", current_client->ip_address);
+      httpd_resp_set_hdr(req, "Set-Cookie", cookie);
+      redirect(req, "/");
+      return ESP_OK; }
+   dprint("bad password from IP %08X\n", current_client->ip_address);
+   send_standard_headers(req, false);
+   resp_write(req, "wrong password<br>\r\n");
+   resp_write(req, login_form);
+   send_standard_close(req);
+   return ESP_OK; }
+
+esp_err_t logout_GET_handler(httpd_req_t *req) {
+   if (!report_ip_address(req, "")) return ESP_OK;
+   current_client->session_expiry = 0;
+   httpd_resp_set_hdr(req, "Set-Cookie", "session=; Max-Age=0; Path=/");
+   redirect(req, "/");
+   return ESP_OK; }
+
+static const httpd_uri_t login_get_uri = {
+   .uri       = "/login",
+   .method    = HTTP_GET,
+   .handler   = login_GET_handler };
+
+static const httpd_uri_t login_post_uri = {
+   .uri       = "/login",
+   .method    = HTTP_POST,
+   .handler   = login_POST_handler };
+
+static const httpd_uri_t logout_uri = {
+   .uri       = "/logout",
+   .method    = HTTP_GET,
+   .handler   = logout_GET_handler };
+
+//********************  /config  **********************************
+
+/* The configuration that the LCD menu changes, as a form or as JSON. A POST
+   checks every field against the same limits the LCD uses before changing
+   any of them, then hands the whole new configuration to the controller task.
+   It writes it to FLASH and applies it without leaving the current mode,
+   unless the change makes that mode unsafe. */
+
+#define CONFIG_WAIT_MSECS 2000  // how long we wait for the controller to take a change
+
+bool wants_json(httpd_req_t *req) { // ?json, or an Accept header that asks for it
+   char buf[100];
+   if (httpd_req_get_url_query_str(req, buf, sizeof(buf)) == ESP_OK && strncmp(buf, "json", 4) == 0) return true;
+   buf[0] = 0;
+   httpd_req_get_hdr_value_str(req, "Accept", buf, sizeof(buf)); // (truncated is ok)
+   return strstr(buf, "application/json") != NULL; }
+
+void config_send_error(httpd_req_t *req, const char *status, const char *msg) {
+   httpd_resp_set_status(req, status);
+   httpd_resp_set_type(req, "text/plain");
+   httpd_resp_set_hdr(req, "Connection", "close");
+   httpd_resp_send(req, msg, HTTPD_RESP_USE_STRLEN); }
+
+void config_send_json(httpd_req_t *req, const struct config_t *config) {
+   char json[300];
+   int len = snprintf(json, sizeof(json), "{");
+   for (int ndx = 0; ndx < NUM_CONFIG_FIELDS; ++ndx)
+      len += snprintf(json + len, sizeof(json) - len, "%s\"%s\":%d", ndx ? "," : "",
+                      config_fields[ndx].name, ((const byte *)config)[config_fields[ndx].offset]);
+   snprintf(json + len, sizeof(json) - len, "}\n");
+   httpd_resp_set_type(req, "application/json");
+   httpd_resp_set_hdr(req, "Connection", "close");
+   httpd_resp_send(req, json, HTTPD_RESP_USE_STRLEN); }
+
+const char *config_parse_value(struct config_t *config, uint16_t *fields, const char *name, const char *value) {
+   long num;
+   if (strcmp(value, "true") == 0) num = 1;
+   else if (strcmp(value, "false") == 0) num = 0;
+   else {
+      char *end;
+      num = strtol(value, &end, 10);
+      if (end == value || *end) return "value isn't a number"; }
+   return config_set_field(config, fields, name, num); }
+
+const char *config_parse_form(struct config_t *config, uint16_t *fields, char *data) { // name=value&name=value...
+   for (char *field = strtok(data, "&"); field; field = strtok(NULL, "&")) {
+      char *value = strchr(field, '=');
+      if (!value) return "missing value";
+      *value++ = 0;
+      url_decode(value);
+      const char *error = config_parse_value(config, fields, field, value);
+      if (error) return error; }
+   return NULL; }
+
+const char *config_parse_json(struct config_t *config, uint16_t *fields, char *data) { // {"name": value, ...}, and no nesting
+   char *ptr = data;
+#define SKIP_BLANKS while (*ptr == ' ' || *ptr == '\t' || *ptr == '\r' || *ptr == '\n') ++ptr
+   SKIP_BLANKS;
+   if (*ptr++ != '{') return "JSON isn't an object";
+   SKIP_BLANKS;
+   if (*ptr == '}') return NULL;
+   while (true) {
+      if (*ptr++ != '"') return "JSON name isn't a string";
+      char *name = ptr;
+      if (!(ptr = strchr(ptr, '"'))) return "JSON name isn't terminated";
+      *ptr++ = 0;
+      SKIP_BLANKS;
+      if (*ptr++ != ':') return "JSON name has no value";
+      SKIP_BLANKS;
+      char *value = ptr;
+      while (*ptr && strchr(" \t\r\n,}", *ptr) == NULL) ++ptr;
+      char delim = *ptr;
+      *ptr = 0;
+      const char *error = config_parse_value(config, fields, name, value);
+      if (error) return error;
+      if (!delim) return "JSON object isn't terminated";
+      ++ptr;
+      if (delim != ',' && delim != '}') { // blanks after the value
+         SKIP_BLANKS;
+         delim = *ptr++; }
+      if (delim == '}') return NULL;
+      if (delim != ',') return "JSON object isn't terminated";
+      SKIP_BLANKS; }
+#undef SKIP_BLANKS
+}
+
+const char *config_handoff(const struct config_t *config, uint16_t fields) { // give a change to the controller, and wait for it
+   unsigned long start = millis();
+   while (config_webchanged) { // (another client's change is still waiting)
+      if (millis() - start > CONFIG_WAIT_MSECS) return "the controller is busy\n";
+      delay(50); }
+   config_webpending = *config;
+   config_webfields = fields;
+   config_webchanged = true;
+   while (config_webchanged) {
+      if (millis() - start > CONFIG_WAIT_MSECS) // (it will still take it when it can)
+         return "the controller is busy; the change is queued\n";
+      delay(50); }
+   return NULL; }
+
+esp_err_t config_GET_handler(httpd_req_t *req) {
+   if (!report_ip_address(req, "")) return ESP_OK;
+   struct config_t config = config_data;
+   if (wants_json(req)) {
+      config_send_json(req, &config);
+      return ESP_OK; }
+   send_standard_headers(req, false);
+   resp_write(req, "<form method='post' action='/config'><table>\r\n");
+   for (int ndx = 0; ndx < NUM_CONFIG_FIELDS; ++ndx) {
+      const struct config_field_t *field = &config_fields[ndx];
+      visitors_GET_printer(req, "<tr><td>%s</td><td><input type='number' name='%s' min='%d' max='%d' value='%d'></td><td>%d to %d</td></tr>\r\n",
+                           field->name, field->name, field->min, field->max, ((byte *)&config)[field->offset], field->min, field->max); }
+   resp_write(req, "</table><br><input type='submit' value='save'></form>\r\n");
+   send_standard_close(req);
+   return ESP_OK; }
+
+esp_err_t config_POST_handler(httpd_req_t *req) {
+   char postdata[400], content_type[40] = "";
+   int datalen = httpd_req_recv(req, postdata, sizeof(postdata) - 1);
+   if (datalen < 0) { // the client went away or was too slow
+      dprint("config POST receive error %d\n", datalen);
+      if (datalen == HTTPD_SOCK_ERR_TIMEOUT) httpd_resp_send_408(req);
+      else httpd_resp_send_500(req);
+      return ESP_OK; }
+   postdata[datalen] = 0;
+   if (!report_ip_address(req, postdata)) return ESP_OK;
+   httpd_req_get_hdr_value_str(req, "Content-Type", content_type, sizeof(content_type));
+   bool json = strstr(content_type, "json") != NULL;
+   if (!session_valid(req, current_client)) { // only logged-in users can change things
+      if (json) config_send_error(req, "401 Unauthorized", "log in first\n");
+      else redirect(req, "/login");
+      return ESP_OK; }
+   if (datalen >= (int) sizeof(postdata) - 1) {
+      config_send_error(req, "413 Payload Too Large", "too much data\n");
+      return ESP_OK; }
+   struct config_t config = config_data;
+   uint16_t fields = 0; // which ones are given; only those will change
+   const char *error = json ? config_parse_json(&config, &fields, postdata) : config_parse_form(&config, &fields, postdata);
+   if (error) { // nothing was changed
+      dprint("config POST error: %s\n", error);
+      config_send_error(req, "400 Bad Request", error);
+      return ESP_OK; }
+   if ((error = config_handoff(&config, fields))) {
+      config_send_error(req, "503 Service Unavailable", error);
+      return ESP_OK; }
+   config = config_data; // what it is now, with our change
+   if (json) config_send_json(req, &config);
+   else redirect(req, "/config");
+   return ESP_OK; }
+
+static const httpd_uri_t config_get_uri = {
+   .uri       = "/config",
+   .method    = HTTP_GET,
+   .handler   = config_GET_handler };
+
+static const httpd_uri_t config_post_uri = {
+   .uri       = "/config",
+   .method    = HTTP_POST,
+   .handler   = config_POST_handler };
+
 //****************** server startup ***************************
 
-static httpd_handle_t server = NULL;
 
 static httpd_handle_t start_webserver(void) {
    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
    config.lru_purge_enable = true;
+   config.max_open_sockets = WEB_MAX_SOCKETS;
+   config.max_uri_handlers = 16;
    config.server_port = WIFI_PORT;
    dprint("Starting server on port %d\n", config.server_port);
    ESP_CHECKERR(httpd_start(&server, &config));
    ESP_CHECKERR(httpd_register_uri_handler(server, &root));
    ESP_CHECKERR(httpd_register_uri_handler(server, &favicon));
    ESP_CHECKERR(httpd_register_uri_handler(server, &log_uri));
+   ESP_CHECKERR(httpd_register_uri_handler(server, &debuglog_uri));
    ESP_CHECKERR(httpd_register_uri_handler(server, &gettemps));
    ESP_CHECKERR(httpd_register_uri_handler(server, &visitors_uri));
    ESP_CHECKERR(httpd_register_uri_handler(server, &send_button_push));
+   ESP_CHECKERR(httpd_register_uri_handler(server, &wifitest_uri));
+   ESP_CHECKERR(httpd_register_uri_handler(server, &login_get_uri));
+   ESP_CHECKERR(httpd_register_uri_handler(server, &login_post_uri));
+   ESP_CHECKERR(httpd_register_uri_handler(server, &logout_uri));
+   ESP_CHECKERR(httpd_register_uri_handler(server, &config_get_uri));
+   ESP_CHECKERR(httpd_register_uri_handler(server, &config_post_uri));
+   ESP_CHECKERR(httpd_register_uri_handler(server, &export_uri));
+   ESP_CHECKERR(httpd_register_uri_handler(server, &archive_uri));
+   ESP_CHECKERR(httpd_register_err_handler(server, HTTPD_404_NOT_FOUND, &captive_portal_handler));
    return server; }
 
 static void stop_webserver(httpd_handle_t server) {
@@ -459,16 +1352,39 @@ static void stop_webserver(httpd_handle_t server) {
 
 //********** Wifi connection routines **********************
 
-/* FreeRTOS event group to signal when we are connected*/
-static EventGroupHandle_t s_wifi_event_group;
-
-/* The event group allows multiple bits for each event, but we only care about two events:
-   - we are connected to the AP with an IP
-   - we failed to connect after the maximum amount of retries */
-#define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT      BIT1
-
-static int s_retry_num = 0;
+/* We never give up on the WiFi connection. After a disconnect or a failed
+   attempt, we wait and try again, doubling the wait each time up to a limit.
+   The retries are made from the webserver task's idle loop, not from the
+   event handler. We remember the BSSID and channel of the access point we
+   were last connected to. Every other attempt goes directly to it, which
+   skips the scan and gets us back within seconds after the access point
+   reboots. The attempts in between do a full scan, in case it has moved. */
+
+enum {WIFI_IDLE, WIFI_CONNECTING, WIFI_CONNECTED, WIFI_WAITING } wifi_state = WIFI_IDLE;
+unsigned long wifi_retry_msecs = WIFI_RETRY_FIRST_MSECS; // the current backoff
+unsigned long wifi_state_time = 0;    // when we entered the current state
+unsigned long wifi_outage_start = 0;  // when we lost the connection
+int wifi_attempts = 0;                // attempts since we were last connected
+bool wifi_have_ap = false;            // do we know the AP's BSSID and channel?
+uint8_t wifi_ap_bssid[6], wifi_ap_channel;
+unsigned long wifi_down_since = 0;    // when we last didn't have a connection
+esp_netif_t *softap_netif = NULL;
+bool softap_active = false;           // is our own access point up?
+esp_ip4_addr_t softap_ip;             // its IP address
+int dns_socket = -1;                  // our captive-portal DNS responder
+volatile bool wifi_power_changed = false; // new power settings from the controller?
+volatile byte wifi_power_save, wifi_tx_dbm, wifi_listen_interval;
+wifi_config_t wifi_config = {
+   .sta = {
+      {.ssid = WIFI_SSID },
+      {.password = WIFI_PASSWORD },
+      /* Setting a password implies station will connect to all security modes including WEP/WPA.
+         However these modes are deprecated and not advisable to be used. Incase your Access point
+         doesn't support WPA2, these mode can be enabled by commenting below line */
+      //.threshold.authmode = WIFI_AUTH_WPA2_PSK,
+      .pmf_cfg = {
+         .capable = true,
+         .required = false }, }, };
 
 int wifi_get_rssi(void) {
    wifi_ap_record_t info;
@@ -476,30 +1392,181 @@ int wifi_get_rssi(void) {
       return info.rssi;
    else return 0; }
 
+void wifi_set_power(byte power_save, byte tx_dbm, byte listen_interval) {
+   // called by the controller with new settings, which we apply in our own task
+   wifi_power_save = power_save;
+   wifi_tx_dbm = tx_dbm;
+   wifi_listen_interval = listen_interval;
+   wifi_power_changed = true; }
+
+void wifi_apply_power(void) {
+   static const wifi_ps_type_t ps_types[3] = {WIFI_PS_NONE, WIFI_PS_MIN_MODEM, WIFI_PS_MAX_MODEM };
+   wifi_power_changed = false;
+   wifi_config.sta.listen_interval = wifi_listen_interval; // (takes effect at the next connection)
+   esp_wifi_set_ps(ps_types[wifi_power_save <= 2 ? wifi_power_save : 0]); // (fails while our AP is up)
+   esp_wifi_set_max_tx_power(wifi_tx_dbm * 4); // in units of 0.25 dBm
+   dprint("WiFi power save %d, transmit power %d dBm, listen interval %d\n",
+          wifi_power_save, wifi_tx_dbm, wifi_listen_interval); }
+
+void wifi_try_connect(void) { // start a connection attempt
+   bool fast = wifi_have_ap && (wifi_attempts & 1) == 0;
+   wifi_config.sta.bssid_set = fast;
+   wifi_config.sta.channel = fast ? wifi_ap_channel : 0;
+   if (fast) memcpy(wifi_config.sta.bssid, wifi_ap_bssid, sizeof(wifi_ap_bssid));
+   wifi_config.sta.scan_method = fast ? WIFI_FAST_SCAN : WIFI_ALL_CHANNEL_SCAN;
+   esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+   ++wifi_attempts;
+   wifi_state = WIFI_CONNECTING;
+   wifi_state_time = millis();
+   dprint("WiFi connect attempt %d%s\n", wifi_attempts, fast ? " to the last AP" : "");
+   esp_wifi_connect(); }
+
+void wifi_attempt_failed(void) { // wait a while before trying again
+   unsigned long max_msecs = softap_active ? WIFI_RETRY_SOFTAP_MSECS : WIFI_RETRY_MAX_MSECS;
+   ++wifi_connectfails;
+   ++connect_failures;
+   wifi_state = WIFI_WAITING;
+   wifi_state_time = millis();
+   if ((wifi_retry_msecs *= 2) > max_msecs) wifi_retry_msecs = max_msecs; }
+
+//********** soft access point and captive portal routines **********************
+
+void softap_start(void) { // start our own access point alongside the station
+   wifi_config_t ap_config;
+   esp_netif_ip_info_t ip_info;
+   memset(&ap_config, 0, sizeof(ap_config));
+   strncpy((char *)ap_config.ap.ssid, WIFI_AP_SSID, sizeof(ap_config.ap.ssid));
+   ap_config.ap.ssid_len = strlen(WIFI_AP_SSID);
+   strncpy((char *)ap_config.ap.password, WIFI_AP_PASSWORD, sizeof(ap_config.ap.password));
+   ap_config.ap.authmode = strlen(WIFI_AP_PASSWORD) >= 8 ? WIFI_AUTH_WPA2_PSK : WIFI_AUTH_OPEN;
+   ap_config.ap.max_connection = SOFTAP_MAX_CLIENTS;
+   ESP_CHECKERR(esp_wifi_set_mode(WIFI_MODE_APSTA));
+   ESP_CHECKERR(esp_wifi_set_config(WIFI_IF_AP, &ap_config));
+   ESP_CHECKERR(esp_netif_get_ip_info(softap_netif, &ip_info));
+   softap_ip = ip_info.ip;
+   snprintf(webserver_address, sizeof(webserver_address), IPSTR ":%d", IP2STR(&softap_ip), WIFI_PORT);
+   dns_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+   struct sockaddr_in addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(DNS_PORT);
+   addr.sin_addr.s_addr = htonl(INADDR_ANY);
+   if (dns_socket >= 0 && bind(dns_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      close(dns_socket);
+      dns_socket = -1; }
+   softap_active = true;
+   if (server == NULL) server = start_webserver();
+   dprint("started access point \"%s\" at %s, DNS socket %d\n", WIFI_AP_SSID, webserver_address, dns_socket); }
+
+void softap_stop(void) { // go back to being only a station
+   if (dns_socket >= 0) close(dns_socket);
+   dns_socket = -1;
+   softap_active = false;
+   esp_wifi_set_mode(WIFI_MODE_STA);
+   dprint("stopped access point\n"); }
+
+void dns_poll(void) { // answer DNS queries with our own address, so every name leads to us
+   byte packet[512];
+   struct sockaddr_in from;
+   socklen_t fromlen = sizeof(from);
+   for (int count = 0; count < 4; ++count) { // (a few at a time)
+      int len = recvfrom(dns_socket, packet, sizeof(packet), MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+      if (len < 12) return; // nothing there, or too short to be a query
+      if ((packet[2] & 0x80) || packet[4] != 0 || packet[5] != 1) continue; // not a query with one question
+      int pos = 12;
+      while (pos < len && packet[pos]) pos += packet[pos] + 1; // skip the name
+      pos += 5; // and its terminator, type, and class
+      if (pos > len || pos + 16 > sizeof(packet)) continue;
+      packet[2] = 0x84 | (packet[2] & 0x01); // response, authoritative, recursion desired as asked
+      packet[3] = 0x80; // recursion available, no error
+      packet[6] = 0; packet[7] = 1; // one answer
+      memset(packet + 8, 0, 4); // no authority or additional records
+      static const byte answer[12] = {
+         0xc0, 0x0c, 0, 1, 0, 1, // the name in the question, type A, class IN
+         0, 0, 0, 60, 0, 4 };    // TTL 60 seconds, 4 bytes of address
+      memcpy(packet + pos, answer, sizeof(answer));
+      memcpy(packet + pos + sizeof(answer), &softap_ip.addr, 4);
+      sendto(dns_socket, packet, pos + 16, 0, (struct sockaddr *)&from, fromlen); } }
+
+esp_err_t captive_portal_handler(httpd_req_t *req, httpd_err_code_t err) {
+   // while our access point is up, send requests for unknown pages to the home page
+   if (!softap_active)
+      return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, NULL);
+   char location[40];
+   snprintf(location, sizeof(location), "http://" IPSTR "/", IP2STR(&softap_ip));
+   httpd_resp_set_status(req, "302 Found");
+   httpd_resp_set_hdr(req, "Location", location);
+   httpd_resp_set_hdr(req, "Connection", "close");
+   httpd_resp_send(req, NULL, 0);
+   return ESP_OK; }
+
+void wifi_reconnect_check(void) { // called periodically from the webserver's idle loop
+   unsigned long waited = millis() - wifi_state_time;
+   if (wifi_power_changed) wifi_apply_power();
+   if (wifi_state != WIFI_CONNECTED) {
+      if (!softap_active && millis() - wifi_down_since >= SOFTAP_START_MSECS) softap_start(); }
+   else if (softap_active && waited >= SOFTAP_STOP_MSECS) softap_stop();
+   if (softap_active && dns_socket >= 0) dns_poll();
+   if (wifi_state == WIFI_WAITING && waited >= wifi_retry_msecs)
+      wifi_try_connect();
+   else if (wifi_state == WIFI_CONNECTING && waited >= WIFI_ATTEMPT_TIMEOUT_MSECS) {
+      dprint("WiFi connect attempt timed out\n");
+      esp_wifi_disconnect(); // (which should also produce a disconnect event)
+      wifi_attempt_failed(); } }
+
 static void event_handler(void* arg, esp_event_base_t event_base,
                           int32_t event_id, void* event_data) {
    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-      esp_wifi_connect(); }
+      wifi_try_connect(); }
+   else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+      wifi_event_sta_connected_t *event = (wifi_event_sta_connected_t *) event_data;
+      memcpy(wifi_ap_bssid, event->bssid, sizeof(wifi_ap_bssid));
+      wifi_ap_channel = event->channel;
+      wifi_have_ap = true; }
    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-      if (s_retry_num < ESP_MAX_RETRY) {
-         esp_wifi_connect();
-         s_retry_num++;
-         dprint("retry to connect to the AP\n"); }
-      else {
-         xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT); }
-      dprint("connect to the AP failed for %s\n", WIFI_SSID); }
+      wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *) event_data;
+      if (wifi_state == WIFI_CONNECTED) { // we lost the connection
+         ++wifi_disconnects;
+         wifi_outage_start = wifi_down_since = millis();
+         wifi_attempts = 0;
+         wifi_retry_msecs = WIFI_RETRY_FIRST_MSECS;
+         dprint("WiFi disconnected from %s, reason %d\n", WIFI_SSID, event->reason);
+         wifi_state = WIFI_WAITING;
+         wifi_state_time = millis() - WIFI_RETRY_FIRST_MSECS; } // (so we retry right away)
+      else if (wifi_state == WIFI_CONNECTING) {
+         dprint("WiFi connect attempt failed for %s, reason %d\n", WIFI_SSID, event->reason);
+         wifi_attempt_failed(); } }
    else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
       ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
+      unsigned long msecs = millis();
       snprintf(webserver_address, sizeof(webserver_address), IPSTR ":%d", IP2STR(&event->ip_info.ip), WIFI_PORT);
-      dprint("our IP address: %s\n", webserver_address);
-      s_retry_num = 0;
-      xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT); } }
+      if (wifi_connects > 0) { // a reconnection
+         wifi_last_outage_msecs = msecs - wifi_outage_start;
+         wifi_total_outage_msecs += wifi_last_outage_msecs;
+         if (wifi_last_outage_msecs > wifi_max_outage_msecs) wifi_max_outage_msecs = wifi_last_outage_msecs; }
+      else wifi_ready_msecs = msecs; // the first connection, for the boot profile
+      dprint("our IP address: %s, after %d attempts, %d msec\n", webserver_address, wifi_attempts,
+             msecs - (wifi_connects > 0 ? wifi_outage_start : 0));
+      ++wifi_connects;
+      ++connect_successes;
+      wifi_attempts = 0;
+      wifi_retry_msecs = WIFI_RETRY_FIRST_MSECS;
+      wifi_state = WIFI_CONNECTED;
+      wifi_state_time = msecs; } }
+
+void wifi_stats_dump(void * parm, void (*print)(void * parm, const char *line, ...)) {
+   print(parm, "WiFi: %ld connections, %ld failed attempts, %ld disconnects, RSSI %d<br>\r\n",
+         wifi_connects, wifi_connectfails, wifi_disconnects, wifi_get_rssi());
+   if (wifi_disconnects > 0)
+      print(parm, "outages: last %lu msec, longest %lu msec, total %lu msec<br><br>\r\n",
+            wifi_last_outage_msecs, wifi_max_outage_msecs, wifi_total_outage_msecs);
+   else print(parm, "<br>\r\n"); }
 
 void wifi_init_sta(void) {
-   s_wifi_event_group = xEventGroupCreate();
    ESP_CHECKERR(esp_netif_init());
    ESP_CHECKERR(esp_event_loop_create_default());
    esp_netif_t *my_sta = esp_netif_create_default_wifi_sta();
+   softap_netif = esp_netif_create_default_wifi_ap(); // (in case we need it)
    #ifdef WIFI_IPADDR // use a static IP address?
    // code from https://www.esp32.com/viewtopic.php?t=14689, approximately
    esp_netif_dhcpc_stop(my_sta);
@@ -524,48 +1591,15 @@ void wifi_init_sta(void) {
                 &event_handler,
                 NULL,
                 &instance_got_ip));
-   wifi_config_t wifi_config = {
-      .sta = {
-         {.ssid = WIFI_SSID },
-         {.password = WIFI_PASSWORD },
-         /* Setting a password implies station will connect to all security modes including WEP/WPA.
-            However these modes are deprecated and not advisable to be used. Incase your Access point
-            doesn't support WPA2, these mode can be enabled by commenting below line */
-         //.threshold.authmode = WIFI_AUTH_WPA2_PSK,
-         .pmf_cfg = {
-            .capable = true,
-            .required = false }, }, };
    ESP_CHECKERR(esp_wifi_set_mode(WIFI_MODE_STA) );
    ESP_CHECKERR(esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
-   ESP_CHECKERR(esp_wifi_start() );
-   /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
-      number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
-   EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
-                                          WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-                                          pdFALSE,
-                                          pdFALSE,
-                                          portMAX_DELAY);
-   /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
-      happened. */
-   if (bits & WIFI_CONNECTED_BIT) {
-      ++connect_successes;
-      dprint("connected to SSID \"%s\" with password \"%s\"\n",
-             WIFI_SSID, WIFI_PASSWORD); }
-   else if (bits & WIFI_FAIL_BIT) {
-      ++connect_failures;
-      dprint("Failed to connect to SSID %s, password %s\n",
-             WIFI_SSID, WIFI_PASSWORD); }
-   else {
-      dprint("UNEXPECTED EVENT\n"); }
-   /* The event will not be processed after unregister */
-   ESP_CHECKERR(esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, instance_got_ip));
-   ESP_CHECKERR(esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, instance_any_id));
-   vEventGroupDelete(s_wifi_event_group); }
+   wifi_down_since = millis();
+   ESP_CHECKERR(esp_wifi_start() ); } // the event handler and wifi_reconnect_check() take it from here
 
 static void disconnect_handler(void* arg, esp_event_base_t event_base,
                                int32_t event_id, void* event_data) {
    httpd_handle_t* server = (httpd_handle_t*) arg;
-   if (*server) {
+   if (*server && !softap_active) { // (our access point still needs it)
       dprint("Stopping webserver\n");
       stop_webserver(*server);
       *server = NULL; } }
@@ -579,7 +1613,12 @@ static void connect_handler(void* arg, esp_event_base_t event_base,
 
 void  webserver_task(void *parm) {
    dprint("CONFIG_HTTPD_MAX_REQ_HDR_LEN = %d\n", CONFIG_HTTPD_MAX_REQ_HDR_LEN);
-   wifi_init_sta();
+   wifi_init_sta(); // (while the controller starts up on the other core)
+   session_init(); // (after the radio is on, so the random numbers are truly random)
+   while (!controller_ready) { // wait until the state we show is valid
+      vTaskDelay(10 / portTICK_PERIOD_MS);
+      wifi_reconnect_check();
+      watchdog_poke(); }
    /* Register event handlers to stop the server when Wi-Fi is disconnected,
       and re-start it upon connection.  */
    ESP_CHECKERR(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &connect_handler, &server));
@@ -589,6 +1628,10 @@ void  webserver_task(void *parm) {
 
    while (1) {// now idle
       vTaskDelay(11 / portTICK_PERIOD_MS);
+      dtrace_flush(); // format debugging output for the serial port, since we have time
+      wifi_reconnect_check();
+      linkhist_add();
+      mqtt_check();
       watchdog_poke(); } }
 
 //*